@@ -0,0 +1,408 @@
+// Closed-loop HTTP load generator
+// Each connection is one thread that sends a request, waits for the whole
+// response, records its latency and sends the next, so offered load follows
+// the server's speed. Requests are drawn from a weighted mix of the clinic's
+// usual traffic: list views, worklist queries, per-patient reads and creates.
+// Run `make load` to start a release build in memory and drive it, or point it
+// at a running server with -p; -z asks for gzip responses.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT 3000
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_DURATION 10
+#define DEFAULT_SEED_PATIENTS 200
+#define MAX_CONNECTIONS 256
+#define MAX_PATIENT_IDS 4096
+#define REQUEST_SIZE 1024
+
+typedef enum {
+    OP_LIST_PATIENTS,
+    OP_LIST_ACTIONS,
+    OP_WORKLIST,
+    OP_PATIENT_ACTIONS,
+    OP_GET_PATIENT,
+    OP_CREATE_ACTION,
+    OP_CREATE_PATIENT,
+    OP_COUNT
+} Operation;
+
+typedef struct {
+    const char *name;
+    int weight;  // share of requests, out of 100
+} OperationMix;
+
+const OperationMix mix[OP_COUNT] = {
+    { "GET /api/patients", 20 },
+    { "GET /api/clinical-actions", 5 },
+    { "GET worklist query", 20 },
+    { "GET patient actions", 25 },
+    { "GET /api/patients/{id}", 15 },
+    { "POST /api/clinical-actions", 12 },
+    { "POST /api/patients", 3 },
+};
+
+const char *const departments[] = { "Pharmacy", "Radiology", "Laboratory", "Nursing", "Cardiology" };
+const char *const statuses[] = { "pending", "in-progress", "completed" };
+
+// Response latencies in nanoseconds, grown as they are recorded
+typedef struct {
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+typedef struct {
+    pthread_t thread;
+    uint64_t random;
+    Samples latencies[OP_COUNT];
+    uint64_t errors;
+} LoadThread;
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t consumed;  // bytes of data taken by the last response
+    size_t body;      // offset of the last response's body, de-chunked in place
+    size_t body_len;
+} Client;
+
+struct sockaddr_in server;
+char patientIds[MAX_PATIENT_IDS][37];
+int patientCount = 0;
+const char *acceptEncoding = "";  // extra header line sent with the mix, "" for identity responses
+volatile int running = 1;
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void samples_add(Samples *samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 4096;
+        samples->samples = realloc(samples->samples, samples->capacity * sizeof(uint64_t));
+        if (!samples->samples) {
+            fprintf(stderr, "Out of memory recording latencies\n");
+            abort();
+        }
+    }
+    samples->samples[samples->count++] = value;
+}
+
+int client_connect(Client *client) {
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) return -1;
+    int opt = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(client->fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+    client->len = 0;
+    client->consumed = 0;
+    return 0;
+}
+
+// Read until at least want bytes are buffered; returns -1 on error or EOF
+int client_fill(Client *client, size_t want) {
+    while (client->len < want) {
+        if (client->cap - client->len < 16384) {
+            client->cap = client->cap ? client->cap * 2 : 65536;
+            client->data = realloc(client->data, client->cap);
+            if (!client->data) {
+                fprintf(stderr, "Out of memory reading response\n");
+                abort();
+            }
+        }
+        ssize_t n = recv(client->fd, client->data + client->len, client->cap - client->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        client->len += n;
+    }
+    return 0;
+}
+
+// Index just past the first delimiter at or after from, reading more as needed; -1 on error
+long client_find(Client *client, size_t from, const char *delimiter) {
+    size_t delimiter_len = strlen(delimiter);
+    for (;;) {
+        if (client->len >= from + delimiter_len) {
+            char *found = memmem(client->data + from, client->len - from, delimiter, delimiter_len);
+            if (found) return found - client->data + delimiter_len;
+        }
+        if (client_fill(client, client->len + 1) < 0) return -1;
+    }
+}
+
+// Send one request and read its response, leaving the body at data + body until the next
+// exchange; returns the status code, or -1 if the connection failed
+int http_exchange(Client *client, const char *request, size_t request_len) {
+    if (client->fd < 0 && client_connect(client) < 0) return -1;
+    memmove(client->data, client->data + client->consumed, client->len - client->consumed);
+    client->len -= client->consumed;
+    client->consumed = 0;
+    size_t sent = 0;
+    while (sent < request_len) {
+        ssize_t n = send(client->fd, request + sent, request_len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    
+    long header_end = client_find(client, 0, "\r\n\r\n");
+    if (header_end < 0) return -1;
+    int status = atoi(client->data + 9);
+    int close_after = 0;
+    long content_length = -1;
+    int chunked = 0;
+    char *headers_end = client->data + header_end - 2;
+    for (char *line = memmem(client->data, header_end, "\r\n", 2) + 2; line < headers_end;
+         line = memmem(line, headers_end + 2 - line, "\r\n", 2) + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) content_length = atol(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding: chunked", 26) == 0) chunked = 1;
+        else if (strncasecmp(line, "Connection: close", 17) == 0) close_after = 1;
+    }
+    
+    client->body = header_end;
+    client->body_len = 0;
+    if (chunked) {
+        // Move each chunk's data down over the framing before it
+        size_t pos = header_end;
+        for (;;) {
+            long line_end = client_find(client, pos, "\r\n");
+            if (line_end < 0) return -1;
+            size_t size = strtoul(client->data + pos, NULL, 16);
+            if (client_fill(client, line_end + size + 2) < 0) return -1;
+            memmove(client->data + client->body + client->body_len, client->data + line_end, size);
+            client->body_len += size;
+            pos = line_end + size + 2;
+            if (size == 0) break;
+        }
+        client->consumed = pos;
+    } else if (content_length >= 0) {
+        client->body_len = content_length;
+        client->consumed = header_end + content_length;
+        if (client_fill(client, client->consumed) < 0) return -1;
+    } else {
+        // Body runs to the end of the connection
+        while (client_fill(client, client->len + 1) == 0) {}
+        client->body_len = client->len - header_end;
+        client->consumed = client->len;
+        close_after = 1;
+    }
+    
+    if (close_after) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    return status;
+}
+
+int format_request(char *request, Operation op, uint64_t *random) {
+    const char *patientId = patientCount ? patientIds[next_random(random) % patientCount] : "";
+    const char *department = departments[next_random(random) % 5];
+    char path[256], body[512] = "";
+    const char *method = "GET";
+    switch (op) {
+        case OP_LIST_PATIENTS: strcpy(path, "/api/patients"); break;
+        case OP_LIST_ACTIONS: strcpy(path, "/api/clinical-actions"); break;
+        case OP_WORKLIST:
+            snprintf(path, sizeof(path), "/api/clinical-actions?assignedTo=%s&status=%s&limit=50", department,
+                     statuses[next_random(random) % 3]);
+            break;
+        case OP_PATIENT_ACTIONS: snprintf(path, sizeof(path), "/api/clinical-actions/patient/%s", patientId); break;
+        case OP_GET_PATIENT: snprintf(path, sizeof(path), "/api/patients/%s", patientId); break;
+        case OP_CREATE_ACTION:
+            method = "POST";
+            strcpy(path, "/api/clinical-actions");
+            snprintf(body, sizeof(body),
+                     "{\"patientId\":\"%s\",\"type\":\"medication\",\"title\":\"Load test order\","
+                     "\"description\":\"Generated by the load generator\",\"assignedTo\":\"%s\","
+                     "\"priority\":\"%s\"}", patientId, department,
+                     (const char *[]){ "high", "medium", "low" }[next_random(random) % 3]);
+            break;
+        default:
+            method = "POST";
+            strcpy(path, "/api/patients");
+            snprintf(body, sizeof(body), "{\"name\":\"Load Patient\",\"age\":%d,\"gender\":\"Female\","
+                     "\"condition\":\"Observation\"}", (int)(next_random(random) % 90) + 1);
+            break;
+    }
+    return snprintf(request, REQUEST_SIZE,
+                    "%s %s HTTP/1.1\r\nHost: localhost\r\n%sContent-Type: application/json\r\n"
+                    "Content-Length: %zu\r\n\r\n%s", method, path, acceptEncoding, strlen(body), body);
+}
+
+void *load_main(void *arg) {
+    LoadThread *load = arg;
+    Client client = { .fd = -1 };
+    char request[REQUEST_SIZE];
+    while (running) {
+        uint32_t pick = next_random(&load->random) % 100;
+        Operation op = 0;
+        while (pick >= (uint32_t)mix[op].weight) pick -= mix[op++].weight;
+        int len = format_request(request, op, &load->random);
+        uint64_t start = now_ns();
+        int status = http_exchange(&client, request, len);
+        uint64_t latency = now_ns() - start;
+        if (status < 200 || status >= 300) {
+            load->errors++;
+            if (status < 0 && client.fd >= 0) {
+                close(client.fd);
+                client.fd = -1;
+            }
+            if (status < 0) usleep(1000);
+            continue;
+        }
+        samples_add(&load->latencies[op], latency);
+    }
+    if (client.fd >= 0) close(client.fd);
+    free(client.data);
+    return NULL;
+}
+
+// Fill patientIds from the server's patient list, creating patients first if there are too few
+int load_patients(int seed) {
+    Client client = { .fd = -1 };
+    char request[REQUEST_SIZE];
+    uint64_t random = now_ns();
+    for (int i = 0; i < seed; i++) {
+        int len = format_request(request, OP_CREATE_PATIENT, &random);
+        if (http_exchange(&client, request, len) < 0) return -1;
+    }
+    
+    const char *list = "GET /api/patients HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (http_exchange(&client, list, strlen(list)) != 200) return -1;
+    char *body = client.data + client.body, *end = body + client.body_len;
+    for (char *p = body; patientCount < MAX_PATIENT_IDS; p += 7 + 36) {
+        p = memmem(p, end - p, "{\"id\":\"", 7);
+        if (!p || p + 7 + 36 > end) break;
+        memcpy(patientIds[patientCount], p + 7, 36);
+        patientIds[patientCount++][36] = '\0';
+    }
+    if (client.fd >= 0) close(client.fd);
+    free(client.data);
+    return patientCount > 0 ? 0 : -1;
+}
+    
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+    
+double percentile_ms(const Samples *samples, double fraction) {
+    if (samples->count == 0) return 0;
+    size_t index = (size_t)(fraction * (samples->count - 1) + 0.5);
+    return samples->samples[index] / 1e6;
+}
+    
+void print_row(const char *name, Samples *samples, double seconds) {
+    qsort(samples->samples, samples->count, sizeof(uint64_t), compare_u64);
+    printf("%-30s %9zu %10.1f %9.3f %9.3f %9.3f\n", name, samples->count, samples->count / seconds,
+           percentile_ms(samples, 0.50), percentile_ms(samples, 0.99), percentile_ms(samples, 0.999));
+}
+    
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-s seed_patients] [-z]\n", program);
+}
+    
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = DEFAULT_PORT, connections = DEFAULT_CONNECTIONS, duration = DEFAULT_DURATION;
+    int seed = DEFAULT_SEED_PATIENTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:d:s:zh")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'z': acceptEncoding = "Accept-Encoding: gzip\r\n"; break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (port <= 0 || connections < 1 || connections > MAX_CONNECTIONS || duration < 1 || seed < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address %s\n", host);
+        return 1;
+    }
+    if (load_patients(seed) < 0) {
+        fprintf(stderr, "Could not load patients from %s:%d\n", host, port);
+        return 1;
+    }
+    
+    printf("Closed-loop load: %d connections for %d s against %s:%d (%d patients)\n\n",
+           connections, duration, host, port, patientCount);
+    LoadThread *threads = calloc(connections, sizeof(LoadThread));
+    if (!threads) {
+        fprintf(stderr, "Out of memory starting connections\n");
+        return 1;
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < connections; i++) {
+        threads[i].random = start + i * 0x9e3779b97f4a7c15ull;
+        if (pthread_create(&threads[i].thread, NULL, load_main, &threads[i]) != 0) {
+            perror("pthread_create failed");
+            return 1;
+        }
+    }
+    sleep(duration);
+    running = 0;
+    for (int i = 0; i < connections; i++) pthread_join(threads[i].thread, NULL);
+    double seconds = (now_ns() - start) / 1e9;
+    
+    // Merge every connection's samples per operation and overall
+    Samples total = {0};
+    uint64_t errors = 0;
+    printf("%-30s %9s %10s %9s %9s %9s\n", "operation", "requests", "req/s", "p50 ms", "p99 ms", "p99.9 ms");
+    for (int op = 0; op < OP_COUNT; op++) {
+        Samples merged = {0};
+        for (int i = 0; i < connections; i++) {
+            Samples *samples = &threads[i].latencies[op];
+            for (size_t k = 0; k < samples->count; k++) {
+                samples_add(&merged, samples->samples[k]);
+                samples_add(&total, samples->samples[k]);
+            }
+        }
+        print_row(mix[op].name, &merged, seconds);
+        free(merged.samples);
+    }
+    for (int i = 0; i < connections; i++) errors += threads[i].errors;
+    print_row("total", &total, seconds);
+    printf("\nerrors: %llu\n", (unsigned long long)errors);
+    return errors ? 2 : 0;
+}
+    
\ No newline at end of file
@@ -0,0 +1,182 @@
+// Microbenchmarks for the serialization, parsing and id generation hot paths
+// Built by `make bench` from workflow.c itself (without its main), so they time
+// exactly the code the server runs. The stores are filled in memory only: no
+// data directory is read or written. Each size grows the stores to that many
+// patients and actions, all actions belonging to one patient, then times:
+//   patients_to_json / actions_to_json / patient_actions_to_json
+//       streaming the whole list in STREAM_CHUNK_SIZE chunks, as stream_fill does
+//   action_to_json (render)
+//       rendering each record's JSON from its stored form, as a cache miss does
+//   parse_action
+//       parsing a typical create body, as handle_create_action does
+//   generate_uuid
+//   deflate (request) / deflate (cached)
+//       compressing the actions list with the per-request and once-per-generation match searches
+#define WORKFLOW_NO_MAIN
+#include "../workflow.c"
+
+#define BENCH_MIN_RECORDS 1000
+#define BENCH_MAX_RECORDS 1000000
+#define BENCH_MIN_OPS 1000000  // small sizes repeat a pass until they reach this many records
+
+const char *benchBody =
+    "{\"patientId\":\"00000000-0000-7000-8000-000000000000\",\"type\":\"medication\","
+    "\"title\":\"Pain Medication\",\"description\":\"Prescribe ibuprofen 400mg every 6 hours for chest pain\","
+    "\"initiatedBy\":\"Dr. Smith\",\"initiatedByDepartment\":\"Doctor\",\"assignedTo\":\"Pharmacy\","
+    "\"priority\":\"high\"}";
+
+const char *const benchDepartments[] = { "Pharmacy", "Radiology", "Laboratory", "Nursing", "Cardiology" };
+
+double elapsed_seconds(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void report(const char *name, uint32_t records, uint64_t ops, double seconds, size_t bytes) {
+    printf("%-28s %8u %12.1f ns/record", name, records, seconds * 1e9 / ops);
+    if (bytes) printf(" %10.1f MB/s", bytes / seconds / 1e6);
+    printf("\n");
+}
+
+// Add patients and actions until both stores hold count records
+void grow_stores(uint32_t count) {
+    write_begin();
+    while (store_count(&patientStore) < count) {
+        Patient *patient = slab_alloc(&patientStore.slab);
+        snprintf(patient->name, sizeof(patient->name), "Patient %u", store_count(&patientStore));
+        patient->age = 20 + store_count(&patientStore) % 70;
+        strcpy(patient->gender, store_count(&patientStore) % 2 ? "Female" : "Male");
+        strcpy(patient->bloodGroup, "O+");
+        strcpy(patient->admissionDate, "2024-01-17");
+        strcpy(patient->condition, "Observation");
+        strcpy(patient->status, "admitted");
+        generate_uuid(&patient->id);
+        index_patient(store_append(&patientStore, patient));
+    }
+    while (store_count(&actionStore) < count) {
+        ClinicalAction action;
+        char error[JSON_ERROR_SIZE];
+        parse_action(benchBody, strlen(benchBody), &action, error);
+        strcpy(action.assignedTo, benchDepartments[store_count(&actionStore) % 5]);
+        generate_uuid(&action.id);
+        action.createdAt = current_timestamp();
+        action.updatedAt = action.createdAt;
+        add_action(&action, 0, 1);
+    }
+    write_end();
+}
+
+typedef void (*ListSerializer)(Buffer *out, JsonStream *stream, size_t limit);
+
+void bench_list(const char *name, ListSerializer serialize, StreamKind kind, uint32_t count, int patient_ref) {
+    Buffer out = {0};
+    uint32_t passes = count >= BENCH_MIN_OPS ? 1 : BENCH_MIN_OPS / count;
+    size_t bytes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_begin();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        JsonStream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.kind = kind;
+        stream.count = count;
+        stream.patient_ref = patient_ref;
+        while (stream.kind != STREAM_NONE) {
+            serialize(&out, &stream, out.len + STREAM_CHUNK_SIZE);
+            bytes += out.len;
+            out.len = 0;
+        }
+    }
+    read_end();
+    report(name, count, (uint64_t)passes * count, elapsed_seconds(&start), bytes);
+    free(out.data);
+}
+
+void bench_render(uint32_t count) {
+    char json[MAX_RECORD_JSON];
+    uint32_t passes = count >= BENCH_MIN_OPS ? 1 : BENCH_MIN_OPS / count;
+    size_t bytes = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_begin();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        for (uint32_t ref = 0; ref < count; ref++) bytes += render_action(ref, get_action(ref), json);
+    }
+    read_end();
+    report("action_to_json (render)", count, (uint64_t)passes * count, elapsed_seconds(&start), bytes);
+}
+
+void bench_parse(uint32_t count) {
+    ClinicalAction action;
+    char error[JSON_ERROR_SIZE];
+    size_t len = strlen(benchBody);
+    int valid = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < count; i++) valid += parse_action(benchBody, len, &action, error);
+    double seconds = elapsed_seconds(&start);
+    if ((uint32_t)valid != count) fprintf(stderr, "parse_action rejected the benchmark body: %s\n", error);
+    report("parse_action", count, count, seconds, (size_t)count * len);
+}
+
+void bench_uuid(uint32_t count) {
+    Uuid id, last;
+    memset(&last, 0, sizeof(last));
+    uint32_t ordered = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < count; i++) {
+        generate_uuid(&id);
+        ordered += memcmp(&id, &last, sizeof(id)) > 0;
+        last = id;
+    }
+    double seconds = elapsed_seconds(&start);
+    if (ordered != count) fprintf(stderr, "generate_uuid produced %u out-of-order ids\n", count - ordered);
+    report("generate_uuid", count, count, seconds, 0);
+}
+
+void bench_deflate(const char *name, uint32_t count, int max_chain) {
+    Buffer plain = {0}, compressed = {0};
+    JsonStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.kind = STREAM_ACTIONS;
+    stream.count = count;
+    read_begin();
+    actions_to_json(&plain, &stream, SIZE_MAX);
+    read_end();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deflate_compress(&compressed, plain.data, plain.len, 1, max_chain);
+    double seconds = elapsed_seconds(&start);
+    report(name, count, count, seconds, plain.len);
+    printf("%-28s %8u %12.1f%% of %zu bytes\n", "", count, 100.0 * compressed.len / plain.len, plain.len);
+    free(plain.data);
+    free(compressed.data);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t max_records = BENCH_MAX_RECORDS;
+    if (argc > 1 && (!parse_count(argv[1], &max_records) || max_records < BENCH_MIN_RECORDS)) {
+        fprintf(stderr, "Usage: %s [max_records (at least %d, default %d)]\n", argv[0], BENCH_MIN_RECORDS,
+                BENCH_MAX_RECORDS);
+        return 1;
+    }
+    persistence = 0;
+    crc32_init();
+    
+    printf("%-28s %8s %12s\n", "benchmark", "records", "time");
+    for (uint32_t count = BENCH_MIN_RECORDS; count <= max_records; count *= 10) {
+        grow_stores(count);
+        bench_list("patients_to_json", patients_to_json, STREAM_PATIENTS, count, -1);
+        bench_list("actions_to_json", actions_to_json, STREAM_ACTIONS, count, -1);
+        bench_list("patient_actions_to_json", patient_actions_to_json, STREAM_PATIENT_ACTIONS, count, 0);
+        bench_render(count);
+        bench_parse(count);
+        bench_uuid(count);
+        bench_deflate("deflate (request)", count, DEFLATE_CHAIN_REQUEST);
+        bench_deflate("deflate (cached)", count, DEFLATE_CHAIN_CACHED);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,712 @@
+// Unit tests, built by `make test` from workflow.c itself (without its main) like the
+// microbenchmarks, so they exercise exactly the code the server runs. The stores live in
+// memory; tests that write files use a temporary data directory that is removed afterwards.
+// Exits non-zero if any check fails.
+#define WORKFLOW_NO_MAIN
+#include "../workflow.c"
+
+int checks = 0, failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+int check(int passed, const char *condition, int line) {
+    checks++;
+    if (!passed) {
+        failures++;
+        fprintf(stderr, "tests/test_workflow.c:%d: check failed: %s\n", line, condition);
+    }
+    return passed;
+}
+
+const char *testPatientBody =
+    "{\"name\":\"Jane Doe\",\"age\":42,\"gender\":\"Female\",\"condition\":\"Observation\","
+    "\"bloodGroup\":\"A+\",\"admissionDate\":\"2024-03-01\"}";
+
+const char *testActionBody =
+    "{\"patientId\":\"00000000-0000-7000-8000-000000000000\",\"type\":\"medication\","
+    "\"title\":\"Pain Medication\",\"description\":\"Prescribe ibuprofen 400mg every 6 hours\","
+    "\"assignedTo\":\"Pharmacy\",\"priority\":\"high\"}";
+
+// Parse body as a patient and check that it fails with an error containing message
+void check_patient_error(const char *body, size_t len, const char *message, int line) {
+    Patient patient;
+    char error[JSON_ERROR_SIZE] = "";
+    int parsed = parse_patient(body, len, &patient, error);
+    check(!parsed && strstr(error, message) != NULL, body, line);
+    if (!parsed && !strstr(error, message)) fprintf(stderr, "    expected \"%s\", got \"%s\"\n", message, error);
+}
+
+#define CHECK_PATIENT_ERROR(body, message) check_patient_error(body, strlen(body), message, __LINE__)
+
+// JSON parsing
+void test_json() {
+    Patient patient;
+    ClinicalAction action;
+    char error[JSON_ERROR_SIZE];
+    
+    CHECK(parse_patient(testPatientBody, strlen(testPatientBody), &patient, error));
+    CHECK(strcmp(patient.name, "Jane Doe") == 0 && patient.age == 42 && strcmp(patient.bloodGroup, "A+") == 0);
+    CHECK(strcmp(patient.status, "admitted") == 0);
+    CHECK(parse_action(testActionBody, strlen(testActionBody), &action, error));
+    CHECK(strcmp(action.assignedTo, "Pharmacy") == 0 && strcmp(action.status, "pending") == 0);
+    CHECK(strcmp(action.initiatedByDepartment, "Doctor") == 0);
+    
+    // Escapes, including a surrogate pair, decode to UTF-8; unknown keys and nulls are skipped
+    const char *escaped =
+        "{\"name\":\"\\\"Q\\\" \\\\ \\/ \\b\\f\\n\\r\\t \\u00e9 \\u20ac \\ud83d\\ude00\",\"age\":1,"
+        "\"gender\":\"X\",\"condition\":\"C\",\"extra\":[1,{\"a\":[true,false,null]},-2.5e3],\"status\":null}";
+    CHECK(parse_patient(escaped, strlen(escaped), &patient, error));
+    CHECK(strcmp(patient.name, "\"Q\" \\ / \b\f\n\r\t \xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80") == 0);
+    CHECK(strcmp(patient.status, "admitted") == 0);
+    
+    // Every truncation of a valid body is rejected
+    size_t len = strlen(testPatientBody);
+    int truncated_rejected = 1;
+    for (size_t i = 0; i < len; i++) truncated_rejected &= !parse_patient(testPatientBody, i, &patient, error);
+    CHECK(truncated_rejected);
+    
+    CHECK_PATIENT_ERROR("", "Expected a JSON object");
+    CHECK_PATIENT_ERROR("[]", "Expected a JSON object");
+    CHECK_PATIENT_ERROR("{\"name\":\"Jane", "Unterminated string");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\\x\"}", "Invalid escape in string");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\\u12\"}", "Invalid unicode escape");
+    CHECK_PATIENT_ERROR("{\"name\":\"\\ud83d\"}", "Unpaired surrogate in string");
+    CHECK_PATIENT_ERROR("{\"name\":\"\\ude00\"}", "Unpaired surrogate in string");
+    CHECK_PATIENT_ERROR("{\"name\":\"\\u0000\"}", "NUL character in string");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\x01\"}", "Control character in string");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\",\"age\":\"42\"}", "Field age must be an integer");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\",\"age\":4.5}", "Field age must be an integer");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\",\"age\":99999999999}", "Field age is out of range");
+    CHECK_PATIENT_ERROR("{\"name\":1}", "Field name must be a string");
+    CHECK_PATIENT_ERROR("{\"gender\":\"abcdefghijk\"}", "Field gender is too long");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\" \"age\":1}", "Expected ',' or '}'");
+    CHECK_PATIENT_ERROR("{\"name\" \"a\"}", "Expected ':'");
+    CHECK_PATIENT_ERROR("{name:\"a\"}", "Expected object key");
+    CHECK_PATIENT_ERROR("{\"x\":tru}", "Invalid JSON value");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\",\"age\":1,\"gender\":\"X\"}", "Field condition is required");
+    CHECK_PATIENT_ERROR("{\"name\":\"a\",\"age\":1,\"gender\":\"X\",\"condition\":\"C\"} {}",
+                        "Unexpected data after JSON object");
+    
+    char deep[2 * JSON_MAX_DEPTH + 16];
+    int n = sprintf(deep, "{\"x\":");
+    for (int i = 0; i < JSON_MAX_DEPTH + 2; i++) deep[n++] = '[';
+    for (int i = 0; i < JSON_MAX_DEPTH + 2; i++) deep[n++] = ']';
+    strcpy(deep + n, "}");
+    CHECK_PATIENT_ERROR(deep, "JSON nested too deeply");
+    
+    char error_body[] = "{\"priority\":\"urgent\"}";
+    CHECK(!parse_action(error_body, strlen(error_body), &action, error));
+}
+
+// Every byte value json_member writes parses back to itself
+void test_json_escapes() {
+    typedef struct {
+        char value[300];
+    } Holder;
+    const JsonField fields[] = { STRING_FIELD(Holder, value, 1) };
+    char value[256], body[256 * 6 + 32], error[JSON_ERROR_SIZE];
+    for (int i = 1; i < 256; i++) value[i - 1] = (char)i;
+    value[255] = '\0';
+    char *end = json_member(body, "{\"value\":", value);
+    *end++ = '}';
+    
+    Holder holder;
+    CHECK(json_parse_record(body, end - body, &holder, fields, 1, error));
+    CHECK(memcmp(holder.value, value, 256) == 0);
+}
+
+void check_parse_error(const char *text, const char *status, int line) {
+    char data[MAX_HEADER_BYTES + 64];
+    size_t len = strlen(text);
+    memcpy(data, text, len);
+    HttpRequest request;
+    memset(&request, 0, sizeof(request));
+    ParseStatus parsed = http_parse_request(&request, data, len);
+    check(parsed == PARSE_ERROR && strcmp(request.error_status, status) == 0, text, line);
+}
+
+#define CHECK_PARSE_ERROR(text, status) check_parse_error(text, status, __LINE__)
+
+// HTTP request parsing
+void test_http() {
+    char data[1024];
+    const char *post =
+        "POST /api/patients?x=1 HTTP/1.1\r\nHost: localhost\r\nContent-Length: 11\r\n\r\n{\"a\":\"bcd\"}";
+    size_t len = strlen(post);
+    memcpy(data, post, len);
+    
+    // Arriving a byte at a time, the request completes with its last byte and not before
+    HttpRequest request;
+    memset(&request, 0, sizeof(request));
+    int early = 0;
+    for (size_t i = 1; i < len; i++) early |= http_parse_request(&request, data, i) != PARSE_INCOMPLETE;
+    CHECK(!early);
+    CHECK(http_parse_request(&request, data, len) == PARSE_DONE);
+    CHECK(view_equals(request.method, "POST") && view_equals(request.path, "/api/patients"));
+    CHECK(view_equals(request.query, "x=1") && view_equals(request.body, "{\"a\":\"bcd\"}"));
+    CHECK(request.total_len == len && request.keep_alive);
+    
+    // Pipelined requests are parsed one after another from the same input
+    const char *pipelined =
+        "GET /api/patients HTTP/1.1\r\n\r\n"
+        "POST /api/patients HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}"
+        "GET /health HTTP/1.0\r\n\r\n";
+    len = strlen(pipelined);
+    memcpy(data, pipelined, len);
+    const char *paths[] = { "/api/patients", "/api/patients", "/health" };
+    size_t offset = 0;
+    for (int i = 0; i < 3; i++) {
+        memset(&request, 0, sizeof(request));
+        CHECK(http_parse_request(&request, data + offset, len - offset) == PARSE_DONE);
+        CHECK(view_equals(request.path, paths[i]));
+        offset += request.total_len;
+    }
+    CHECK(offset == len);
+    CHECK(!request.keep_alive);
+    
+    CHECK_PARSE_ERROR("GET\r\n\r\n", "400 Bad Request");
+    CHECK_PARSE_ERROR("GET / HTTP/2.0\r\n\r\n", "400 Bad Request");
+    CHECK_PARSE_ERROR("GET / HTTP/1.1\r\nNoColon\r\n\r\n", "400 Bad Request");
+    CHECK_PARSE_ERROR("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", "400 Bad Request");
+    CHECK_PARSE_ERROR("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n", "400 Bad Request");
+    CHECK_PARSE_ERROR("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", "411 Length Required");
+    CHECK_PARSE_ERROR("POST / HTTP/1.1\r\nContent-Length: 999999999\r\n\r\n", "413 Payload Too Large");
+    
+    char large[MAX_HEADER_BYTES + 32];
+    int n = sprintf(large, "GET / HTTP/1.1\r\nX-Padding: ");
+    memset(large + n, 'a', MAX_HEADER_BYTES);
+    large[n + MAX_HEADER_BYTES] = '\0';
+    CHECK_PARSE_ERROR(large, "431 Request Header Fields Too Large");
+}
+
+// A patient with one pending action, whose log entries are appended to out
+void test_log_records(Buffer *out, Patient *patient, ClinicalAction *action) {
+    char error[JSON_ERROR_SIZE], patient_id[37];
+    parse_patient(testPatientBody, strlen(testPatientBody), patient, error);
+    generate_uuid(&patient->id);
+    format_uuid(&patient->id, patient_id);
+    parse_action(testActionBody, strlen(testActionBody), action, error);
+    strcpy(action->patientId, patient_id);
+    stamp_action(action);
+    encode_entry(out, WAL_PATIENT, patient);
+    encode_entry(out, WAL_ACTION, action);
+}
+
+int write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return 0;
+    int written = write_all(fd, data, len) == 0;
+    close(fd);
+    return written;
+}
+
+// Log replay
+void test_replay() {
+    char path[4096];
+    storage_path(path, sizeof(path), "wal", 1, ".log");
+    Patient patient;
+    ClinicalAction action;
+    int complete;
+    
+    // A torn tail is reported, and the entries before it are applied
+    Buffer log = {0};
+    test_log_records(&log, &patient, &action);
+    size_t valid = log.len;
+    Patient torn;
+    ClinicalAction torn_action;
+    test_log_records(&log, &torn, &torn_action);
+    CHECK(write_file(path, log.data, valid + 20));
+    write_begin();
+    CHECK(replay_file(path, 0, 1, &complete) == valid);
+    write_end();
+    CHECK(!complete);
+    CHECK(index_lookup(&patientIndex, &patient.id) >= 0);
+    CHECK(index_lookup(&actionIndex, &action.id) >= 0);
+    CHECK(index_lookup(&patientIndex, &torn.id) < 0);
+    
+    // A checksum mismatch ends the replay at the damaged entry
+    log.len = 0;
+    test_log_records(&log, &patient, &action);
+    size_t first = get_u32((const uint8_t *)log.data) + WAL_ENTRY_HEADER;
+    log.data[log.len - 1] ^= 0x40;
+    CHECK(write_file(path, log.data, log.len));
+    write_begin();
+    CHECK(replay_file(path, 0, 1, &complete) == first);
+    write_end();
+    CHECK(!complete);
+    CHECK(index_lookup(&patientIndex, &patient.id) >= 0);
+    CHECK(index_lookup(&actionIndex, &action.id) < 0);
+    
+    // An intact entry that no longer applies is skipped, and replay goes on past it
+    log.len = 0;
+    ClinicalAction missing = action;
+    generate_uuid(&missing.id);
+    strcpy(missing.status, "completed");
+    encode_entry(&log, WAL_ACTION_STATUS, &missing);
+    test_log_records(&log, &patient, &action);
+    strcpy(patient.status, "discharged");
+    encode_entry(&log, WAL_PATIENT_STATUS, &patient);
+    CHECK(write_file(path, log.data, log.len));
+    write_begin();
+    CHECK(replay_file(path, 0, 1, &complete) == log.len);
+    write_end();
+    CHECK(complete);
+    int ref = index_lookup(&patientIndex, &patient.id);
+    CHECK(ref >= 0 && strcmp(get_patient(ref)->status, "discharged") == 0);
+    CHECK(index_lookup(&actionIndex, &action.id) >= 0);
+    
+    free(log.data);
+    unlink(path);
+}
+
+// A worker without its thread, listening on a loopback port; events are fed to it by hand
+Worker *test_worker(struct sockaddr_in *address) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    socklen_t len = sizeof(*address);
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr *)address, len) < 0 || listen(listener, 16) < 0 ||
+        getsockname(listener, (struct sockaddr *)address, &len) < 0 || init_worker(&workers[0], 0, listener) < 0) {
+        perror("Creating test worker failed");
+        exit(1);
+    }
+    return &workers[0];
+}
+
+// Connect a client and accept it on the worker; returns the client's socket
+int test_connect(Worker *worker, const struct sockaddr_in *address, Connection **conn) {
+    int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client < 0 || connect(client, (const struct sockaddr *)address, sizeof(*address)) < 0) {
+        perror("Connecting test client failed");
+        exit(1);
+    }
+    accept_connections(worker);
+    *conn = worker->idle_head.prev;
+    return client;
+}
+
+// Read what the server sent until it closes the connection
+size_t read_until_closed(int fd, char *data, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+    while (len + 1 < size && (n = read(fd, data + len, size - 1 - len)) > 0) len += n;
+    data[len] = '\0';
+    return len;
+}
+
+// Status changes reuse the patient slots they replace instead of growing the slab
+void test_patient_slots() {
+    Patient patient;
+    char error[JSON_ERROR_SIZE];
+    parse_patient(testPatientBody, strlen(testPatientBody), &patient, error);
+    generate_uuid(&patient.id);
+    write_begin();
+    Patient *stored = slab_alloc(&patientStore.slab);
+    *stored = patient;
+    uint32_t ref = store_append(&patientStore, stored);
+    index_patient(ref);
+    update_patient_status(ref, "discharged");
+    write_end();
+    
+    size_t chunks = patientStore.slab.chunk_count, used = patientStore.slab.chunk_used;
+    for (int i = 0; i < 10000; i++) {
+        write_begin();
+        update_patient_status(ref, i % 2 ? "discharged" : "admitted");
+        write_end();
+    }
+    CHECK(patientStore.slab.chunk_count == chunks && patientStore.slab.chunk_used == used);
+    CHECK(strcmp(get_patient(ref)->status, "admitted") != 0 && memcmp(&get_patient(ref)->id, &patient.id, 16) == 0);
+    CHECK(strcmp(get_patient(ref)->name, patient.name) == 0);
+    
+    // A reader's section keeps the copy it may hold alive until it ends
+    read_begin();
+    const Patient *held = get_patient(ref);
+    write_begin();
+    update_patient_status(ref, "transferred");
+    write_end();
+    write_begin();
+    update_patient_status(ref, "admitted");
+    write_end();
+    CHECK(strcmp(held->status, "discharged") == 0 && memcmp(&held->id, &patient.id, 16) == 0);
+    read_end();
+}
+
+// Event batches
+void test_event_batches() {
+    struct sockaddr_in address;
+    Worker *worker = test_worker(&address);
+    Connection *conn;
+    char request[512], response[4096];
+    
+    // A held response is released by a wake that closes its connection, while the connection's own
+    // event is still queued later in the same batch
+    int client = test_connect(worker, &address, &conn);
+    int n = snprintf(request, sizeof(request),
+                     "POST /api/patients HTTP/1.1\r\nConnection: close\r\nContent-Length: %zu\r\n\r\n%s",
+                     strlen(testPatientBody), testPatientBody);
+    CHECK(write(client, request, n) == n);
+    shutdown(client, SHUT_WR);
+    persistence = 1;
+    handle_connection_event(conn, EPOLLIN | EPOLLRDHUP);
+    persistence = 0;
+    CHECK(conn->wait_lsn != 0 && !conn->closed);
+    
+    __atomic_store_n(&wal.durable_lsn, wal.appended_lsn, __ATOMIC_SEQ_CST);
+    struct epoll_event events[2] = { { .events = EPOLLIN }, { .events = EPOLLIN | EPOLLRDHUP } };
+    events[0].data.ptr = worker;
+    events[1].data.ptr = conn;
+    handle_events(worker, events, 2);
+    CHECK(conn->closed && worker->closed == conn);
+    free_closed_connections(worker);
+    CHECK(worker->closed == NULL);
+    read_until_closed(client, response, sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0 && strstr(response, "Patient created") != NULL);
+    close(client);
+    wal.pending.len = 0;
+    
+    // A subscriber that stopped reading is dropped by the wake that delivers events to it, while
+    // its own event is still queued later in the same batch
+    client = test_connect(worker, &address, &conn);
+    n = snprintf(request, sizeof(request), "GET /api/events HTTP/1.1\r\n\r\n");
+    CHECK(write(client, request, n) == n);
+    handle_connection_event(conn, EPOLLIN);
+    CHECK(conn->subscription.active && worker->subscribers == 1);
+    buffer_reserve(&conn->out, OUTPUT_HIGH_WATER + 1);
+    conn->out.len = conn->out_sent + OUTPUT_HIGH_WATER + 1;
+    events[1].data.ptr = conn;
+    handle_events(worker, events, 2);
+    CHECK(conn->closed && worker->closed == conn && worker->subscribers == 0);
+    send_heartbeats(worker);
+    free_closed_connections(worker);
+    CHECK(read_until_closed(client, response, sizeof(response)) > 0);
+    close(client);
+}
+
+// Send one request on a fresh connection, handle it and read the whole response
+void test_exchange(Worker *worker, const struct sockaddr_in *address, const char *request, char *response,
+                   size_t size) {
+    Connection *conn;
+    int client = test_connect(worker, address, &conn);
+    ssize_t len = (ssize_t)strlen(request);
+    CHECK(write(client, request, len) == len);
+    shutdown(client, SHUT_WR);
+    handle_connection_event(conn, EPOLLIN | EPOLLRDHUP);
+    free_closed_connections(worker);
+    read_until_closed(client, response, size);
+    close(client);
+}
+
+// Routes answer methods they do not accept with 405 and the methods they do
+void test_methods() {
+    struct sockaddr_in address;
+    Worker *worker = test_worker(&address);
+    char id[37], request[256], response[8192];
+    format_uuid(&get_action(0)->id, id);  // an action replayed by test_replay
+    
+    snprintf(request, sizeof(request), "GET /api/clinical-actions/%s HTTP/1.1\r\n\r\n", id);
+    test_exchange(worker, &address, request, response, sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0 && strstr(response, id) != NULL);
+    snprintf(request, sizeof(request), "DELETE /api/clinical-actions/%s HTTP/1.1\r\n\r\n", id);
+    test_exchange(worker, &address, request, response, sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 405", 12) == 0 && strstr(response, "\r\nAllow: GET, OPTIONS\r\n") != NULL);
+    CHECK(index_lookup(&actionIndex, &get_action(0)->id) == 0);
+    
+    const char *const get_only[] = { "/", "/api/stats", "/api/search?q=pain", "/api/changes", "/api/storage",
+                                     "/metrics", "/api/events", "/api/patients/x" };
+    for (size_t i = 0; i < sizeof(get_only) / sizeof(get_only[0]); i++) {
+        snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}", get_only[i]);
+        test_exchange(worker, &address, request, response, sizeof(response));
+        check(strncmp(response, "HTTP/1.1 405", 12) == 0 && strstr(response, "Allow: GET, OPTIONS"), get_only[i],
+              __LINE__);
+    }
+    snprintf(request, sizeof(request), "PUT /api/clinical-actions/patient/%s HTTP/1.1\r\n\r\n", id);
+    test_exchange(worker, &address, request, response, sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 405", 12) == 0);
+}
+
+// Department queues: a peek reads the published top without write_lock, a claim pops it
+void test_department_next() {
+    struct sockaddr_in address;
+    Worker *worker = test_worker(&address);
+    char response[8192], peeked[37], claimed[37];
+    
+    // Held by this thread, write_lock would deadlock a peek that took it; the alarm ends such a run
+    alarm(10);
+    write_begin();
+    test_exchange(worker, &address, "GET /api/departments/Pharmacy/next HTTP/1.1\r\n\r\n", response, sizeof(response));
+    write_end();
+    alarm(0);
+    const char *id = strstr(response, "{\"id\":\"");
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0 && id && strstr(response, "\"status\":\"pending\""));
+    snprintf(peeked, sizeof(peeked), "%s", id ? id + 7 : "");
+    
+    test_exchange(worker, &address, "POST /api/departments/Pharmacy/next HTTP/1.1\r\n\r\n", response, sizeof(response));
+    id = strstr(response, "{\"id\":\"");
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0 && id && strstr(response, "\"status\":\"in-progress\""));
+    snprintf(claimed, sizeof(claimed), "%s", id ? id + 7 : "");
+    CHECK(strcmp(peeked, claimed) == 0);
+    
+    test_exchange(worker, &address, "GET /api/departments/Pharmacy/next HTTP/1.1\r\n\r\n", response, sizeof(response));
+    CHECK(strstr(response, claimed) == NULL);
+    test_exchange(worker, &address, "GET /api/departments/Nowhere/next HTTP/1.1\r\n\r\n", response, sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 404", 12) == 0);
+}
+
+// Worklist queries: pages are arrays, chained by the id in X-Next-Cursor
+void test_action_pages() {
+    struct sockaddr_in address;
+    Worker *worker = test_worker(&address);
+    char request[256], response[65536], all[65536], cursor[37] = "";
+    
+    test_exchange(worker, &address, "GET /api/clinical-actions?assignedTo=Pharmacy&limit=1000 HTTP/1.1\r\n\r\n", all,
+                  sizeof(all));
+    const char *body = strstr(all, "\r\n\r\n");
+    CHECK(body && body[4] == '[' && strstr(all, "X-Next-Cursor") == NULL);
+    
+    // Following the cursor one at a time visits every action of the full result once, in order
+    int pages = 0, in_order = 1;
+    const char *expected = body ? strstr(body, "{\"id\":\"") : NULL;
+    do {
+        snprintf(request, sizeof(request), "GET /api/clinical-actions?assignedTo=Pharmacy&limit=1%s%s HTTP/1.1\r\n\r\n",
+                 cursor[0] ? "&cursor=" : "", cursor);
+        test_exchange(worker, &address, request, response, sizeof(response));
+        const char *page = strstr(response, "\r\n\r\n");
+        in_order &= page && page[4] == '[';
+        for (const char *id = page ? strstr(page, "{\"id\":\"") : NULL; id; id = strstr(id + 1, "{\"id\":\"")) {
+            in_order &= expected && strncmp(id, expected, 44) == 0;
+            expected = expected ? strstr(expected + 1, "{\"id\":\"") : NULL;
+        }
+        const char *next = strstr(response, "X-Next-Cursor: ");
+        snprintf(cursor, sizeof(cursor), "%s", next ? next + 15 : "");
+        pages++;
+    } while (cursor[0] && pages < 100);
+    CHECK(in_order && expected == NULL && pages > 1);
+    
+    test_exchange(worker, &address, "GET /api/clinical-actions?status=pending&cursor=12 HTTP/1.1\r\n\r\n", response,
+                  sizeof(response));
+    CHECK(strncmp(response, "HTTP/1.1 400", 12) == 0);
+}
+
+// Deflate with gzip and zlib framing
+void test_compress_body() {
+    Buffer plain = {0}, body = {0}, inflated = {0};
+    for (int i = 0; i < 2000; i++) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "{\"id\":%d,\"name\":\"Patient %d\",\"status\":\"%s\"},", i, i * 7,
+                         i % 3 ? "admitted" : "discharged");
+        buffer_append(&plain, line, n);
+    }
+    
+    compress_body(&body, ENCODING_GZIP, plain.data, plain.len, DEFLATE_CHAIN_REQUEST);
+    const uint8_t *gzip = (const uint8_t *)body.data;
+    CHECK(body.len > 18 && gzip[0] == 0x1f && gzip[1] == 0x8b && gzip[2] == 8);
+    CHECK(inflate_stream(&inflated, gzip + 10, body.len - 18));
+    CHECK(inflated.len == plain.len && memcmp(inflated.data, plain.data, plain.len) == 0);
+    CHECK(get_u32(gzip + body.len - 8) == crc32_update(0, plain.data, plain.len));
+    CHECK(get_u32(gzip + body.len - 4) == plain.len);
+    
+    body.len = inflated.len = 0;
+    compress_body(&body, ENCODING_DEFLATE, plain.data, plain.len, DEFLATE_CHAIN_CACHED);
+    const uint8_t *zlib = (const uint8_t *)body.data;
+    CHECK(body.len > 6 && (zlib[0] << 8 | zlib[1]) % 31 == 0);
+    CHECK(inflate_stream(&inflated, zlib + 2, body.len - 6));
+    CHECK(inflated.len == plain.len && memcmp(inflated.data, plain.data, plain.len) == 0);
+    CHECK(__builtin_bswap32(get_u32(zlib + body.len - 4)) == adler32_update(1, plain.data, plain.len));
+    
+    // A stream cut short anywhere is rejected
+    int truncated_rejected = 1;
+    for (size_t i = 0; i < body.len - 6; i++) {
+        inflated.len = 0;
+        truncated_rejected &= !inflate_stream(&inflated, zlib + 2, i);
+    }
+    CHECK(truncated_rejected);
+    
+    free(plain.data);
+    free(body.data);
+    free(inflated.data);
+}
+
+// Compress data as one final stream, or in chunks of chunk bytes each ended by a sync flush,
+// and check that it inflates back; returns the type of the stream's first block
+int check_deflate(const uint8_t *data, size_t len, size_t chunk, int line) {
+    Buffer compressed = {0}, inflated = {0};
+    size_t offset = 0;
+    while (chunk && offset < len) {
+        size_t n = len - offset < chunk ? len - offset : chunk;
+        deflate_compress(&compressed, (const char *)data + offset, n, 0, DEFLATE_CHAIN_REQUEST);
+        // A sync flush ends with an empty stored block
+        check(compressed.len >= 4 && memcmp(compressed.data + compressed.len - 4, "\x00\x00\xff\xff", 4) == 0,
+              "sync flush", line);
+        offset += n;
+    }
+    deflate_compress(&compressed, (const char *)data + offset, len - offset, 1, DEFLATE_CHAIN_CACHED);
+    int type = compressed.len ? ((uint8_t)compressed.data[0] >> 1) & 3 : -1;
+    int ok = inflate_stream(&inflated, (const uint8_t *)compressed.data, compressed.len);
+    check(ok && inflated.len == len && (len == 0 || memcmp(inflated.data, data, len) == 0), "deflate round-trip", line);
+    free(compressed.data);
+    free(inflated.data);
+    return type;
+}
+
+#define CHECK_DEFLATE(data, len, chunk) check_deflate(data, len, chunk, __LINE__)
+
+// Deflate round-trips over every byte value, through each block type the inflater reads
+void test_deflate_blocks() {
+    uint8_t bytes[256];
+    for (int i = 0; i < 256; i++) bytes[i] = (uint8_t)i;
+    
+    // Short inputs go out as fixed Huffman blocks
+    int fixed = 1;
+    for (int i = 0; i < 256; i++) fixed &= CHECK_DEFLATE(bytes + i, 1, 0) == 1;
+    CHECK(fixed);
+    CHECK(CHECK_DEFLATE((const uint8_t *)"abcabcabcabc", 12, 0) == 1);
+    CHECK_DEFLATE(bytes, 256, 0);
+    CHECK_DEFLATE(bytes, 0, 0);
+    
+    // Long skewed inputs get dynamic codes, over several blocks; noise leaves few matches
+    size_t len = 256 * 1024;
+    uint8_t *data = malloc(len);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = i % 7 == 0 ? (uint8_t)(seed >> 16) : (uint8_t)"aaaabbbcde"[(seed >> 16) % 10];
+    }
+    CHECK(CHECK_DEFLATE(data, len, 0) == 2);
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    CHECK_DEFLATE(data, len, 0);
+    
+    // Streamed in chunks, each ended by an empty stored block
+    CHECK_DEFLATE(data, len, 1000);
+    CHECK_DEFLATE(bytes, 256, 1);
+    
+    // Stored blocks with data, as other encoders write them
+    uint8_t stored[2 * (5 + 256)];
+    Buffer inflated = {0};
+    for (int block = 0; block < 2; block++) {
+        uint8_t *p = stored + block * (5 + 256);
+        p[0] = (uint8_t)block;  // final bit on the second block
+        p[1] = 0x00;
+        p[2] = 0x01;
+        p[3] = 0xff;
+        p[4] = 0xfe;
+        memcpy(p + 5, bytes, 256);
+    }
+    CHECK(inflate_stream(&inflated, stored, sizeof(stored)));
+    CHECK(inflated.len == 512 && memcmp(inflated.data, bytes, 256) == 0 && memcmp(inflated.data + 256, bytes, 256) == 0);
+    stored[4] ^= 1;
+    inflated.len = 0;
+    CHECK(!inflate_stream(&inflated, stored, sizeof(stored)));
+    
+    free(data);
+    free(inflated.data);
+}
+
+// Archive segments
+void test_archive() {
+    Patient patient;
+    ClinicalAction action;
+    char error[JSON_ERROR_SIZE], json[MAX_RECORD_JSON];
+    Uuid ids[3];
+    
+    // Three discharged patients whose actions are all completed, and one still admitted
+    write_begin();
+    for (int i = 0; i < 4; i++) {
+        parse_patient(testPatientBody, strlen(testPatientBody), &patient, error);
+        snprintf(patient.name, sizeof(patient.name), "Archived \"%d\" \xc3\xa9", i);
+        generate_uuid(&patient.id);
+        Patient *stored = slab_alloc(&patientStore.slab);
+        *stored = patient;
+        uint32_t ref = store_append(&patientStore, stored);
+        index_patient(ref);
+        for (int k = 0; k < i + 1; k++) {
+            parse_action(testActionBody, strlen(testActionBody), &action, error);
+            format_uuid(&patient.id, action.patientId);
+            snprintf(action.title, sizeof(action.title), "Action %d of %d", k, i);
+            stamp_action(&action);
+            int action_ref = add_action(&action, ref, 1);
+            update_action_status(action_ref, STATUS_COMPLETED, action.updatedAt);
+        }
+        if (i < 3) {
+            update_patient_status(ref, "discharged");
+            ids[i] = patient.id;
+        }
+    }
+    write_end();
+    
+    CHECK(archive_freeze(INT64_MAX) == 3);
+    uint32_t patients = store_count(&patientStore);
+    CHECK(archive_write(7, patients) == 3);
+    
+    ArchivedPatient found;
+    for (int i = 0; i < 3; i++) {
+        CHECK(archive_lookup(&ids[i], &found));
+        int ref = index_lookup(&patientIndex, &ids[i]);
+        int len = render_patient(ref, get_patient(ref), json);
+        CHECK(found.len == (uint32_t)len && memcmp(found.json, json, len) == 0);
+        CHECK(found.action_count == (uint32_t)i + 1);
+        
+        ActionList *list = *patient_action_list(ref);
+        const uint8_t *p = found.actions;
+        for (uint32_t k = 0; k < found.action_count && k < list->count; k++) {
+            const ActionRecord *record = get_action(list->refs[k]);
+            len = render_action(list->refs[k], record, json);
+            CHECK((int64_t)get_u64(p) == record->createdAt && get_u32(p + 8) == (uint32_t)len);
+            CHECK(memcmp(p + 12, json, len) == 0);
+            p += 12 + get_u32(p + 8);
+        }
+    }
+    CHECK(!archive_lookup(&patient.id, &found));
+    
+    // Unfiltered scans step over the frozen patients and actions to the hot ones around them
+    read_begin();
+    uint32_t actions = store_count(&actionStore), refs[64];
+    uint32_t listed = bitmap_query(NULL, 0, 0, actions, refs, 64);
+    CHECK(listed > 0);
+    for (uint32_t i = 0; i < listed; i++) CHECK(!action_archived(refs[i]));
+    CHECK(refs[listed - 1] == actions - 1);
+    SharedBytes *list = render_list(&patientStore, 0);
+    for (int i = 0; i < 3; i++) {
+        char id[37];
+        format_uuid(&ids[i], id);
+        CHECK(!memmem(list->data, list->len, id, 36));
+        CHECK(bitmap_next(&hotPatients, index_lookup(&patientIndex, &ids[i]), patients) == patients - 1);
+    }
+    read_end();
+    shared_bytes_release(list);
+    
+    char path[4096];
+    storage_path(path, sizeof(path), "archive", 7, ".arc");
+    unlink(path);
+}
+
+int main() {
+    persistence = 0;
+    crc32_init();
+    char dir[] = "/tmp/workflow-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("Creating test data directory failed");
+        return 1;
+    }
+    data_dir = dir;
+    
+    test_json();
+    test_json_escapes();
+    test_http();
+    test_replay();
+    test_patient_slots();
+    test_event_batches();
+    test_methods();
+    test_department_next();
+    test_action_pages();
+    test_compress_body();
+    test_deflate_blocks();
+    test_archive();
+    
+    rmdir(dir);
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -1,20 +1,102 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
-#define MAX_PATIENTS 100
-#define MAX_ACTIONS 500
 #define BUFFER_SIZE 8192
 #define PORT 3000
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_IDLE_TIMEOUT 15
+#define MAX_EVENTS 256
+#define OUTPUT_HIGH_WATER (256 * 1024)
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define MAX_RECORD_JSON 8192
+#define MAX_HEADER_BYTES (16 * 1024)
+#define MAX_HEADERS 32
+#define MAX_REQUEST_BODY (16 * 1024 * 1024)
+#define MAX_SPLICES 8
+#define MAX_BULK_LINE 4096
+#define BULK_BATCH_LINES 512
+#define BULK_BUFFER_BYTES (64 * 1024)
+#define MAX_BULK_ERRORS 100
+#define EVENT_RING_SIZE 4096
+#define CHANGE_LOG_SIZE 65536
+#define CHANGES_DEFAULT_LIMIT 1000
+#define CHANGES_MAX_LIMIT 10000
+#define LATENCY_BUCKETS 50
+#define ACCESS_LOG_SLOTS 4096
+#define ACCESS_LOG_LINE 256
+#define MAX_QUERY_VALUE 128
+#define BITMAP_BLOCK_WORDS 1024
+#define BITMAP_BLOCK_BITS (BITMAP_BLOCK_WORDS * 64)
+#define DEFAULT_PAGE_LIMIT 50
+#define MAX_PAGE_LIMIT 1000
+#define SEARCH_MAX_TERM 32
+#define SEARCH_MAX_QUERY_TERMS 8
+#define SEARCH_MAX_EXPANSIONS 128
+#define SEARCH_TAIL_TERMS 4096
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 100
+#define LIST_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define COMPRESS_MIN_BYTES 1024
+#define DEFLATE_CHAIN_CACHED 256
+#define DEFLATE_CHAIN_REQUEST 16
+#define MAX_WORKERS 64
+#define MAX_READER_THREADS 128
+#define INITIAL_INDEX_CAPACITY 64
+#define INITIAL_ACTION_LIST_CAPACITY 4
+#define SEGMENT_BASE_BITS 10
+#define SEGMENT_BASE (1u << SEGMENT_BASE_BITS)
+#define SEGMENT_DIRECTORY_SIZE 23
+#define SLAB_CHUNK_SIZE (1024 * 1024)
+#define DEFAULT_DATA_DIR "data"
+#define WAL_ENTRY_HEADER 9
+#define SNAPSHOT_HEADER 24
+#define SNAPSHOT_WAL_BYTES (64 * 1024 * 1024)
+#define SNAPSHOT_INTERVAL 300
+#define ARCHIVE_HEADER 40
+#define ARCHIVE_INDEX_ENTRY 36
+#define ARCHIVE_BLOCK_BYTES (64 * 1024)
+#define ARCHIVE_BLOOM_BITS 10  // per patient
+#define ARCHIVE_BLOOM_HASHES 7
+#define ARCHIVE_AGE_DAYS 30
+#define ARCHIVE_INTERVAL 3600
+#define ARCHIVE_FREEZE_BATCH 1024
+#define VOCABULARY_SLOTS 2048
+#define MAX_VOCABULARY_CODES 1024
+#define VOCABULARY_OVERFLOW 0xffff  // the name is kept with the record instead
+#define STRING_HEAP_CHUNK_SIZE (1024 * 1024)
 
 // Data structures
+// Record ids are 16 binary bytes, shown as 8-4-4-4-12 hex text
 typedef struct {
-    char id[37];
+    uint8_t bytes[16];
+} Uuid;
+
+typedef struct {
+    Uuid id;
     char name[100];
     int age;
     char gender[10];
@@ -24,8 +106,11 @@ typedef struct {
     char status[20];
 } Patient;
 
+// A clinical action as the API and the log see it. Request bodies are parsed into this
+// form and log entries decoded into it; stored actions are kept compact (ActionRecord)
+// and expanded back into it to be rendered or logged.
 typedef struct {
-    char id[37];
+    Uuid id;
     char patientId[37];
     char type[20];
     char title[100];
@@ -35,240 +120,4659 @@ typedef struct {
     char assignedTo[20];
     char status[20];
     char priority[10];
-    char createdAt[25];
-    char updatedAt[25];
+    int64_t createdAt;  // seconds since 1970-01-01T00:00:00 in local wall-clock time
+    int64_t updatedAt;
 } ClinicalAction;
 
+// Closed vocabularies are fixed codes; priority codes are also the queue order
+typedef enum {
+    STATUS_PENDING,
+    STATUS_IN_PROGRESS,
+    STATUS_COMPLETED,
+    STATUS_COUNT
+} ActionStatus;
+
+typedef enum {
+    PRIORITY_HIGH,
+    PRIORITY_MEDIUM,
+    PRIORITY_LOW,
+    PRIORITY_COUNT
+} ActionPriority;
+
+const char *const statusNames[STATUS_COUNT] = { "pending", "in-progress", "completed" };
+const char *const priorityNames[PRIORITY_COUNT] = { "high", "medium", "low" };
+
+// Stored clinical action: the fields that never change once it is written.
+// Free text lives in the string heap and department and type names are
+// vocabulary codes; status, priority, assignee, patient and updatedAt live in
+// the action columns, where filters and status changes touch only them. A type
+// or initiating department without a code is VOCABULARY_OVERFLOW, and both
+// names then follow initiatedBy's terminating NUL in the heap.
+typedef struct {
+    Uuid id;
+    int64_t createdAt;
+    const char *title;
+    const char *description;
+    const char *initiatedBy;
+    uint16_t type;
+    uint16_t initiatedByDepartment;
+} ActionRecord;
+
+// Segmented arrays
+// Segment k holds SEGMENT_BASE << k pointer slots and is never moved once
+// allocated, so growing the array leaves existing slots in place.
+typedef struct {
+    void **segments[SEGMENT_DIRECTORY_SIZE];
+    uint32_t segment_count;
+} SegmentedArray;
+
+// Slab allocator for fixed-size records
+// Records are carved out of SLAB_CHUNK_SIZE chunks, one record per
+// allocation, so millions of them cost neither per-record malloc overhead
+// nor heap fragmentation. Records replaced by a copy are retired back to the
+// slab and handed out again before new ones are carved.
+typedef struct SlabChunk {
+    struct SlabChunk *next;
+    char data[];
+} SlabChunk;
+
+typedef struct {
+    size_t record_size;
+    SlabChunk *chunks;
+    size_t chunk_used;  // bytes handed out from the newest chunk
+    size_t chunk_count;
+    void *released;     // records given back by any thread, linked through their first bytes
+    void *reusable;     // records taken over from released, for slab_alloc only
+} Slab;
+
+// Dense columns
+// One fixed-width value per record, segmented like SegmentedArray so values
+// never move as the column grows. Scans over a column read only that field,
+// packed contiguously, instead of striding across whole records.
+typedef struct {
+    char *segments[SEGMENT_DIRECTORY_SIZE];
+    uint32_t segment_count;
+    uint32_t width;  // bytes per value
+} Column;
+
+// String heap
+// Long text is copied once into append-only chunks and referenced by pointer.
+// Stored text never changes, so it is never moved or freed.
+typedef struct StringChunk {
+    struct StringChunk *next;
+    char data[];
+} StringChunk;
+
+typedef struct {
+    StringChunk *chunks;
+    size_t chunk_used;
+    size_t chunk_count;
+} StringHeap;
+
+// Interned strings
+// Open vocabularies (department and action type names) keep each distinct
+// value once and name it by a 16-bit code. Codes are only ever added: readers
+// map codes to names and names to codes without locking, and writers intern
+// new names under write_lock. Names come from clients, so each vocabulary
+// holds at most MAX_VOCABULARY_CODES of them.
+typedef struct {
+    SegmentedArray names;              // char * per code
+    uint32_t count;
+    uint16_t slots[VOCABULARY_SLOTS];  // code + 1 by name hash, 0 when empty
+} Vocabulary;
+
+// Serialized JSON of one record, rendered when the record is written (or, for
+// records recovered from disk, on first use)
+typedef struct {
+    uint32_t len;
+    char data[];
+} Fragment;
+
 // Global data storage
-Patient patients[MAX_PATIENTS];
-ClinicalAction clinicalActions[MAX_ACTIONS];
-int patientCount = 0;
-int actionCount = 0;
+// Record stores are append-only: a writer fills a slab record, places it in
+// the next slot and publishes it by release-storing the new count. Readers
+// acquire-load the count once and treat [0, count) as their snapshot, so they
+// never take a lock. Neither slots nor records move as the stores grow.
+// Every write bumps the store generation after publishing.
+typedef struct {
+    SegmentedArray slots;
+    SegmentedArray fragments;  // Fragment * per record
+    Slab slab;
+    uint32_t count;
+    uint64_t generation;
+    size_t fragment_bytes;
+    int (*render)(uint32_t ref, const void *record, char *json);
+} RecordStore;
+
+int render_patient(uint32_t ref, const void *record, char *json);
+int render_action(uint32_t ref, const void *record, char *json);
+
+RecordStore patientStore = { .slab = { .record_size = sizeof(Patient) }, .render = render_patient };
+RecordStore actionStore = { .slab = { .record_size = sizeof(ActionRecord) }, .render = render_action };
+
+// Action columns, indexed like actionStore; status and updatedAt change in place
+Column actionStatus = { .width = sizeof(uint8_t) };      // ActionStatus
+Column actionPriority = { .width = sizeof(uint8_t) };    // ActionPriority
+Column actionAssignee = { .width = sizeof(uint16_t) };   // departments code of assignedTo
+Column actionPatient = { .width = sizeof(uint32_t) };    // patient index
+Column actionUpdatedAt = { .width = sizeof(int64_t) };
+
+// Patient tiers, indexed like patientStore. The column is only allocated as
+// far as patients have been archived; a patient past its end is hot.
+typedef enum {
+    TIER_HOT,
+    TIER_ARCHIVING,  // frozen and out of lists, still written to snapshots until its segment is
+    TIER_ARCHIVED    // held by an archive segment and left out of snapshots
+} PatientTier;
+
+Column patientTier = { .width = sizeof(uint8_t) };
+
+StringHeap actionText;
+Vocabulary departments;  // assignedTo and initiatedByDepartment
+Vocabulary actionTypes;
+
+// Reference-counted bytes shared between a cache and the connections sending them
+typedef struct {
+    int refs;
+    uint64_t generation;  // store generation the bytes were rendered from
+    uint32_t crc32;       // for a deflate stream: checksums and length of the body it encodes
+    uint32_t adler32;
+    size_t plain_len;
+    size_t len;
+    char data[];
+} SharedBytes;
+
+// Last rendered body of a list endpoint; rebuilt from fragments when the store generation moves on.
+// deflated holds the body's raw deflate stream, compressed once for gzip and deflate clients alike.
+typedef struct {
+    RecordStore *store;
+    SharedBytes *bytes;
+    SharedBytes *deflated;
+    pthread_mutex_t build_lock;
+} ListCache;
+
+// Hash indexes
+// Open-addressing tables of packed (hash << 32 | record index + 1) entries.
+// Writers insert under write_lock and publish each entry with one atomic
+// store; growing swaps in a rebuilt table and retires the old one, so readers
+// probe without locking.
+typedef struct {
+    uint32_t mask;
+    uint32_t used;
+    uint64_t entries[];
+} IndexTable;
+
+typedef struct {
+    IndexTable *table;
+    const Uuid *(*key_of)(uint32_t ref);
+} HashIndex;
+
+// Indexes of one patient's actions in insertion order, copied on growth
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t refs[];
+} ActionList;
+
+const Uuid *patient_id_of(uint32_t ref);
+const Uuid *action_id_of(uint32_t ref);
+void search_index_patient(uint32_t ref);
+void search_index_action(uint32_t ref);
+
+HashIndex patientIndex = { NULL, patient_id_of };
+HashIndex actionIndex = { NULL, action_id_of };
+SegmentedArray patientActions;  // ActionList * per patient
+
+// Secondary indexes
+// Each value of an indexed action field (assignedTo, status, priority) owns a
+// bitmap over action indexes. A bitmap is a directory of 65536-bit blocks,
+// allocated only where the value occurs, and every block keeps summary bits
+// marking its non-zero words, so an intersection skips empty stretches a
+// block or 64 words at a time. Writers flip bits with atomic stores under
+// write_lock; readers scan without locking.
+typedef struct {
+    uint64_t summary[BITMAP_BLOCK_WORDS / 64];
+    uint64_t words[BITMAP_BLOCK_WORDS];
+} BitmapBlock;
+
+typedef struct {
+    uint32_t capacity;
+    BitmapBlock *blocks[];
+} BitmapDirectory;
+
+typedef struct {
+    BitmapDirectory *directory;  // copied on growth, old one retired
+} FieldBitmap;
+
+// Bitmaps by value code (a department code, an ActionStatus, an ActionPriority)
+typedef struct {
+    SegmentedArray bitmaps;  // FieldBitmap * per code
+    uint32_t limit;          // codes below this have their slots allocated
+} FieldIndex;
+
+FieldIndex assignedToIndex, statusIndex, priorityIndex;
+
+// Records still in the hot tier, by patient or action index: set when a record is indexed and
+// cleared when it is frozen, so unfiltered scans skip archived stretches as filtered ones do
+FieldBitmap hotPatients, hotActions;
+void bitmap_set(FieldBitmap *bitmap, uint32_t bit);
+
+// Department work queues
+// Each department's pending actions sit in a binary min-heap ordered by
+// priority (high, medium, low), then createdAt, then index. queuePositions maps
+// every action to its heap slot + 1 (0 when it is not queued), so a status
+// change removes it from the middle in O(log n). Queues are only changed under
+// write_lock; each publishes its first entry in top, so a peek needs no lock.
+typedef struct {
+    uint32_t ref;
+    uint32_t rank;
+    int64_t created;
+} QueueEntry;
+
+typedef struct {
+    QueueEntry *heap;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t top;  // heap[0].ref + 1, or 0 when empty, for lock-free peeks
+} DepartmentQueue;
+
+DepartmentQueue *departmentQueues[MAX_VOCABULARY_CODES];  // by department code, never freed
+uint32_t *queuePositions = NULL;
+uint32_t queuePositionCapacity = 0;
+
+// Full-text search index
+// Patient names and conditions and action titles and descriptions are split
+// into lowercase terms of letters and digits. Each distinct term is stored
+// once under an id and keeps one posting list per store of (record index << 1
+// | title bit), in index order and copied on growth like a patient's action
+// list. Exact terms are found through a hash table of ids; prefixes binary
+// search a run of term ids sorted by text, while terms added since that run
+// was last merged sit in a short unsorted tail that queries scan. Writers add
+// terms and postings under write_lock; queries read without locking.
+typedef enum {
+    SEARCH_PATIENTS,
+    SEARCH_ACTIONS,
+    SEARCH_STORES
+} SearchStore;
+
+typedef struct {
+    const char *text;
+    uint32_t len;
+    ActionList *postings[SEARCH_STORES];
+} SearchTerm;
+
+typedef struct {
+    uint32_t count;
+    uint32_t ids[];
+} TermOrder;
+
+typedef struct {
+    IndexTable *table;     // hash << 32 | term id + 1
+    SegmentedArray terms;  // SearchTerm * per id
+    Slab slab;
+    StringHeap text;
+    uint32_t count;
+    TermOrder *sorted;     // ids [0, sorted->count) in text order, retired when merged again
+    uint64_t postings;
+    size_t posting_bytes;  // held by the current posting lists
+} SearchIndex;
+
+SearchIndex searchIndex = { .slab = { .record_size = sizeof(SearchTerm) } };
+
+// Epoch-based reclamation
+// Readers announce the epoch they entered in; writers retire replaced memory
+// and only free it once every active reader has moved past that epoch.
+typedef struct {
+    uint64_t epoch;  // 0 while the thread is outside a read section
+    char pad[64 - sizeof(uint64_t)];
+} EpochSlot;
+
+typedef struct Retired {
+    void *ptr;
+    void (*destroy)(void *);
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+uint64_t global_epoch = 1;
+EpochSlot epoch_slots[MAX_READER_THREADS];
+int epoch_slot_count = 0;
+__thread EpochSlot *thread_epoch_slot = NULL;
+Retired *retired_list = NULL;
+pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Growable byte buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// Content codings a response body can be sent in; gzip and deflate wrap the same deflate stream
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+} ContentEncoding;
+
+// A list response being serialized a chunk at a time
+typedef enum {
+    STREAM_NONE,
+    STREAM_PATIENTS,
+    STREAM_ACTIONS,
+    STREAM_PATIENT_ACTIONS
+} StreamKind;
+
+typedef struct {
+    StreamKind kind;
+    int chunked;      // HTTP/1.1 chunked framing; HTTP/1.0 bodies end at close
+    int started;      // opening '[' written
+    int patient_ref;  // for STREAM_PATIENT_ACTIONS, -1 for an unknown patient
+    uint32_t first;   // position the list starts at
+    uint32_t next;    // cursor into the snapshot
+    uint32_t count;   // end of the snapshot captured when the response started
+    uint32_t written; // records appended so far; archived ones are skipped
+    ContentEncoding encoding;  // each chunk is deflated and flushed on its own
+    uint32_t crc32;            // checksums and length of the plain body sent so far
+    uint32_t adler32;
+    size_t plain_len;
+} JsonStream;
+
+// Zero-copy slice of the connection's input buffer
+typedef struct {
+    const char *data;
+    size_t len;
+} StringView;
+
+typedef struct {
+    StringView name;
+    StringView value;
+} HttpHeader;
+
+typedef enum {
+    PARSE_INCOMPLETE,
+    PARSE_DONE,
+    PARSE_ERROR
+} ParseStatus;
+
+typedef enum {
+    BULK_NONE,
+    BULK_PATIENTS,
+    BULK_ACTIONS
+} BulkKind;
+
+// Resumable parse state for the request at the front of the input buffer
+typedef struct {
+    size_t scanned;             // header bytes already searched for the blank line
+    size_t header_len;          // 0 until the header block is complete
+    size_t content_length;
+    size_t total_len;           // header_len + content_length, or header_len alone for a bulk upload
+    BulkKind bulk;              // NDJSON upload whose body is consumed as it arrives rather than buffered
+    StringView method;
+    StringView path;
+    StringView query;           // text after '?', without it
+    StringView body;
+    HttpHeader headers[MAX_HEADERS];
+    int header_count;
+    int http11;
+    int keep_alive;
+    int expect_continue;
+    int continue_sent;
+    const char *error_status;   // set with PARSE_ERROR
+    const char *error_message;
+} HttpRequest;
+
+// Bytes that outlive the connection (pre-rendered responses), sent in place at out offset
+typedef struct {
+    size_t offset;
+    const char *data;
+    size_t len;
+    SharedBytes *owner;  // reference released once sent, NULL for static memory
+} Splice;
+
+// A response rendered once at startup in every content coding, for keep-alive and closing connections
+typedef struct {
+    char etag[ENCODING_COUNT][56];
+    Buffer ok[ENCODING_COUNT][2];
+    Buffer not_modified[ENCODING_COUNT][2];
+} StaticResponse;
+
+struct Worker;
+struct Connection;
+
+// An /api/events subscription; empty filters match everything
+typedef struct {
+    int active;
+    uint64_t seq;          // last event delivered or skipped
+    char patientId[37];
+    char department[20];
+    struct Connection *prev;
+    struct Connection *next;
+} Subscription;
+
+// An NDJSON upload in progress: complete lines are applied in batches as they arrive
+typedef struct {
+    BulkKind kind;
+    size_t remaining;   // body bytes not yet consumed
+    uint32_t line;      // lines consumed so far, blank ones included
+    uint32_t received;  // non-blank lines
+    uint32_t created;
+    uint32_t failed;
+    int skipping;       // discarding the rest of an overlong line
+    uint64_t lsn;       // end of the last batch's log entries
+    Buffer errors;      // {"line":N,"error":"..."} for the first MAX_BULK_ERRORS failures
+    void *drafts;       // parsed records of the batch being applied
+} BulkUpload;
+
+// Request metrics
+// Each worker counts into its own WorkerMetrics, which only that worker
+// writes, so the hot path takes no lock and shares no cache line; /metrics
+// sums them. Latency histograms are log-linear like HDR histograms: two
+// buckets per power of two of microseconds, from 1 us up to ~25 s, then
+// one overflow bucket.
+typedef enum {
+    ROUTE_INDEX,
+    ROUTE_PATIENTS,
+    ROUTE_PATIENT,
+    ROUTE_ACTIONS,
+    ROUTE_ACTION_QUERY,
+    ROUTE_ACTION,
+    ROUTE_ACTION_STATUS,
+    ROUTE_PATIENT_ACTIONS,
+    ROUTE_BULK,
+    ROUTE_DEPARTMENT_NEXT,
+    ROUTE_STORAGE,
+    ROUTE_EVENTS,
+    ROUTE_METRICS,
+    ROUTE_SEARCH,
+    ROUTE_STATS,
+    ROUTE_CHANGES,
+    ROUTE_PATIENT_STATUS,
+    ROUTE_PREFLIGHT,
+    ROUTE_NOT_FOUND,
+    ROUTE_COUNT
+} Route;
+
+const char *const routeNames[ROUTE_COUNT] = {
+    "index", "patients", "patient", "actions", "action_query", "action", "action_status",
+    "patient_actions", "bulk", "department_next", "storage", "events", "metrics", "search", "stats",
+    "changes", "patient_status", "preflight", "not_found"
+};
+
+typedef struct {
+    uint64_t requests;
+    uint64_t latency_ns;  // total time spent in the handler
+    uint64_t latency[LATENCY_BUCKETS];
+} RouteMetrics;
+
+typedef struct {
+    RouteMetrics routes[ROUTE_COUNT];
+    uint64_t bytes_sent;
+    uint64_t connections;  // currently open
+    uint64_t list_cache_hits;
+    uint64_t list_cache_misses;
+    uint64_t fragment_hits;
+    uint64_t fragment_renders;
+} WorkerMetrics;
+
+__thread WorkerMetrics *thread_metrics = NULL;  // NULL outside the workers
+
+// Dashboard counters
+// Actions by department, status and priority, and patients in total and
+// admitted, counted as records are created and actions change status, so
+// /api/stats never scans a store. Every change that moves a count already
+// holds write_lock, so a single set of counters has one writer at a time and
+// /api/stats reads it without locking.
+typedef struct {
+    Column actions;     // uint64_t[STATUS_COUNT][PRIORITY_COUNT] per departments code
+    uint64_t patients;
+    uint64_t admitted;
+} DashboardStats;
+
+#define STATS_ACTION_WIDTH (sizeof(uint64_t) * STATUS_COUNT * PRIORITY_COUNT)
+
+DashboardStats dashboardStats = { .actions = { .width = STATS_ACTION_WIDTH } };
+
+// Access log
+// Workers format one line into the next free slot of a bounded ring and move
+// on; a background thread writes the lines to stdout. Each slot's sequence
+// number tells whether it is free for the producer at that position or filled
+// for the consumer (a Vyukov bounded queue), so producers claim a slot with
+// one CAS and never wait. When the ring is full the line is dropped and counted.
+typedef struct {
+    uint64_t seq;
+    char line[ACCESS_LOG_LINE];
+} AccessLogSlot;
+
+typedef struct {
+    AccessLogSlot slots[ACCESS_LOG_SLOTS];
+    uint64_t head __attribute__((aligned(64)));  // next position to claim
+    uint64_t tail __attribute__((aligned(64)));  // next position to write out
+    uint64_t dropped;
+} AccessLog;
+
+AccessLog accessLog;
+
+// Per-client connection state owned by one worker's event loop
+typedef struct Connection {
+    int fd;
+    struct Worker *worker;
+    Buffer in;
+    size_t in_start;  // first byte of the unconsumed input
+    HttpRequest request;
+    Buffer out;
+    size_t out_sent;
+    Splice splices[MAX_SPLICES];
+    int splice_head;
+    int splice_count;
+    size_t splice_sent;  // bytes of splices[splice_head] already written
+    JsonStream stream;
+    Subscription subscription;
+    BulkUpload bulk;
+    int http11;
+    int keep_alive;
+    int close_after_write;
+    int read_pending;
+    int peer_closed;
+    int closed;         // set by close_connection; the struct is freed once the event batch is done
+    int status;         // status code of the response being built, for the access log
+    ContentEncoding encoding;  // coding the current request accepts for large bodies
+    uint64_t wait_lsn;  // responses held until the log is durable up to here, 0 if none
+    time_t last_active;
+    struct Connection *prev;
+    struct Connection *next;
+    struct Connection *wait_prev;
+    struct Connection *wait_next;
+} Connection;
+
+// Each worker thread runs its own epoll loop over the shared listening socket
+typedef struct Worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int server_socket;
+    int wake_fd;        // eventfd signalled when the log becomes durable further
+    int waiting;        // connections linked on wait_head
+    Connection idle_head;
+    Connection wait_head;
+    int subscribers;    // connections linked on event_head
+    Connection event_head;
+    time_t last_heartbeat;
+    Connection *closed;  // closed during the current event batch, linked through next
+    WorkerMetrics metrics;
+} Worker;
+
+Worker workers[MAX_WORKERS];
+
+// Write-ahead log
+// Writers append framed entries to pending and note the LSN (logical log
+// offset) their entry ends at. The log thread writes and fdatasyncs whatever
+// has accumulated as one batch, so concurrent writes share a single flush, and
+// responses to writes are held until durable_lsn reaches their LSN. Segment
+// wal-<seq>.log follows snapshot-<seq>.snap, which holds every record logged
+// in earlier segments.
+typedef enum {
+    WAL_PATIENT = 1,
+    WAL_ACTION = 2,
+    WAL_ACTION_STATUS = 3,  // id, status and updatedAt of an existing action
+    WAL_PATIENT_STATUS = 4  // id and status of an existing patient
+} WalEntryType;
+
+typedef struct {
+    int fd;                     // current segment, -1 when running in memory only
+    uint64_t seq;               // current segment number
+    Buffer pending;             // entries not yet handed to the log thread
+    uint64_t appended_lsn;      // end of the last entry appended
+    uint64_t durable_lsn;       // end of the last entry flushed to disk
+    uint64_t unsnapshotted;     // log bytes not yet covered by a snapshot
+    int rotate_requested;
+    uint32_t rotated_patients;  // store counts captured when the segment was rotated
+    uint32_t rotated_actions;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // entries or a rotation request for the log thread
+    pthread_cond_t rotated;
+} WriteAheadLog;
+
+WriteAheadLog wal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .wake = PTHREAD_COND_INITIALIZER, .rotated = PTHREAD_COND_INITIALIZER };
+
+uint64_t wal_log(WalEntryType type, const void *record);
+uint64_t wal_log_batch(WalEntryType type, const void *const *records, uint32_t count);
+
+// Cursor over an entry payload; ok drops to 0 on malformed input
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    int ok;
+} Decoder;
+
+// Change events
+// Every created or changed record takes the next change sequence number. Its
+// handler publishes it as one ready-framed SSE message with that number as its
+// id into a ring of the latest EVENT_RING_SIZE events. Workers copy what their
+// subscribers have not seen yet; a subscriber that falls a full ring behind is
+// told to resync. The change log keeps just the store and index of the latest
+// CHANGE_LOG_SIZE changes, so /api/changes catches a client up in O(changes).
+// Numbering starts from the startup time in microseconds, so a sequence number
+// kept from an earlier run is older than anything in this run's log.
+typedef struct {
+    uint64_t seq;
+    char patientId[37];
+    char department[20];  // assignedTo of an action, empty for patient events
+    uint32_t len;
+    char data[];
+} Event;
+
+Event *event_ring[EVENT_RING_SIZE];
+uint64_t change_seq = 0;   // last change published
+uint64_t change_base = 0;  // change_seq when this run started
+uint64_t change_log[CHANGE_LOG_SIZE];  // seq << 33 | index << 1 | 1 for an action, by seq % CHANGE_LOG_SIZE
+
+// Archive segments
+// Discharged patients whose actions are all completed and have not changed for
+// archive_age seconds move out of the hot stores into archive-<seq>.arc, an
+// immutable file written alongside snapshot-<seq>.snap and mapped read-only.
+// Patients are sorted by id and packed, each with its actions, into blocks of
+// about ARCHIVE_BLOCK_BYTES of JSON that are deflated one by one. A sparse
+// index of each block's first id, a Bloom filter over the ids and a header
+// close the file:
+//   header  "CWARCH01", u32 blocks, patients, actions, Bloom bits, u64 index offset, Bloom offset
+//   index   per block: first id (16 bytes), u64 offset, u32 compressed and plain length, u32 CRC32
+//   block   per patient: id, u32 JSON length, u32 action count, JSON,
+//           then per action: u64 createdAt, u32 JSON length, JSON
+// A lookup checks each segment's Bloom filter, binary-searches the index and
+// inflates the one block that can hold the id. Archived records stay in the
+// running process's stores (indexes into them are stable) but leave lists,
+// queries, search and the counters, drop their fragments and are no longer
+// written to snapshots, so the next start no longer loads them.
+typedef struct {
+    uint64_t seq;
+    const uint8_t *data;  // the whole file, mapped read-only
+    size_t size;
+    uint32_t block_count;
+    uint32_t patients;
+    uint32_t actions;
+    uint32_t bloom_bits;
+    const uint8_t *index;
+    const uint8_t *bloom;
+} ArchiveSegment;
+
+// An archived patient found by archive_lookup, pointing into the thread's inflated block
+typedef struct {
+    const char *json;
+    uint32_t len;
+    uint32_t action_count;
+    const uint8_t *actions;
+} ArchivedPatient;
+
+SegmentedArray archiveSegments;  // ArchiveSegment * in the order they were written
+uint32_t archiveCount = 0;       // written by recovery, then only by the snapshot thread
+__thread Buffer archiveBlock;    // last block this thread inflated
+__thread const uint8_t *archiveBlockSource = NULL;  // and where in its segment it was read from
+
+// Server configuration (overridable from the command line)
+int server_port = PORT;
+int listen_backlog = DEFAULT_BACKLOG;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+int worker_count = 0;
+const char *data_dir = DEFAULT_DATA_DIR;
+int persistence = 1;
+int64_t archive_age = (int64_t)ARCHIVE_AGE_DAYS * 86400;  // seconds since a discharged patient's last change
+
+// Id generation state
+// Ids are UUIDv7: 48 bits of Unix milliseconds, a 12-bit counter that orders ids
+// made within one millisecond, then 62 random bits. uuid_clock holds the last
+// (milliseconds << 12 | counter) handed out; each id claims the next value with
+// one CAS, so ids are unique and increasing across threads without a lock.
+uint64_t uuid_clock = 0;
+__thread uint64_t uuid_random = 0;
+
+// Local UTC offset of the current hour, packed as (hour << 32 | offset seconds)
+uint64_t clock_offset = 0;
 
 // Utility functions
-void generate_uuid(char *uuid) {
-    sprintf(uuid, "%08x-%04x-%04x-%04x-%012x",
-            rand() % 0xFFFFFFFF,
-            rand() % 0xFFFF,
-            rand() % 0xFFFF,
-            rand() % 0xFFFF,
-            ((long long)rand() << 32) | rand());
+// splitmix64 over a per-thread state, seeded on first use
+uint64_t random_u64() {
+    if (!uuid_random) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uuid_random = ((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec) ^ (uintptr_t)&uuid_random ^
+                      (uint64_t)getpid() << 32;
+    }
+    uint64_t z = (uuid_random += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
 }
 
-void get_current_timestamp(char *timestamp) {
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(timestamp, 25, "%Y-%m-%dT%H:%M:%S", tm_info);
+void generate_uuid(Uuid *id) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    uint64_t tick = ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) << 12;
+    uint64_t last = __atomic_load_n(&uuid_clock, __ATOMIC_RELAXED), next;
+    // A full counter, or a clock that stepped back, borrows from the next millisecond
+    do {
+        next = tick > last ? tick : last + 1;
+    } while (!__atomic_compare_exchange_n(&uuid_clock, &last, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    uint64_t millis = next >> 12, random = random_u64();
+    for (int i = 0; i < 6; i++) id->bytes[i] = (uint8_t)(millis >> (40 - 8 * i));
+    id->bytes[6] = 0x70 | ((next >> 8) & 0x0f);
+    id->bytes[7] = (uint8_t)next;
+    id->bytes[8] = 0x80 | ((random >> 56) & 0x3f);
+    for (int i = 9; i < 16; i++) id->bytes[i] = (uint8_t)(random >> (8 * (15 - i)));
 }
 
-void initialize_data() {
-    // Sample patients
-    strcpy(patients[0].name, "John Smith");
-    patients[0].age = 45;
-    strcpy(patients[0].gender, "Male");
-    strcpy(patients[0].bloodGroup, "O+");
-    strcpy(patients[0].admissionDate, "2024-01-15");
-    strcpy(patients[0].condition, "Chest Pain");
-    strcpy(patients[0].status, "admitted");
-    generate_uuid(patients[0].id);
-    
-    strcpy(patients[1].name, "Sarah Johnson");
-    patients[1].age = 32;
-    strcpy(patients[1].gender, "Female");
-    strcpy(patients[1].bloodGroup, "A+");
-    strcpy(patients[1].admissionDate, "2024-01-16");
-    strcpy(patients[1].condition, "Fractured Leg");
-    strcpy(patients[1].status, "admitted");
-    generate_uuid(patients[1].id);
-    
-    strcpy(patients[2].name, "Michael Chen");
-    patients[2].age = 58;
-    strcpy(patients[2].gender, "Male");
-    strcpy(patients[2].bloodGroup, "B+");
-    strcpy(patients[2].admissionDate, "2024-01-14");
-    strcpy(patients[2].condition, "Diabetes Management");
-    strcpy(patients[2].status, "admitted");
-    generate_uuid(patients[2].id);
-    
-    patientCount = 3;
+// Unix seconds at which id was generated
+int64_t uuid_seconds(const Uuid *id) {
+    uint64_t millis = 0;
+    for (int i = 0; i < 6; i++) millis = millis << 8 | id->bytes[i];
+    return (int64_t)(millis / 1000);
+}
+
+// Write id as 36 characters of 8-4-4-4-12 hex text plus a NUL
+void format_uuid(const Uuid *id, char *text) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) *text++ = '-';
+        *text++ = digits[id->bytes[i] >> 4];
+        *text++ = digits[id->bytes[i] & 15];
+    }
+    *text = '\0';
+}
+
+// Parse 8-4-4-4-12 hex text; returns 0 if text is not exactly that
+int parse_uuid(const char *text, Uuid *id) {
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            if (*text++ != '-') return 0;
+        }
+        int value = 0;
+        for (int k = 0; k < 2; k++) {
+            char c = *text++;
+            if (c >= '0' && c <= '9') value = value << 4 | (c - '0');
+            else if (c >= 'a' && c <= 'f') value = value << 4 | (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') value = value << 4 | (c - 'A' + 10);
+            else return 0;
+        }
+        id->bytes[i] = (uint8_t)value;
+    }
+    return *text == '\0';
+}
+
+// Timestamps are seconds since 1970-01-01T00:00:00 on the local wall clock, so they convert to
+// and from the API's zone-less "YYYY-MM-DDTHH:MM:SS" text with calendar arithmetic alone.
+// Being local, they repeat an hour when daylight saving time ends; anything that needs them in
+// order uses the Unix time in the record's UUIDv7 id instead.
+// Local timestamp of Unix time seconds, which should be recent: localtime_r only runs once an hour
+int64_t local_timestamp(int64_t seconds) {
+    uint64_t hour = (uint64_t)seconds / 3600;
+    uint64_t cached = __atomic_load_n(&clock_offset, __ATOMIC_RELAXED);
+    if (cached >> 32 != hour) {
+        time_t now = (time_t)seconds;
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        cached = hour << 32 | (uint32_t)(int32_t)tm_info.tm_gmtoff;
+        __atomic_store_n(&clock_offset, cached, __ATOMIC_RELAXED);
+    }
+    return seconds + (int32_t)(uint32_t)cached;
+}
+
+// The coarse clock is read without a system call
+int64_t current_timestamp() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return local_timestamp(now.tv_sec);
+}
+
+// Unix time of local timestamp. In the hour repeated when daylight saving time ends mktime
+// picks one of its two readings; a time skipped when it starts reads as just past the gap.
+int64_t unix_time(int64_t timestamp) {
+    time_t local = (time_t)timestamp;
+    struct tm tm_info;
+    gmtime_r(&local, &tm_info);
+    tm_info.tm_isdst = -1;
+    return (int64_t)mktime(&tm_info);
+}
+
+void format_timestamp(int64_t timestamp, char *text) {
+    int64_t days = (timestamp >= 0 ? timestamp : timestamp - 86399) / 86400;
+    int64_t seconds = timestamp - days * 86400;
+    // Civil date from days since 1970-01-01 in the proleptic Gregorian calendar
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t day_of_era = z - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t mp = (5 * day_of_year + 2) / 153;
+    int day = (int)(day_of_year - (153 * mp + 2) / 5 + 1);
+    int month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    int year = (int)(year_of_era + era * 400 + (month <= 2));
+    sprintf(text, "%04d-%02d-%02dT%02d:%02d:%02d", year, month, day,
+            (int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60));
+}
+
+// Parse "YYYY-MM-DDTHH:MM:SS"; returns 0 if text is not a timestamp
+int parse_timestamp(const char *text, int64_t *timestamp) {
+    int year, month, day, hour, minute, second, end = 0;
+    if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &end) != 6 ||
+        text[end] != '\0') {
+        return 0;
+    }
+    // Days from 1970-01-01 in the proleptic Gregorian calendar
+    int64_t y = year - (month <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t year_of_era = y - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+    *timestamp = days * 86400 + hour * 3600 + minute * 60 + second;
+    return 1;
+}
+
+// New action id and its local creation time, taken from the id so the two always agree
+void stamp_action(ClinicalAction *action) {
+    generate_uuid(&action->id);
+    action->createdAt = local_timestamp(uuid_seconds(&action->id));
+    action->updatedAt = action->createdAt;
+}
+
+// Code of value in a closed vocabulary, or -1
+int enum_code(const char *const *names, int count, const char *value) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], value) == 0) return i;
+    }
+    return -1;
+}
+
+// Read/write sections
+void read_begin() {
+    if (!thread_epoch_slot) {
+        int index = __atomic_fetch_add(&epoch_slot_count, 1, __ATOMIC_SEQ_CST);
+        if (index >= MAX_READER_THREADS) {
+            fprintf(stderr, "Too many reader threads\n");
+            abort();
+        }
+        thread_epoch_slot = &epoch_slots[index];
+    }
+    __atomic_store_n(&thread_epoch_slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void read_end() {
+    __atomic_store_n(&thread_epoch_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Free every retired object that no active reader can still reference
+void reclaim_retired() {
+    uint64_t oldest = UINT64_MAX;
+    int slots = __atomic_load_n(&epoch_slot_count, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < slots && i < MAX_READER_THREADS; i++) {
+        uint64_t epoch = __atomic_load_n(&epoch_slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
     
-    // Sample clinical actions
-    strcpy(clinicalActions[0].patientId, patients[0].id);
-    strcpy(clinicalActions[0].type, "prescription");
-    strcpy(clinicalActions[0].title, "Pain Medication");
-    strcpy(clinicalActions[0].description, "Prescribe ibuprofen 400mg every 6 hours for chest pain");
-    strcpy(clinicalActions[0].initiatedBy, "Dr. Wilson");
-    strcpy(clinicalActions[0].initiatedByDepartment, "Doctor");
-    strcpy(clinicalActions[0].assignedTo, "Pharmacy");
-    strcpy(clinicalActions[0].status, "pending");
-    strcpy(clinicalActions[0].priority, "medium");
-    generate_uuid(clinicalActions[0].id);
-    get_current_timestamp(clinicalActions[0].createdAt);
-    strcpy(clinicalActions[0].updatedAt, clinicalActions[0].createdAt);
-    
-    strcpy(clinicalActions[1].patientId, patients[1].id);
-    strcpy(clinicalActions[1].type, "diagnostic");
-    strcpy(clinicalActions[1].title, "X-Ray Imaging");
-    strcpy(clinicalActions[1].description, "Perform leg X-ray to assess fracture severity");
-    strcpy(clinicalActions[1].initiatedBy, "Dr. Brown");
-    strcpy(clinicalActions[1].initiatedByDepartment, "Doctor");
-    strcpy(clinicalActions[1].assignedTo, "Radiology");
-    strcpy(clinicalActions[1].status, "in-progress");
-    strcpy(clinicalActions[1].priority, "high");
-    generate_uuid(clinicalActions[1].id);
-    get_current_timestamp(clinicalActions[1].createdAt);
-    strcpy(clinicalActions[1].updatedAt, clinicalActions[1].createdAt);
-    
-    actionCount = 2;
+    pthread_mutex_lock(&retire_lock);
+    Retired **link = &retired_list;
+    while (*link) {
+        Retired *entry = *link;
+        if (entry->epoch < oldest) {
+            *link = entry->next;
+            entry->destroy(entry->ptr);
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&retire_lock);
 }
 
-// HTTP response helpers
-void send_http_response(int client_socket, const char *status, const char *content_type, const char *body) {
-    char response[BUFFER_SIZE];
-    sprintf(response, 
-            "HTTP/1.1 %s\r\n"
-            "Content-Type: %s\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-            "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
-            "Content-Length: %zu\r\n"
-            "Connection: close\r\n"
-            "\r\n%s",
-            status, content_type, strlen(body), body);
-    send(client_socket, response, strlen(response), 0);
+// Defer freeing memory that has just been unlinked from a shared structure
+void retire(void *ptr, void (*destroy)(void *)) {
+    Retired *entry = malloc(sizeof(Retired));
+    if (!entry) {
+        fprintf(stderr, "Out of memory retiring object\n");
+        abort();
+    }
+    entry->ptr = ptr;
+    entry->destroy = destroy;
+    pthread_mutex_lock(&retire_lock);
+    entry->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    entry->next = retired_list;
+    retired_list = entry;
+    pthread_mutex_unlock(&retire_lock);
 }
 
-void send_json_response(int client_socket, const char *json) {
-    send_http_response(client_socket, "200 OK", "application/json", json);
+void write_begin() {
+    pthread_mutex_lock(&write_lock);
 }
 
-void send_html_response(int client_socket, const char *html) {
-    send_http_response(client_socket, "200 OK", "text/html", html);
+void write_end() {
+    reclaim_retired();
+    pthread_mutex_unlock(&write_lock);
 }
 
-// JSON generation functions
-void patients_to_json(char *json) {
-    strcpy(json, "[");
-    for (int i = 0; i < patientCount; i++) {
-        char patient_json[500];
-        sprintf(patient_json,
-                "{\"id\":\"%s\",\"name\":\"%s\",\"age\":%d,\"gender\":\"%s\","
-                "\"bloodGroup\":\"%s\",\"admissionDate\":\"%s\",\"condition\":\"%s\","
-                "\"status\":\"%s\"}",
-                patients[i].id, patients[i].name, patients[i].age, patients[i].gender,
-                patients[i].bloodGroup, patients[i].admissionDate, patients[i].condition,
-                patients[i].status);
-        
-        strcat(json, patient_json);
-        if (i < patientCount - 1) strcat(json, ",");
-    }
-    strcat(json, "]");
-}
-
-void actions_to_json(char *json) {
-    strcpy(json, "[");
-    for (int i = 0; i < actionCount; i++) {
-        char action_json[800];
-        sprintf(action_json,
-                "{\"id\":\"%s\",\"patientId\":\"%s\",\"type\":\"%s\",\"title\":\"%s\","
-                "\"description\":\"%s\",\"initiatedBy\":\"%s\",\"initiatedByDepartment\":\"%s\","
-                "\"assignedTo\":\"%s\",\"status\":\"%s\",\"priority\":\"%s\","
-                "\"createdAt\":\"%s\",\"updatedAt\":\"%s\"}",
-                clinicalActions[i].id, clinicalActions[i].patientId, clinicalActions[i].type,
-                clinicalActions[i].title, clinicalActions[i].description,
-                clinicalActions[i].initiatedBy, clinicalActions[i].initiatedByDepartment,
-                clinicalActions[i].assignedTo, clinicalActions[i].status, clinicalActions[i].priority,
-                clinicalActions[i].createdAt, clinicalActions[i].updatedAt);
-        
-        strcat(json, action_json);
-        if (i < actionCount - 1) strcat(json, ",");
-    }
-    strcat(json, "]");
-}
-
-void patient_actions_to_json(const char *patientId, char *json) {
-    strcpy(json, "[");
-    int first = 1;
-    for (int i = 0; i < actionCount; i++) {
-        if (strcmp(clinicalActions[i].patientId, patientId) == 0) {
-            if (!first) strcat(json, ",");
-            
-            char action_json[800];
-            sprintf(action_json,
-                    "{\"id\":\"%s\",\"patientId\":\"%s\",\"type\":\"%s\",\"title\":\"%s\","
-                    "\"description\":\"%s\",\"initiatedBy\":\"%s\",\"initiatedByDepartment\":\"%s\","
-                    "\"assignedTo\":\"%s\",\"status\":\"%s\",\"priority\":\"%s\","
-                    "\"createdAt\":\"%s\",\"updatedAt\":\"%s\"}",
-                    clinicalActions[i].id, clinicalActions[i].patientId, clinicalActions[i].type,
-                    clinicalActions[i].title, clinicalActions[i].description,
-                    clinicalActions[i].initiatedBy, clinicalActions[i].initiatedByDepartment,
-                    clinicalActions[i].assignedTo, clinicalActions[i].status, clinicalActions[i].priority,
-                    clinicalActions[i].createdAt, clinicalActions[i].updatedAt);
-            
-            strcat(json, action_json);
-            first = 0;
+// Segmented array operations
+uint32_t segment_of(uint32_t index, uint32_t *offset) {
+    uint64_t position = (uint64_t)index + SEGMENT_BASE;
+    uint32_t segment = 63 - __builtin_clzll(position) - SEGMENT_BASE_BITS;
+    *offset = (uint32_t)(position - ((uint64_t)SEGMENT_BASE << segment));
+    return segment;
+}
+
+// Address of slot index; its segment must already exist
+void **segmented_slot(SegmentedArray *array, uint32_t index) {
+    uint32_t offset;
+    uint32_t segment = segment_of(index, &offset);
+    return &__atomic_load_n(&array->segments[segment], __ATOMIC_ACQUIRE)[offset];
+}
+
+// Allocate the segment holding index if needed (caller holds write_lock)
+void segmented_reserve(SegmentedArray *array, uint32_t index) {
+    uint32_t offset;
+    uint32_t segment = segment_of(index, &offset);
+    if (array->segments[segment]) return;
+    
+    void **slots = calloc((size_t)SEGMENT_BASE << segment, sizeof(void *));
+    if (!slots) {
+        fprintf(stderr, "Out of memory allocating store segment\n");
+        abort();
+    }
+    __atomic_store_n(&array->segments[segment], slots, __ATOMIC_RELEASE);
+    if (segment + 1 > array->segment_count) {
+        __atomic_store_n(&array->segment_count, segment + 1, __ATOMIC_RELAXED);
+    }
+}
+
+size_t segmented_memory(SegmentedArray *array) {
+    uint32_t segments = __atomic_load_n(&array->segment_count, __ATOMIC_RELAXED);
+    size_t slots = 0;
+    for (uint32_t i = 0; i < segments; i++) {
+        if (__atomic_load_n(&array->segments[i], __ATOMIC_RELAXED)) slots += (size_t)SEGMENT_BASE << i;
+    }
+    return slots * sizeof(void *);
+}
+
+// Slab operations
+size_t slab_stride(Slab *slab) {
+    return (slab->record_size + 7) & ~(size_t)7;
+}
+
+// Hand out a zeroed record (caller holds write_lock)
+// Chunks are fresh, pre-faulted anonymous mappings, so records carved from
+// them start out zeroed without a memset; only reused records are cleared.
+void *slab_alloc(Slab *slab) {
+    if (!slab->reusable) slab->reusable = __atomic_exchange_n(&slab->released, NULL, __ATOMIC_ACQUIRE);
+    if (slab->reusable) {
+        void *record = slab->reusable;
+        slab->reusable = *(void **)record;
+        memset(record, 0, slab->record_size);
+        return record;
+    }
+    
+    size_t stride = slab_stride(slab);
+    if (!slab->chunks || slab->chunk_used + stride > SLAB_CHUNK_SIZE) {
+        SlabChunk *chunk = mmap(NULL, sizeof(SlabChunk) + SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (chunk == MAP_FAILED) {
+            fprintf(stderr, "Out of memory allocating slab chunk\n");
+            abort();
         }
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        slab->chunk_used = 0;
+        __atomic_store_n(&slab->chunk_count, slab->chunk_count + 1, __ATOMIC_RELAXED);
     }
-    strcat(json, "]");
+    void *record = slab->chunks->data + slab->chunk_used;
+    slab->chunk_used += stride;
+    return record;
 }
 
-// HTML template
-const char* get_html_template() {
-    return "<!DOCTYPE html>\n"
-           "<html lang=\"en\">\n"
-           "<head>\n"
-           "    <meta charset=\"UTF-8\">\n"
-           "    <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
-           "    <title>Patient Clinical Workflow - C Version</title>\n"
-           "    <style>\n"
-           "        body { font-family: Arial, sans-serif; margin: 20px; background: #f5f5f5; }\n"
-           "        .container { max-width: 1200px; margin: 0 auto; }\n"
-           "        .card { background: white; padding: 20px; margin: 10px 0; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }\n"
-           "        .patient { border-left: 4px solid #007bff; }\n"
-           "        .action { border-left: 4px solid #28a745; }\n"
-           "        .status-pending { background: #fff3cd; }\n"
-           "        .status-in-progress { background: #cce5ff; }\n"
-           "        .status-completed { background: #d4edda; }\n"
-           "        button { background: #007bff; color: white; padding: 8px 16px; border: none; border-radius: 4px; cursor: pointer; }\n"
-           "        button:hover { background: #0056b3; }\n"
-           "        .grid { display: grid; grid-template-columns: 1fr 1fr; gap: 20px; }\n"
-           "        input, select, textarea { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ddd; border-radius: 4px; }\n"
-           "    </style>\n"
-           "</head>\n"
-           "<body>\n"
-           "    <div class=\"container\">\n"
-           "        <h1>Patient-Centric Clinical Workflow System</h1>\n"
-           "        <p>C Implementation with Raw Sockets</p>\n"
-           "        \n"
-           "        <div class=\"card\">\n"
-           "            <h2>Patients</h2>\n"
-           "            <div id=\"patients-list\"></div>\n"
-           "        </div>\n"
-           "        \n"
-           "        <div class=\"grid\">\n"
-           "            <div class=\"card\">\n"
-           "                <h2>Add Patient</h2>\n"
-           "                <form id=\"patient-form\">\n"
-           "                    <input type=\"text\" id=\"name\" placeholder=\"Patient Name\" required>\n"
-           "                    <input type=\"number\" id=\"age\" placeholder=\"Age\" required>\n"
-           "                    <select id=\"gender\" required>\n"
-           "                        <option value=\"\">Select Gender</option>\n"
-           "                        <option value=\"Male\">Male</option>\n"
-           "                        <option value=\"Female\">Female</option>\n"
-           "                    </select>\n"
-           "                    <input type=\"text\" id=\"condition\" placeholder=\"Condition\" required>\n"
-           "                    <button type=\"submit\">Add Patient</button>\n"
-           "                </form>\n"
-           "            </div>\n"
-           "            \n"
-           "            <div class=\"card\">\n"
-           "                <h2>Create Clinical Action</h2>\n"
-           "                <form id=\"action-form\">\n"
-           "                    <select id=\"patient-select\" required>\n"
-           "                        <option value=\"\">Select Patient</option>\n"
-           "                    </select>\n"
-           "                    <select id=\"action-type\" required>\n"
-           "                        <option value=\"prescription\">Prescription</option>\n"
+// Give a record no reader can reach any more back to its slab (any thread; reclaim_retired runs
+// both inside and outside write sections)
+void slab_release(Slab *slab, void *record) {
+    void *head = __atomic_load_n(&slab->released, __ATOMIC_RELAXED);
+    do {
+        *(void **)record = head;
+    } while (!__atomic_compare_exchange_n(&slab->released, &head, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Column operations
+// Address of the value at index; its segment must already exist
+void *column_at(Column *column, uint32_t index) {
+    uint32_t offset;
+    uint32_t segment = segment_of(index, &offset);
+    return __atomic_load_n(&column->segments[segment], __ATOMIC_ACQUIRE) + (size_t)offset * column->width;
+}
+
+// Allocate the segment holding index if needed (caller holds write_lock)
+void column_reserve(Column *column, uint32_t index) {
+    uint32_t offset;
+    uint32_t segment = segment_of(index, &offset);
+    if (column->segments[segment]) return;
+    
+    char *values = calloc((size_t)SEGMENT_BASE << segment, column->width);
+    if (!values) {
+        fprintf(stderr, "Out of memory allocating column segment\n");
+        abort();
+    }
+    __atomic_store_n(&column->segments[segment], values, __ATOMIC_RELEASE);
+    if (segment + 1 > column->segment_count) {
+        __atomic_store_n(&column->segment_count, segment + 1, __ATOMIC_RELAXED);
+    }
+}
+
+size_t column_memory(Column *column) {
+    uint32_t segments = __atomic_load_n(&column->segment_count, __ATOMIC_RELAXED);
+    size_t values = 0;
+    for (uint32_t i = 0; i < segments; i++) {
+        if (__atomic_load_n(&column->segments[i], __ATOMIC_RELAXED)) values += (size_t)SEGMENT_BASE << i;
+    }
+    return values * column->width;
+}
+
+// String heap operations
+// Copy len bytes into the heap (caller holds write_lock)
+const char *heap_copy_bytes(StringHeap *heap, const char *data, size_t len) {
+    if (!heap->chunks || heap->chunk_used + len > STRING_HEAP_CHUNK_SIZE) {
+        StringChunk *chunk = mmap(NULL, sizeof(StringChunk) + STRING_HEAP_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (chunk == MAP_FAILED) {
+            fprintf(stderr, "Out of memory allocating string heap chunk\n");
+            abort();
+        }
+        chunk->next = heap->chunks;
+        heap->chunks = chunk;
+        heap->chunk_used = 0;
+        __atomic_store_n(&heap->chunk_count, heap->chunk_count + 1, __ATOMIC_RELAXED);
+    }
+    char *copy = heap->chunks->data + heap->chunk_used;
+    memcpy(copy, data, len);
+    heap->chunk_used += len;
+    return copy;
+}
+
+// Copy text into the heap (caller holds write_lock); empty strings share one constant
+const char *heap_copy(StringHeap *heap, const char *text) {
+    size_t len = strlen(text) + 1;
+    if (len == 1) return "";
+    return heap_copy_bytes(heap, text, len);
+}
+
+size_t heap_memory(StringHeap *heap) {
+    return __atomic_load_n(&heap->chunk_count, __ATOMIC_RELAXED) * (sizeof(StringChunk) + STRING_HEAP_CHUNK_SIZE);
+}
+
+// Vocabulary operations
+uint32_t hash_string(const char *text) {
+    uint32_t hash = 2166136261u;
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+const char *vocabulary_name(Vocabulary *vocabulary, uint32_t code) {
+    return __atomic_load_n(segmented_slot(&vocabulary->names, code), __ATOMIC_ACQUIRE);
+}
+
+// Code of name, or -1 if it has never been interned (lock-free)
+int vocabulary_find(Vocabulary *vocabulary, const char *name) {
+    for (uint32_t i = hash_string(name) % VOCABULARY_SLOTS;; i = (i + 1) % VOCABULARY_SLOTS) {
+        uint16_t slot = __atomic_load_n(&vocabulary->slots[i], __ATOMIC_ACQUIRE);
+        if (!slot) return -1;
+        if (strcmp(vocabulary_name(vocabulary, slot - 1), name) == 0) return slot - 1;
+    }
+}
+
+// Code of name, adding it if it is new; -1 once every code is taken (caller holds write_lock)
+int vocabulary_intern(Vocabulary *vocabulary, const char *name) {
+    uint32_t i = hash_string(name) % VOCABULARY_SLOTS;
+    for (; vocabulary->slots[i]; i = (i + 1) % VOCABULARY_SLOTS) {
+        if (strcmp(vocabulary_name(vocabulary, vocabulary->slots[i] - 1), name) == 0) {
+            return vocabulary->slots[i] - 1;
+        }
+    }
+    if (vocabulary->count == MAX_VOCABULARY_CODES) return -1;
+    
+    uint32_t code = vocabulary->count;
+    char *copy = strdup(name);
+    if (!copy) {
+        fprintf(stderr, "Out of memory interning name\n");
+        abort();
+    }
+    segmented_reserve(&vocabulary->names, code);
+    __atomic_store_n(segmented_slot(&vocabulary->names, code), copy, __ATOMIC_RELEASE);
+    // The name is published before the slot that leads readers to it
+    __atomic_store_n(&vocabulary->slots[i], (uint16_t)(code + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&vocabulary->count, code + 1, __ATOMIC_RELEASE);
+    return (int)code;
+}
+
+// Metric operations
+// Counters have a single writer, so a plain read-modify-write suffices; the atomic
+// store only keeps a concurrent /metrics read from seeing a torn value
+void metric_add(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+uint64_t metric_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Dashboard counter operations
+// Count delta actions of department, status and priority (caller holds write_lock)
+void stats_count_action(uint32_t department, ActionStatus status, ActionPriority priority, int64_t delta) {
+    column_reserve(&dashboardStats.actions, department);
+    uint64_t *counts = column_at(&dashboardStats.actions, department);
+    metric_add(&counts[status * PRIORITY_COUNT + priority], (uint64_t)delta);
+}
+
+// Count delta patients, admitted of them (caller holds write_lock)
+void stats_count_patient(int64_t patients, int64_t admitted) {
+    metric_add(&dashboardStats.patients, (uint64_t)patients);
+    metric_add(&dashboardStats.admitted, (uint64_t)admitted);
+}
+
+// The counts for department, or NULL if no action has been counted for it yet (lock-free)
+const uint64_t *stats_counts(uint32_t department) {
+    uint32_t offset;
+    uint32_t segment = segment_of(department, &offset);
+    if (!__atomic_load_n(&dashboardStats.actions.segments[segment], __ATOMIC_ACQUIRE)) return NULL;
+    return column_at(&dashboardStats.actions, department);
+}
+
+// Histogram bucket of a latency: 0 and 1 us exactly, then two per power of two
+uint32_t latency_bucket(uint64_t micros) {
+    if (micros < 2) return (uint32_t)micros;
+    uint32_t octave = 63 - __builtin_clzll(micros);
+    uint32_t bucket = 2 + (octave - 1) * 2 + ((micros >> (octave - 1)) & 1);
+    return bucket < LATENCY_BUCKETS - 1 ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Exclusive upper bound of a bucket in microseconds (the last bucket has none)
+uint64_t latency_bucket_bound(uint32_t bucket) {
+    if (bucket < 2) return bucket + 1;
+    uint32_t octave = 1 + (bucket - 2) / 2;
+    return (uint64_t)(3 + (bucket - 2) % 2) << (octave - 1);
+}
+
+// Access log operations
+// Queue one line without waiting; dropped (and counted) when the ring is full
+void access_log(const char *request_line, int status, uint64_t micros) {
+    uint64_t pos = __atomic_load_n(&accessLog.head, __ATOMIC_RELAXED);
+    AccessLogSlot *slot;
+    for (;;) {
+        slot = &accessLog.slots[pos % ACCESS_LOG_SLOTS];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&accessLog.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (seq < pos) {
+            __atomic_add_fetch(&accessLog.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&accessLog.head, __ATOMIC_RELAXED);
+        }
+    }
+    snprintf(slot->line, sizeof(slot->line), "Request: %s %d %lluus\n", request_line, status,
+             (unsigned long long)micros);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Write queued lines to stdout, flushing whenever the ring runs dry
+void *access_log_main(void *arg) {
+    (void)arg;
+    int unflushed = 0;
+    for (;;) {
+        AccessLogSlot *slot = &accessLog.slots[accessLog.tail % ACCESS_LOG_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != accessLog.tail + 1) {
+            if (unflushed) fflush(stdout);
+            unflushed = 0;
+            struct timespec pause = { 0, 10 * 1000 * 1000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        fputs(slot->line, stdout);
+        unflushed = 1;
+        // Hand the slot back to producers one lap ahead
+        __atomic_store_n(&slot->seq, accessLog.tail + ACCESS_LOG_SLOTS, __ATOMIC_RELEASE);
+        accessLog.tail++;
+    }
+    return NULL;
+}
+
+int start_access_log() {
+    for (uint64_t i = 0; i < ACCESS_LOG_SLOTS; i++) accessLog.slots[i].seq = i;
+    pthread_t thread;
+    return pthread_create(&thread, NULL, access_log_main, NULL) == 0 ? 0 : -1;
+}
+
+// Record store operations
+uint32_t store_count(RecordStore *store) {
+    return __atomic_load_n(&store->count, __ATOMIC_ACQUIRE);
+}
+
+void *store_get(RecordStore *store, uint32_t ref) {
+    return __atomic_load_n(segmented_slot(&store->slots, ref), __ATOMIC_ACQUIRE);
+}
+
+Fragment *render_fragment(RecordStore *store, uint32_t ref, const void *record) {
+    char json[MAX_RECORD_JSON];
+    int len = store->render(ref, record, json);
+    Fragment *fragment = malloc(sizeof(Fragment) + len);
+    if (!fragment) {
+        fprintf(stderr, "Out of memory rendering record\n");
+        abort();
+    }
+    fragment->len = len;
+    memcpy(fragment->data, json, len);
+    return fragment;
+}
+
+// Records recovered from disk have no fragment until a reader first needs one;
+// racing readers may both render it, and the loser frees its copy
+Fragment *store_fragment(RecordStore *store, uint32_t ref) {
+    Fragment **slot = (Fragment **)segmented_slot(&store->fragments, ref);
+    Fragment *fragment = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    WorkerMetrics *metrics = thread_metrics;
+    if (fragment) {
+        if (metrics) metric_add(&metrics->fragment_hits, 1);
+        return fragment;
+    }
+    
+    if (metrics) metric_add(&metrics->fragment_renders, 1);
+    Fragment *rendered = render_fragment(store, ref, store_get(store, ref));
+    if (__atomic_compare_exchange_n(slot, &fragment, rendered, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&store->fragment_bytes, rendered->len, __ATOMIC_RELAXED);
+        return rendered;
+    }
+    free(rendered);
+    return fragment;
+}
+
+// Publish a fully written record and its fragment (NULL to render it on first use)
+// in the next slot and return its index (caller holds write_lock)
+uint32_t store_publish(RecordStore *store, void *record, Fragment *fragment) {
+    uint32_t ref = store->count;
+    segmented_reserve(&store->slots, ref);
+    segmented_reserve(&store->fragments, ref);
+    __atomic_store_n(segmented_slot(&store->slots, ref), record, __ATOMIC_RELEASE);
+    if (fragment) {
+        __atomic_store_n(segmented_slot(&store->fragments, ref), fragment, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&store->fragment_bytes, fragment->len, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&store->count, ref + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&store->generation, store->generation + 1, __ATOMIC_RELEASE);
+    return ref;
+}
+
+uint32_t store_append(RecordStore *store, void *record) {
+    return store_publish(store, record, render_fragment(store, store->count, record));
+}
+
+// Re-render record ref after its mutable columns changed and swap the fragment in; the old one
+// is freed once no reader can hold it (caller holds write_lock)
+void store_refresh(RecordStore *store, uint32_t ref) {
+    Fragment *fragment = render_fragment(store, ref, store_get(store, ref));
+    // Exchange, so a fragment a reader has just rendered lazily from the old values is retired too
+    Fragment *old_fragment = __atomic_exchange_n((Fragment **)segmented_slot(&store->fragments, ref), fragment,
+                                                 __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&store->fragment_bytes, fragment->len, __ATOMIC_RELAXED);
+    if (old_fragment) __atomic_sub_fetch(&store->fragment_bytes, old_fragment->len, __ATOMIC_RELAXED);
+    __atomic_store_n(&store->generation, store->generation + 1, __ATOMIC_RELEASE);
+    if (old_fragment) retire(old_fragment, free);
+}
+
+// Drop record ref's fragment once it is no longer listed; a reader that still needs it renders it
+// again (caller holds write_lock)
+void store_release_fragment(RecordStore *store, uint32_t ref) {
+    Fragment *old_fragment = __atomic_exchange_n((Fragment **)segmented_slot(&store->fragments, ref), NULL,
+                                                 __ATOMIC_ACQ_REL);
+    if (!old_fragment) return;
+    __atomic_sub_fetch(&store->fragment_bytes, old_fragment->len, __ATOMIC_RELAXED);
+    retire(old_fragment, free);
+}
+
+size_t store_memory(RecordStore *store) {
+    uint32_t count = store_count(store);
+    return segmented_memory(&store->slots) + segmented_memory(&store->fragments) +
+           __atomic_load_n(&store->slab.chunk_count, __ATOMIC_RELAXED) * (sizeof(SlabChunk) + SLAB_CHUNK_SIZE) +
+           __atomic_load_n(&store->fragment_bytes, __ATOMIC_RELAXED) + (size_t)count * sizeof(Fragment);
+}
+
+Patient *get_patient(uint32_t ref) {
+    return store_get(&patientStore, ref);
+}
+
+ActionRecord *get_action(uint32_t ref) {
+    return store_get(&actionStore, ref);
+}
+
+ActionStatus action_status(uint32_t ref) {
+    return __atomic_load_n((uint8_t *)column_at(&actionStatus, ref), __ATOMIC_ACQUIRE);
+}
+
+ActionPriority action_priority(uint32_t ref) {
+    return *(uint8_t *)column_at(&actionPriority, ref);
+}
+
+uint16_t action_assignee(uint32_t ref) {
+    return *(uint16_t *)column_at(&actionAssignee, ref);
+}
+
+uint32_t action_patient(uint32_t ref) {
+    return *(uint32_t *)column_at(&actionPatient, ref);
+}
+
+int64_t action_updated_at(uint32_t ref) {
+    return __atomic_load_n((int64_t *)column_at(&actionUpdatedAt, ref), __ATOMIC_ACQUIRE);
+}
+
+PatientTier patient_tier(uint32_t ref) {
+    uint32_t offset;
+    uint32_t segment = segment_of(ref, &offset);
+    char *tiers = __atomic_load_n(&patientTier.segments[segment], __ATOMIC_ACQUIRE);
+    return tiers ? (PatientTier)__atomic_load_n((uint8_t *)tiers + offset, __ATOMIC_ACQUIRE) : TIER_HOT;
+}
+
+// The snapshot thread is the column's only writer
+void set_patient_tier(uint32_t ref, PatientTier tier) {
+    column_reserve(&patientTier, ref);
+    __atomic_store_n((uint8_t *)column_at(&patientTier, ref), (uint8_t)tier, __ATOMIC_RELEASE);
+}
+
+// Actions go with their patient: once it leaves the hot tier they are read-only and unlisted
+int action_archived(uint32_t ref) {
+    return patient_tier(action_patient(ref)) != TIER_HOT;
+}
+
+int record_archived(RecordStore *store, uint32_t ref) {
+    return store == &patientStore ? patient_tier(ref) != TIER_HOT : action_archived(ref);
+}
+
+// Name of a record's type (field 0) or initiating department (field 1), from its vocabulary or
+// from the names stored after initiatedBy
+const char *record_name(const ActionRecord *record, Vocabulary *vocabulary, uint16_t code, int field) {
+    if (code != VOCABULARY_OVERFLOW) return vocabulary_name(vocabulary, code);
+    const char *name = record->initiatedBy + strlen(record->initiatedBy) + 1;
+    return field == 0 ? name : name + strlen(name) + 1;
+}
+
+// Rebuild the API form of action ref from its record and columns
+void action_expand(uint32_t ref, const ActionRecord *record, ClinicalAction *action) {
+    action->id = record->id;
+    format_uuid(&get_patient(action_patient(ref))->id, action->patientId);
+    strcpy(action->type, record_name(record, &actionTypes, record->type, 0));
+    strcpy(action->title, record->title);
+    strcpy(action->description, record->description);
+    strcpy(action->initiatedBy, record->initiatedBy);
+    strcpy(action->initiatedByDepartment,
+           record_name(record, &departments, record->initiatedByDepartment, 1));
+    strcpy(action->assignedTo, vocabulary_name(&departments, action_assignee(ref)));
+    strcpy(action->status, statusNames[action_status(ref)]);
+    strcpy(action->priority, priorityNames[action_priority(ref)]);
+    action->createdAt = record->createdAt;
+    action->updatedAt = action_updated_at(ref);
+}
+
+ActionList **patient_action_list(uint32_t patient_ref) {
+    return (ActionList **)segmented_slot(&patientActions, patient_ref);
+}
+
+// Hash index operations
+const Uuid *patient_id_of(uint32_t ref) {
+    return &get_patient(ref)->id;
+}
+
+const Uuid *action_id_of(uint32_t ref) {
+    return &get_action(ref)->id;
+}
+
+uint32_t hash_id(const Uuid *id) {
+    uint64_t hi, lo;
+    memcpy(&hi, id->bytes, 8);
+    memcpy(&lo, id->bytes + 8, 8);
+    uint64_t hash = (hi ^ (lo * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+    return (uint32_t)(hash >> 32);
+}
+
+IndexTable *index_table_create(uint32_t capacity) {
+    IndexTable *table = calloc(1, sizeof(IndexTable) + capacity * sizeof(uint64_t));
+    if (!table) {
+        fprintf(stderr, "Out of memory allocating index\n");
+        abort();
+    }
+    table->mask = capacity - 1;
+    return table;
+}
+
+void index_table_put(IndexTable *table, uint64_t entry) {
+    uint32_t i = (uint32_t)(entry >> 32) & table->mask;
+    while (table->entries[i]) i = (i + 1) & table->mask;
+    __atomic_store_n(&table->entries[i], entry, __ATOMIC_RELEASE);
+    table->used++;
+}
+
+// Returns the record index stored under key, or -1 (lock-free; call inside a read section)
+int index_lookup(HashIndex *index, const Uuid *key) {
+    IndexTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    if (!table) return -1;
+    
+    uint32_t hash = hash_id(key);
+    for (uint32_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+        uint64_t entry = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+        if (!entry) return -1;
+        if ((uint32_t)(entry >> 32) == hash) {
+            uint32_t ref = (uint32_t)entry - 1;
+            if (memcmp(index->key_of(ref), key, sizeof(Uuid)) == 0) return (int)ref;
+        }
+    }
+}
+
+// Look up an id given as text; malformed ids are simply not found
+int index_lookup_text(HashIndex *index, const char *text) {
+    Uuid id;
+    return parse_uuid(text, &id) ? index_lookup(index, &id) : -1;
+}
+
+// Make room for count more entries at no more than half load, rebuilding the table at most once
+// (caller holds write_lock)
+void index_reserve(HashIndex *index, uint32_t count) {
+    IndexTable *table = index->table;
+    uint64_t needed = ((uint64_t)(table ? table->used : 0) + count) * 2;
+    if (table && needed <= (uint64_t)table->mask + 1) return;
+    
+    uint32_t capacity = table ? (table->mask + 1) * 2 : INITIAL_INDEX_CAPACITY;
+    while (capacity < needed) capacity *= 2;
+    IndexTable *grown = index_table_create(capacity);
+    if (table) {
+        for (uint32_t i = 0; i <= table->mask; i++) {
+            if (table->entries[i]) index_table_put(grown, table->entries[i]);
+        }
+    }
+    __atomic_store_n(&index->table, grown, __ATOMIC_RELEASE);
+    if (table) retire(table, free);
+}
+
+// Add a published record to the index, doubling the table at half load (caller holds write_lock)
+void index_insert(HashIndex *index, uint32_t ref) {
+    IndexTable *table = index->table;
+    if (!table || (table->used + 1) * 2 > table->mask + 1) {
+        index_reserve(index, 1);
+        table = index->table;
+    }
+    index_table_put(table, ((uint64_t)hash_id(index->key_of(ref)) << 32) | (ref + 1));
+}
+
+// Append an action to its patient's list, copying the list when it is full (caller holds write_lock)
+void action_list_append(ActionList **slot, uint32_t ref) {
+    ActionList *list = *slot;
+    if (!list || list->count == list->capacity) {
+        uint32_t capacity = list ? list->capacity * 2 : INITIAL_ACTION_LIST_CAPACITY;
+        ActionList *grown = malloc(sizeof(ActionList) + capacity * sizeof(uint32_t));
+        if (!grown) {
+            fprintf(stderr, "Out of memory allocating action list\n");
+            abort();
+        }
+        grown->count = list ? list->count : 0;
+        grown->capacity = capacity;
+        if (list) memcpy(grown->refs, list->refs, list->count * sizeof(uint32_t));
+        grown->refs[grown->count] = ref;
+        grown->count++;
+        __atomic_store_n(slot, grown, __ATOMIC_RELEASE);
+        if (list) retire(list, free);
+        return;
+    }
+    list->refs[list->count] = ref;
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELEASE);
+}
+
+void index_patient(uint32_t ref) {
+    index_insert(&patientIndex, ref);
+    segmented_reserve(&patientActions, ref);
+    bitmap_set(&hotPatients, ref);
+    search_index_patient(ref);
+    stats_count_patient(1, strcmp(get_patient(ref)->status, "admitted") == 0);
+}
+
+// Secondary index operations
+// Bitmap of value code, or NULL if no action has ever had that value (lock-free)
+FieldBitmap *field_bitmap(FieldIndex *index, uint32_t code) {
+    if (code >= __atomic_load_n(&index->limit, __ATOMIC_ACQUIRE)) return NULL;
+    return __atomic_load_n((FieldBitmap **)segmented_slot(&index->bitmaps, code), __ATOMIC_ACQUIRE);
+}
+
+BitmapBlock *bitmap_block(FieldBitmap *bitmap, uint32_t block) {
+    BitmapDirectory *directory = __atomic_load_n(&bitmap->directory, __ATOMIC_ACQUIRE);
+    if (!directory || block >= directory->capacity) return NULL;
+    return __atomic_load_n(&directory->blocks[block], __ATOMIC_ACQUIRE);
+}
+
+// Allocate the block holding bit if needed, copying the directory when it is too small (caller holds write_lock)
+BitmapBlock *bitmap_reserve(FieldBitmap *bitmap, uint32_t bit) {
+    uint32_t block = bit / BITMAP_BLOCK_BITS;
+    BitmapDirectory *directory = bitmap->directory;
+    if (!directory || block >= directory->capacity) {
+        uint32_t capacity = directory ? directory->capacity : 4;
+        while (capacity <= block) capacity *= 2;
+        BitmapDirectory *grown = calloc(1, sizeof(BitmapDirectory) + capacity * sizeof(BitmapBlock *));
+        if (!grown) {
+            fprintf(stderr, "Out of memory allocating bitmap\n");
+            abort();
+        }
+        grown->capacity = capacity;
+        if (directory) memcpy(grown->blocks, directory->blocks, directory->capacity * sizeof(BitmapBlock *));
+        __atomic_store_n(&bitmap->directory, grown, __ATOMIC_RELEASE);
+        if (directory) retire(directory, free);
+        directory = grown;
+    }
+    if (!directory->blocks[block]) {
+        BitmapBlock *allocated = calloc(1, sizeof(BitmapBlock));
+        if (!allocated) {
+            fprintf(stderr, "Out of memory allocating bitmap\n");
+            abort();
+        }
+        __atomic_store_n(&directory->blocks[block], allocated, __ATOMIC_RELEASE);
+    }
+    return directory->blocks[block];
+}
+
+// Set bit, allocating its block if needed (caller holds write_lock)
+void bitmap_set(FieldBitmap *bitmap, uint32_t bit) {
+    BitmapBlock *block = bitmap_reserve(bitmap, bit);
+    uint32_t word = (bit % BITMAP_BLOCK_BITS) / 64;
+    // Set the bit before its summary bit, so a summary bit never hides a set word
+    __atomic_store_n(&block->words[word], block->words[word] | (1ull << (bit % 64)), __ATOMIC_RELEASE);
+    __atomic_store_n(&block->summary[word / 64], block->summary[word / 64] | (1ull << (word % 64)), __ATOMIC_RELEASE);
+}
+
+// Clear bit, and its summary bit once its word is empty (caller holds write_lock)
+void bitmap_clear(FieldBitmap *bitmap, uint32_t bit) {
+    BitmapBlock *block = bitmap_block(bitmap, bit / BITMAP_BLOCK_BITS);
+    if (!block) return;
+    uint32_t word = (bit % BITMAP_BLOCK_BITS) / 64;
+    uint64_t bits = block->words[word] & ~(1ull << (bit % 64));
+    __atomic_store_n(&block->words[word], bits, __ATOMIC_RELEASE);
+    if (!bits) {
+        __atomic_store_n(&block->summary[word / 64], block->summary[word / 64] & ~(1ull << (word % 64)),
+                         __ATOMIC_RELEASE);
+    }
+}
+
+// First set bit from bit up to end, or end if there is none; summary bits skip empty words and
+// missing blocks skip 65536 bits at a time (call inside a read section)
+uint32_t bitmap_next(FieldBitmap *bitmap, uint32_t bit, uint32_t end) {
+    while (bit < end) {
+        uint32_t base = bit - bit % BITMAP_BLOCK_BITS;
+        uint32_t first = (bit - base) / 64;
+        BitmapBlock *block = bitmap_block(bitmap, bit / BITMAP_BLOCK_BITS);
+        for (uint32_t s = first / 64; block && s < BITMAP_BLOCK_WORDS / 64; s++) {
+            uint64_t summary = __atomic_load_n(&block->summary[s], __ATOMIC_ACQUIRE);
+            if (s == first / 64) summary &= ~0ull << (first % 64);
+            while (summary) {
+                uint32_t word = s * 64 + __builtin_ctzll(summary);
+                summary &= summary - 1;
+                uint64_t bits = __atomic_load_n(&block->words[word], __ATOMIC_ACQUIRE);
+                if (word == first) bits &= ~0ull << (bit % 64);
+                if (bits) {
+                    uint32_t found = base + word * 64 + __builtin_ctzll(bits);
+                    return found < end ? found : end;
+                }
+            }
+        }
+        bit = base + BITMAP_BLOCK_BITS;
+    }
+    return end;
+}
+
+// Add an action to the bitmap of its field value, creating the bitmap on first use (caller holds write_lock)
+void field_index_add(FieldIndex *index, uint32_t code, uint32_t ref) {
+    FieldBitmap *bitmap = field_bitmap(index, code);
+    if (!bitmap) {
+        bitmap = calloc(1, sizeof(FieldBitmap));
+        if (!bitmap) {
+            fprintf(stderr, "Out of memory allocating bitmap\n");
+            abort();
+        }
+        segmented_reserve(&index->bitmaps, code);
+        __atomic_store_n((FieldBitmap **)segmented_slot(&index->bitmaps, code), bitmap, __ATOMIC_RELEASE);
+        if (code >= index->limit) __atomic_store_n(&index->limit, code + 1, __ATOMIC_RELEASE);
+    }
+    bitmap_set(bitmap, ref);
+}
+
+// Remove an action from the bitmap of its old field value (caller holds write_lock)
+void field_index_remove(FieldIndex *index, uint32_t code, uint32_t ref) {
+    FieldBitmap *bitmap = field_bitmap(index, code);
+    if (bitmap) bitmap_clear(bitmap, ref);
+}
+
+// Department queue operations
+int queue_before(const QueueEntry *a, const QueueEntry *b) {
+    if (a->rank != b->rank) return a->rank < b->rank;
+    if (a->created != b->created) return a->created < b->created;
+    return a->ref < b->ref;
+}
+
+// Queue of department, created on first use if create is set (lock-free when create is 0)
+DepartmentQueue *department_queue(uint16_t department, int create) {
+    if (department >= MAX_VOCABULARY_CODES) return NULL;
+    DepartmentQueue *queue = __atomic_load_n(&departmentQueues[department], __ATOMIC_ACQUIRE);
+    if (queue || !create) return queue;
+    
+    queue = calloc(1, sizeof(DepartmentQueue));
+    if (!queue) {
+        fprintf(stderr, "Out of memory allocating department queue\n");
+        abort();
+    }
+    __atomic_store_n(&departmentQueues[department], queue, __ATOMIC_RELEASE);
+    return queue;
+}
+
+void queue_publish_top(DepartmentQueue *queue) {
+    __atomic_store_n(&queue->top, queue->size ? queue->heap[0].ref + 1 : 0, __ATOMIC_RELEASE);
+}
+
+void queue_place(DepartmentQueue *queue, uint32_t index, QueueEntry entry) {
+    queue->heap[index] = entry;
+    queuePositions[entry.ref] = index + 1;
+}
+
+void queue_sift_up(DepartmentQueue *queue, uint32_t index) {
+    QueueEntry entry = queue->heap[index];
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (!queue_before(&entry, &queue->heap[parent])) break;
+        queue_place(queue, index, queue->heap[parent]);
+        index = parent;
+    }
+    queue_place(queue, index, entry);
+}
+
+void queue_sift_down(DepartmentQueue *queue, uint32_t index) {
+    QueueEntry entry = queue->heap[index];
+    for (;;) {
+        uint32_t child = 2 * index + 1;
+        if (child >= queue->size) break;
+        if (child + 1 < queue->size && queue_before(&queue->heap[child + 1], &queue->heap[child])) child++;
+        if (!queue_before(&queue->heap[child], &entry)) break;
+        queue_place(queue, index, queue->heap[child]);
+        index = child;
+    }
+    queue_place(queue, index, entry);
+}
+
+void queue_push(uint32_t ref) {
+    if (ref >= queuePositionCapacity) {
+        uint32_t capacity = queuePositionCapacity ? queuePositionCapacity : 1024;
+        while (capacity <= ref) capacity *= 2;
+        uint32_t *positions = realloc(queuePositions, capacity * sizeof(uint32_t));
+        if (!positions) {
+            fprintf(stderr, "Out of memory growing queue positions\n");
+            abort();
+        }
+        memset(positions + queuePositionCapacity, 0, (capacity - queuePositionCapacity) * sizeof(uint32_t));
+        queuePositions = positions;
+        queuePositionCapacity = capacity;
+    }
+    
+    DepartmentQueue *queue = department_queue(action_assignee(ref), 1);
+    if (queue->size == queue->capacity) {
+        uint32_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        QueueEntry *heap = realloc(queue->heap, capacity * sizeof(QueueEntry));
+        if (!heap) {
+            fprintf(stderr, "Out of memory growing department queue\n");
+            abort();
+        }
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+    queue->heap[queue->size] = (QueueEntry){ ref, action_priority(ref), get_action(ref)->createdAt };
+    queue_sift_up(queue, queue->size++);
+    queue_publish_top(queue);
+}
+
+void queue_remove(uint32_t ref) {
+    DepartmentQueue *queue = department_queue(action_assignee(ref), 0);
+    if (!queue || ref >= queuePositionCapacity || !queuePositions[ref]) return;
+    uint32_t index = queuePositions[ref] - 1;
+    queuePositions[ref] = 0;
+    QueueEntry last = queue->heap[--queue->size];
+    if (index < queue->size) {
+        queue_place(queue, index, last);
+        if (index > 0 && queue_before(&last, &queue->heap[(index - 1) / 2])) queue_sift_up(queue, index);
+        else queue_sift_down(queue, index);
+    }
+    queue_publish_top(queue);
+}
+
+void index_action(uint32_t ref) {
+    index_insert(&actionIndex, ref);
+    action_list_append(patient_action_list(action_patient(ref)), ref);
+    bitmap_set(&hotActions, ref);
+    field_index_add(&assignedToIndex, action_assignee(ref), ref);
+    field_index_add(&statusIndex, action_status(ref), ref);
+    field_index_add(&priorityIndex, action_priority(ref), ref);
+    if (action_status(ref) == STATUS_PENDING) queue_push(ref);
+    search_index_action(ref);
+    stats_count_action(action_assignee(ref), action_status(ref), action_priority(ref), 1);
+}
+
+// Store a new action for patient_ref: intern its names, copy its text into the heap and fill its
+// columns, rendering its fragment now unless render is 0 (recovery). Returns its index, or -1 if
+// assignedTo is a new department and every department code is taken (caller holds write_lock).
+int add_action(ClinicalAction *action, uint32_t patient_ref, int render) {
+    // Only assignedTo needs a code, to route and count by; an initiating department is looked up
+    // so that it never takes one, and a type past the vocabulary's limit is stored as text
+    int assignedTo = vocabulary_intern(&departments, action->assignedTo);
+    if (assignedTo < 0) return -1;
+    int type = vocabulary_intern(&actionTypes, action->type);
+    int initiatedByDepartment = vocabulary_find(&departments, action->initiatedByDepartment);
+    int status = enum_code(statusNames, STATUS_COUNT, action->status);
+    int priority = enum_code(priorityNames, PRIORITY_COUNT, action->priority);
+    
+    ActionRecord *record = slab_alloc(&actionStore.slab);
+    record->id = action->id;
+    record->createdAt = action->createdAt;
+    record->title = heap_copy(&actionText, action->title);
+    record->description = heap_copy(&actionText, action->description);
+    if (type < 0 || initiatedByDepartment < 0) {
+        char names[sizeof(action->initiatedBy) + sizeof(action->type) + sizeof(action->initiatedByDepartment)];
+        size_t len = 0;
+        const char *fields[] = { action->initiatedBy, action->type, action->initiatedByDepartment };
+        for (int i = 0; i < 3; i++) {
+            size_t field_len = strlen(fields[i]) + 1;
+            memcpy(names + len, fields[i], field_len);
+            len += field_len;
+        }
+        record->initiatedBy = heap_copy_bytes(&actionText, names, len);
+        type = initiatedByDepartment = VOCABULARY_OVERFLOW;
+    } else {
+        record->initiatedBy = heap_copy(&actionText, action->initiatedBy);
+    }
+    record->type = (uint16_t)type;
+    record->initiatedByDepartment = (uint16_t)initiatedByDepartment;
+    
+    // Columns are filled before the record is published, so readers never see them unset
+    uint32_t ref = actionStore.count;
+    column_reserve(&actionStatus, ref);
+    column_reserve(&actionPriority, ref);
+    column_reserve(&actionAssignee, ref);
+    column_reserve(&actionPatient, ref);
+    column_reserve(&actionUpdatedAt, ref);
+    *(uint8_t *)column_at(&actionStatus, ref) = (uint8_t)(status < 0 ? STATUS_PENDING : status);
+    *(uint8_t *)column_at(&actionPriority, ref) = (uint8_t)(priority < 0 ? PRIORITY_MEDIUM : priority);
+    *(uint16_t *)column_at(&actionAssignee, ref) = (uint16_t)assignedTo;
+    *(uint32_t *)column_at(&actionPatient, ref) = patient_ref;
+    *(int64_t *)column_at(&actionUpdatedAt, ref) = action->updatedAt;
+    
+    if (render) store_append(&actionStore, record);
+    else store_publish(&actionStore, record, NULL);
+    index_action(ref);
+    return (int)ref;
+}
+
+// Move an action to a new status in place, then re-render it and update its status bitmap and
+// department queue (caller holds write_lock)
+void update_action_status(uint32_t ref, ActionStatus status, int64_t updatedAt) {
+    ActionStatus old = action_status(ref);
+    if (old == STATUS_PENDING && status != STATUS_PENDING) queue_remove(ref);
+    field_index_remove(&statusIndex, old, ref);
+    __atomic_store_n((uint8_t *)column_at(&actionStatus, ref), (uint8_t)status, __ATOMIC_RELEASE);
+    __atomic_store_n((int64_t *)column_at(&actionUpdatedAt, ref), updatedAt, __ATOMIC_RELEASE);
+    store_refresh(&actionStore, ref);
+    field_index_add(&statusIndex, status, ref);
+    if (old != STATUS_PENDING && status == STATUS_PENDING) queue_push(ref);
+    stats_count_action(action_assignee(ref), old, action_priority(ref), -1);
+    stats_count_action(action_assignee(ref), status, action_priority(ref), 1);
+}
+
+void patient_release(void *record) {
+    slab_release(&patientStore.slab, record);
+}
+
+// Swap in a copy of patient ref in the new status, since readers hold records without locking
+// (the old copy is retired back to the slab once no reader can hold it), then re-render it and move
+// it between the admitted counts (caller holds write_lock)
+void update_patient_status(uint32_t ref, const char *status) {
+    Patient *old = get_patient(ref);
+    Patient *patient = slab_alloc(&patientStore.slab);
+    *patient = *old;
+    snprintf(patient->status, sizeof(patient->status), "%s", status);
+    __atomic_store_n(segmented_slot(&patientStore.slots, ref), patient, __ATOMIC_RELEASE);
+    store_refresh(&patientStore, ref);
+    stats_count_patient(0, (strcmp(patient->status, "admitted") == 0) - (strcmp(old->status, "admitted") == 0));
+    retire(old, patient_release);
+}
+
+// Find up to max actions from index start onward that are in every bitmap (an empty set matches
+// every hot action), writing their indexes to refs; returns how many were found (call inside a
+// read section)
+uint32_t bitmap_query(FieldBitmap **bitmaps, int bitmap_count, uint32_t start, uint32_t count,
+                      uint32_t *refs, uint32_t max) {
+    uint32_t found = 0;
+    if (count == 0) return 0;
+    FieldBitmap *hot = &hotActions;
+    if (bitmap_count == 0) {
+        bitmaps = &hot;
+        bitmap_count = 1;
+    }
+    
+    uint32_t last_block = (count - 1) / BITMAP_BLOCK_BITS;
+    for (uint32_t block_index = start / BITMAP_BLOCK_BITS; block_index <= last_block && found < max; block_index++) {
+        BitmapBlock *blocks[3];
+        int present = 1;
+        for (int i = 0; i < bitmap_count && present; i++) {
+            blocks[i] = bitmap_block(bitmaps[i], block_index);
+            present = blocks[i] != NULL;
+        }
+        if (!present) continue;
+        
+        uint32_t base = block_index * BITMAP_BLOCK_BITS;
+        uint32_t first_word = start > base ? (start - base) / 64 : 0;
+        for (uint32_t s = first_word / 64; s < BITMAP_BLOCK_WORDS / 64 && found < max; s++) {
+            uint64_t summary = ~0ull;
+            for (int i = 0; i < bitmap_count; i++) summary &= __atomic_load_n(&blocks[i]->summary[s], __ATOMIC_ACQUIRE);
+            while (summary && found < max) {
+                uint32_t word = s * 64 + __builtin_ctzll(summary);
+                summary &= summary - 1;
+                if (word < first_word) continue;
+                
+                uint64_t bits = ~0ull;
+                for (int i = 0; i < bitmap_count; i++) bits &= __atomic_load_n(&blocks[i]->words[word], __ATOMIC_ACQUIRE);
+                while (bits && found < max) {
+                    uint32_t ref = base + word * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    if (ref >= start && ref < count) refs[found++] = ref;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+// First position in refs[0, count) (the action indexes themselves when refs is NULL) whose
+// action was created at or after local timestamp. Ids are generated under the write lock, so
+// actions are appended in id order, and so are the indexes in a patient's list; the Unix time in
+// the id keeps that order even where the local clock repeats an hour (call inside a read section).
+uint32_t created_lower_bound(const uint32_t *refs, uint32_t count, int64_t timestamp) {
+    int64_t bound = unix_time(timestamp);
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (uuid_seconds(&get_action(refs ? refs[mid] : mid)->id) < bound) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Search index operations
+// Copy the next term of text at *p into term (lowercased, cut at SEARCH_MAX_TERM - 1 bytes) and
+// return its length, or 0 at the end of text. Bytes of UTF-8 sequences count as letters.
+uint32_t search_next_term(const char **p, char *term) {
+    const unsigned char *s = (const unsigned char *)*p;
+    while (*s && !isalnum(*s) && *s < 0x80) s++;
+    uint32_t len = 0;
+    for (; *s && (isalnum(*s) || *s >= 0x80); s++) {
+        if (len < SEARCH_MAX_TERM - 1) term[len++] = (char)tolower(*s);
+    }
+    term[len] = '\0';
+    *p = (const char *)s;
+    return len;
+}
+
+SearchTerm *search_term(uint32_t id) {
+    return __atomic_load_n(segmented_slot(&searchIndex.terms, id), __ATOMIC_ACQUIRE);
+}
+
+// Id of term, or -1 if no record has used it (lock-free)
+int search_term_find(const char *term) {
+    IndexTable *table = __atomic_load_n(&searchIndex.table, __ATOMIC_ACQUIRE);
+    if (!table) return -1;
+    uint32_t hash = hash_string(term);
+    for (uint32_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+        uint64_t entry = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+        if (!entry) return -1;
+        if ((uint32_t)(entry >> 32) == hash && strcmp(search_term((uint32_t)entry - 1)->text, term) == 0) {
+            return (int)((uint32_t)entry - 1);
+        }
+    }
+}
+
+int compare_term_ids(const void *a, const void *b) {
+    return strcmp(search_term(*(const uint32_t *)a)->text, search_term(*(const uint32_t *)b)->text);
+}
+
+// Sort the tail and merge it into a new sorted run (caller holds write_lock)
+void search_merge_terms() {
+    TermOrder *sorted = searchIndex.sorted;
+    uint32_t merged = sorted ? sorted->count : 0, count = searchIndex.count;
+    TermOrder *order = malloc(sizeof(TermOrder) + count * sizeof(uint32_t));
+    if (!order) {
+        fprintf(stderr, "Out of memory merging search terms\n");
+        abort();
+    }
+    uint32_t *tail = order->ids + merged;
+    for (uint32_t id = merged; id < count; id++) tail[id - merged] = id;
+    qsort(tail, count - merged, sizeof(uint32_t), compare_term_ids);
+    // The tail is sorted in place at the end of the new run; merging from the front never writes
+    // past the next unread tail id
+    uint32_t i = 0, j = 0, k = 0, tail_count = count - merged;
+    while (i < merged) {
+        if (j < tail_count && compare_term_ids(&tail[j], &sorted->ids[i]) < 0) order->ids[k++] = tail[j++];
+        else order->ids[k++] = sorted->ids[i++];
+    }
+    order->count = count;
+    __atomic_store_n(&searchIndex.sorted, order, __ATOMIC_RELEASE);
+    if (sorted) retire(sorted, free);
+}
+
+// Term with this text, added if it is new (caller holds write_lock)
+SearchTerm *search_term_intern(const char *text, uint32_t len) {
+    int found = search_term_find(text);
+    if (found >= 0) return search_term(found);
+    
+    uint32_t id = searchIndex.count;
+    SearchTerm *term = slab_alloc(&searchIndex.slab);
+    term->text = heap_copy(&searchIndex.text, text);
+    term->len = len;
+    segmented_reserve(&searchIndex.terms, id);
+    __atomic_store_n(segmented_slot(&searchIndex.terms, id), term, __ATOMIC_RELEASE);
+    
+    IndexTable *table = searchIndex.table;
+    if (!table || (table->used + 1) * 2 > table->mask + 1) {
+        IndexTable *grown = index_table_create(table ? (table->mask + 1) * 2 : INITIAL_INDEX_CAPACITY);
+        if (table) {
+            for (uint32_t i = 0; i <= table->mask; i++) {
+                if (table->entries[i]) index_table_put(grown, table->entries[i]);
+            }
+        }
+        __atomic_store_n(&searchIndex.table, grown, __ATOMIC_RELEASE);
+        if (table) retire(table, free);
+        table = grown;
+    }
+    index_table_put(table, (uint64_t)hash_string(text) << 32 | (id + 1));
+    __atomic_store_n(&searchIndex.count, id + 1, __ATOMIC_RELEASE);
+    
+    TermOrder *sorted = searchIndex.sorted;
+    if (searchIndex.count - (sorted ? sorted->count : 0) >= SEARCH_TAIL_TERMS) search_merge_terms();
+    return term;
+}
+
+// Post record ref of store under every term of text. Titles are indexed before the other field, so
+// a term in both keeps its title bit. (caller holds write_lock)
+void search_index_text(SearchStore store, uint32_t ref, const char *text, int title) {
+    char term[SEARCH_MAX_TERM];
+    uint32_t len;
+    while ((len = search_next_term(&text, term)) > 0) {
+        ActionList **postings = &search_term_intern(term, len)->postings[store];
+        ActionList *list = *postings;
+        if (list && list->count > 0 && list->refs[list->count - 1] >> 1 == ref) continue;
+        uint32_t capacity = list ? list->capacity : 0;
+        action_list_append(postings, ref << 1 | title);
+        __atomic_store_n(&searchIndex.postings, searchIndex.postings + 1, __ATOMIC_RELAXED);
+        if ((*postings)->capacity != capacity) {
+            size_t grown = ((*postings)->capacity - capacity) * sizeof(uint32_t) + (list ? 0 : sizeof(ActionList));
+            __atomic_store_n(&searchIndex.posting_bytes, searchIndex.posting_bytes + grown, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void search_index_patient(uint32_t ref) {
+    Patient *patient = get_patient(ref);
+    search_index_text(SEARCH_PATIENTS, ref, patient->name, 1);
+    search_index_text(SEARCH_PATIENTS, ref, patient->condition, 0);
+}
+
+void search_index_action(uint32_t ref) {
+    ActionRecord *record = get_action(ref);
+    search_index_text(SEARCH_ACTIONS, ref, record->title, 1);
+    search_index_text(SEARCH_ACTIONS, ref, record->description, 0);
+}
+
+// Write to ids the term that equals text, then (for a prefix query) up to max in total that start
+// with it in text order; returns how many were written (lock-free)
+uint32_t search_expand(const char *text, uint32_t len, int prefix, uint32_t *ids, uint32_t max) {
+    uint32_t n = 0;
+    int exact = search_term_find(text);
+    if (exact >= 0) ids[n++] = (uint32_t)exact;
+    if (!prefix) return n;
+    
+    // The run is loaded before the count, so it never covers ids past the count
+    TermOrder *sorted = __atomic_load_n(&searchIndex.sorted, __ATOMIC_ACQUIRE);
+    uint32_t count = __atomic_load_n(&searchIndex.count, __ATOMIC_ACQUIRE);
+    uint32_t merged = sorted ? sorted->count : 0, low = 0, high = merged;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (strcmp(search_term(sorted->ids[mid])->text, text) < 0) low = mid + 1;
+        else high = mid;
+    }
+    for (uint32_t i = low; i < merged && n < max; i++) {
+        SearchTerm *term = search_term(sorted->ids[i]);
+        if (strncmp(term->text, text, len) != 0) break;
+        if ((int)sorted->ids[i] != exact) ids[n++] = sorted->ids[i];
+    }
+    for (uint32_t id = merged; id < count && n < max; id++) {
+        if ((int)id != exact && strncmp(search_term(id)->text, text, len) == 0) ids[n++] = id;
+    }
+    return n;
+}
+
+// Sample data helpers (run before the workers start)
+uint32_t add_sample_patient(const char *name, int age, const char *gender, const char *bloodGroup,
+                            const char *admissionDate, const char *condition) {
+    Patient *patient = slab_alloc(&patientStore.slab);
+    strcpy(patient->name, name);
+    patient->age = age;
+    strcpy(patient->gender, gender);
+    strcpy(patient->bloodGroup, bloodGroup);
+    strcpy(patient->admissionDate, admissionDate);
+    strcpy(patient->condition, condition);
+    strcpy(patient->status, "admitted");
+    generate_uuid(&patient->id);
+    
+    uint32_t ref = store_append(&patientStore, patient);
+    index_patient(ref);
+    wal_log(WAL_PATIENT, patient);
+    return ref;
+}
+
+void add_sample_action(uint32_t patient_ref, const char *type, const char *title, const char *description,
+                       const char *initiatedBy, const char *assignedTo, const char *status, const char *priority) {
+    ClinicalAction action = { 0 };
+    format_uuid(&get_patient(patient_ref)->id, action.patientId);
+    strcpy(action.type, type);
+    strcpy(action.title, title);
+    strcpy(action.description, description);
+    strcpy(action.initiatedBy, initiatedBy);
+    strcpy(action.initiatedByDepartment, "Doctor");
+    strcpy(action.assignedTo, assignedTo);
+    strcpy(action.status, status);
+    strcpy(action.priority, priority);
+    stamp_action(&action);
+    
+    add_action(&action, patient_ref, 1);
+    wal_log(WAL_ACTION, &action);
+}
+
+void initialize_data() {
+    // Sample patients
+    uint32_t john = add_sample_patient("John Smith", 45, "Male", "O+", "2024-01-15", "Chest Pain");
+    uint32_t sarah = add_sample_patient("Sarah Johnson", 32, "Female", "A+", "2024-01-16", "Fractured Leg");
+    add_sample_patient("Michael Chen", 58, "Male", "B+", "2024-01-14", "Diabetes Management");
+    
+    // Sample clinical actions
+    add_sample_action(john, "prescription", "Pain Medication",
+                      "Prescribe ibuprofen 400mg every 6 hours for chest pain",
+                      "Dr. Wilson", "Pharmacy", "pending", "medium");
+    add_sample_action(sarah, "diagnostic", "X-Ray Imaging",
+                      "Perform leg X-ray to assess fracture severity",
+                      "Dr. Brown", "Radiology", "in-progress", "high");
+}
+
+// Output buffering
+void buffer_reserve(Buffer *buffer, size_t extra) {
+    if (buffer->len + extra <= buffer->cap) return;
+    size_t cap = buffer->cap ? buffer->cap : BUFFER_SIZE;
+    while (cap < buffer->len + extra) cap *= 2;
+    char *data = realloc(buffer->data, cap);
+    if (!data) {
+        fprintf(stderr, "Out of memory growing buffer\n");
+        abort();
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+}
+
+void buffer_append(Buffer *buffer, const char *data, size_t len) {
+    buffer_reserve(buffer, len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+void buffer_printf(Buffer *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    buffer_reserve(buffer, (size_t)len + 1);
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->len, (size_t)len + 1, format, args);
+    va_end(args);
+    buffer->len += len;
+}
+
+// Durable storage encoding
+// Log entries and snapshots share one framing: a 4-byte payload length, the
+// CRC32 of the type byte and payload, the type byte, then the record's fields
+// as 2-byte length-prefixed strings and 4-byte integers, all little-endian.
+uint32_t crc32_table[8][256];
+
+// Slicing-by-8 tables, so checksumming a large log keeps up with reading it
+void crc32_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc32_table[k - 1][i];
+            crc32_table[k][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+        }
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) ^ crc;
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put_u32(char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (char)(value >> (8 * i));
+}
+
+uint32_t get_u32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void put_u64(char *p, uint64_t value) {
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+void encode_u32(Buffer *out, uint32_t value) {
+    char bytes[4];
+    put_u32(bytes, value);
+    buffer_append(out, bytes, 4);
+}
+
+void encode_string(Buffer *out, const char *text) {
+    size_t len = strlen(text);
+    char prefix[2] = { (char)len, (char)(len >> 8) };
+    buffer_append(out, prefix, 2);
+    buffer_append(out, text, len);
+}
+
+// Ids and timestamps are logged as their API text
+void encode_uuid(Buffer *out, const Uuid *id) {
+    char text[37];
+    format_uuid(id, text);
+    encode_string(out, text);
+}
+
+void encode_timestamp(Buffer *out, int64_t timestamp) {
+    char text[20];
+    format_timestamp(timestamp, text);
+    encode_string(out, text);
+}
+
+void encode_patient(Buffer *out, const Patient *patient) {
+    encode_uuid(out, &patient->id);
+    encode_string(out, patient->name);
+    encode_u32(out, (uint32_t)patient->age);
+    encode_string(out, patient->gender);
+    encode_string(out, patient->bloodGroup);
+    encode_string(out, patient->admissionDate);
+    encode_string(out, patient->condition);
+    encode_string(out, patient->status);
+}
+
+void encode_action(Buffer *out, const ClinicalAction *action) {
+    encode_uuid(out, &action->id);
+    encode_string(out, action->patientId);
+    encode_string(out, action->type);
+    encode_string(out, action->title);
+    encode_string(out, action->description);
+    encode_string(out, action->initiatedBy);
+    encode_string(out, action->initiatedByDepartment);
+    encode_string(out, action->assignedTo);
+    encode_string(out, action->status);
+    encode_string(out, action->priority);
+    encode_timestamp(out, action->createdAt);
+    encode_timestamp(out, action->updatedAt);
+}
+
+// Append one framed entry for record to out
+void encode_entry(Buffer *out, WalEntryType type, const void *record) {
+    size_t start = out->len;
+    buffer_reserve(out, WAL_ENTRY_HEADER);
+    out->len += WAL_ENTRY_HEADER;
+    out->data[start + 8] = (char)type;
+    if (type == WAL_PATIENT) {
+        encode_patient(out, record);
+    } else if (type == WAL_ACTION) {
+        encode_action(out, record);
+    } else if (type == WAL_PATIENT_STATUS) {
+        const Patient *patient = record;
+        encode_uuid(out, &patient->id);
+        encode_string(out, patient->status);
+    } else {
+        const ClinicalAction *action = record;
+        encode_uuid(out, &action->id);
+        encode_string(out, action->status);
+        encode_timestamp(out, action->updatedAt);
+    }
+    
+    uint32_t payload_len = out->len - start - WAL_ENTRY_HEADER;
+    put_u32(out->data + start, payload_len);
+    put_u32(out->data + start + 4, crc32_update(0, out->data + start + 8, payload_len + 1));
+}
+
+uint32_t decode_u32(Decoder *decoder) {
+    if (decoder->end - decoder->p < 4) {
+        decoder->ok = 0;
+        return 0;
+    }
+    uint32_t value = get_u32(decoder->p);
+    decoder->p += 4;
+    return value;
+}
+
+// Copy a string field into a fixed-size record field, rejecting one that would not fit
+void decode_string(Decoder *decoder, char *field, size_t size) {
+    if (decoder->end - decoder->p < 2) {
+        decoder->ok = 0;
+        return;
+    }
+    size_t len = decoder->p[0] | decoder->p[1] << 8;
+    decoder->p += 2;
+    if (len >= size || (size_t)(decoder->end - decoder->p) < len) {
+        decoder->ok = 0;
+        return;
+    }
+    memcpy(field, decoder->p, len);
+    field[len] = '\0';
+    decoder->p += len;
+}
+
+void decode_uuid(Decoder *decoder, Uuid *id) {
+    char text[37];
+    decode_string(decoder, text, sizeof(text));
+    if (decoder->ok && !parse_uuid(text, id)) decoder->ok = 0;
+}
+
+void decode_timestamp(Decoder *decoder, int64_t *timestamp) {
+    char text[20];
+    decode_string(decoder, text, sizeof(text));
+    if (decoder->ok && !parse_timestamp(text, timestamp)) decoder->ok = 0;
+}
+
+int decode_patient(Decoder *decoder, Patient *patient) {
+    decode_uuid(decoder, &patient->id);
+    decode_string(decoder, patient->name, sizeof(patient->name));
+    patient->age = (int)decode_u32(decoder);
+    decode_string(decoder, patient->gender, sizeof(patient->gender));
+    decode_string(decoder, patient->bloodGroup, sizeof(patient->bloodGroup));
+    decode_string(decoder, patient->admissionDate, sizeof(patient->admissionDate));
+    decode_string(decoder, patient->condition, sizeof(patient->condition));
+    decode_string(decoder, patient->status, sizeof(patient->status));
+    return decoder->ok && decoder->p == decoder->end;
+}
+
+int decode_action(Decoder *decoder, ClinicalAction *action) {
+    decode_uuid(decoder, &action->id);
+    decode_string(decoder, action->patientId, sizeof(action->patientId));
+    decode_string(decoder, action->type, sizeof(action->type));
+    decode_string(decoder, action->title, sizeof(action->title));
+    decode_string(decoder, action->description, sizeof(action->description));
+    decode_string(decoder, action->initiatedBy, sizeof(action->initiatedBy));
+    decode_string(decoder, action->initiatedByDepartment, sizeof(action->initiatedByDepartment));
+    decode_string(decoder, action->assignedTo, sizeof(action->assignedTo));
+    decode_string(decoder, action->status, sizeof(action->status));
+    decode_string(decoder, action->priority, sizeof(action->priority));
+    decode_timestamp(decoder, &action->createdAt);
+    decode_timestamp(decoder, &action->updatedAt);
+    return decoder->ok && decoder->p == decoder->end;
+}
+
+// Compression
+// Response bodies are compressed with a small DEFLATE (RFC 1951) encoder:
+// LZ77 over hash chains of 3-byte prefixes within the 32 KB window, then
+// blocks of dynamic Huffman codes (or the fixed codes, when those come out
+// shorter). Each thread keeps its own match tables. Positions are stored
+// offset by a base that moves past every input, so entries left by earlier
+// inputs read as stale without clearing the tables.
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_LAZY_LIMIT 32
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_DIST_CODES 30
+
+typedef struct {
+    uint32_t head[1 << DEFLATE_HASH_BITS];  // newest position + base with each hash
+    uint32_t prev[DEFLATE_WINDOW];          // next older position + base in the same chain
+    uint32_t base;
+    uint8_t length_code[DEFLATE_MAX_MATCH - DEFLATE_MIN_MATCH + 1];
+    uint8_t dist_code[512];
+    uint32_t symbols[DEFLATE_BLOCK_SYMBOLS];  // a literal byte, or MATCH_FLAG | (length - 3) << 16 | (distance - 1)
+    uint32_t symbol_count;
+    Buffer *out;
+    uint64_t bits;
+    int bit_count;
+} Deflater;
+
+#define DEFLATE_MATCH_FLAG 0x80000000u
+
+const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99,
+                                  115, 131, 163, 195, 227, 258 };
+const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+                                1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12,
+                                13, 13 };
+// Order code-length code lengths are sent in
+const uint8_t codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+__thread Deflater *thread_deflater;
+
+Deflater *deflater_get() {
+    if (thread_deflater) return thread_deflater;
+    Deflater *d = calloc(1, sizeof(Deflater));
+    if (!d) {
+        fprintf(stderr, "Out of memory allocating deflater\n");
+        abort();
+    }
+    d->base = 1;
+    for (int code = 0; code < 29; code++) {
+        for (int len = lengthBase[code]; len < (code < 28 ? lengthBase[code + 1] : 259); len++) {
+            d->length_code[len - DEFLATE_MIN_MATCH] = code;
+        }
+    }
+    // Distances up to 256 index dist_code directly, longer ones by (distance - 1) >> 7
+    for (int code = 0; code < 30; code++) {
+        int end = code < 29 ? distBase[code + 1] : DEFLATE_WINDOW + 1;
+        for (int dist = distBase[code]; dist < end; dist++) {
+            if (dist <= 256) d->dist_code[dist - 1] = code;
+            else d->dist_code[256 + ((dist - 1) >> 7)] = code;
+        }
+    }
+    thread_deflater = d;
+    return d;
+}
+
+uint32_t deflate_dist_code(const Deflater *d, uint32_t dist) {
+    return dist <= 256 ? d->dist_code[dist - 1] : d->dist_code[256 + ((dist - 1) >> 7)];
+}
+
+// Append count bits of value, least significant first (count at most 16)
+void deflate_bits(Deflater *d, uint32_t value, int count) {
+    d->bits |= (uint64_t)value << d->bit_count;
+    d->bit_count += count;
+    if (d->bit_count >= 32) {
+        buffer_reserve(d->out, 4);
+        put_u32(d->out->data + d->out->len, (uint32_t)d->bits);
+        d->out->len += 4;
+        d->bits >>= 32;
+        d->bit_count -= 32;
+    }
+}
+
+// Write out the pending bits, padding the last byte with zeros
+void deflate_align(Deflater *d) {
+    while (d->bit_count > 0) {
+        char byte = (char)d->bits;
+        buffer_append(d->out, &byte, 1);
+        d->bits >>= 8;
+        d->bit_count = d->bit_count > 8 ? d->bit_count - 8 : 0;
+    }
+    d->bits = 0;
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Code lengths of at most max_bits for symbols [0, count) with the given frequencies. Huffman lengths
+// come from the in-place Moffat-Katajainen method; codes past max_bits are then shortened and the
+// shortfall taken from shorter codes. At least two symbols always get a code, so every code is complete.
+void huffman_lengths(const uint32_t *freq, int count, int max_bits, uint8_t *lengths) {
+    uint32_t sorted[DEFLATE_LITLEN_CODES];  // frequency << 9 | symbol, ascending
+    uint32_t depth[DEFLATE_LITLEN_CODES];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        lengths[i] = 0;
+        if (freq[i]) sorted[n++] = freq[i] << 9 | i;
+    }
+    for (int i = 0; n < 2; i++) {
+        if (!freq[i]) sorted[n++] = 1u << 9 | i;
+    }
+    qsort(sorted, n, sizeof(uint32_t), compare_u32);
+    for (int i = 0; i < n; i++) depth[i] = sorted[i] >> 9;
+    
+    // Pair the two lightest trees left to right, keeping parent links in place of merged weights
+    depth[0] += depth[1];
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; next++) {
+        if (leaf >= n || depth[root] < depth[leaf]) {
+            depth[next] = depth[root];
+            depth[root++] = next;
+        } else {
+            depth[next] = depth[leaf++];
+        }
+        if (leaf >= n || (root < next && depth[root] < depth[leaf])) {
+            depth[next] += depth[root];
+            depth[root++] = next;
+        } else {
+            depth[next] += depth[leaf++];
+        }
+    }
+    // Internal node depths right to left, then leaf depths from the count of nodes at each depth
+    depth[n - 2] = 0;
+    for (int next = n - 3; next >= 0; next--) depth[next] = depth[depth[next]] + 1;
+    int available = 1, used = 0, level = 0, next = n - 1;
+    root = n - 2;
+    while (available > 0) {
+        while (root >= 0 && (int)depth[root] == level) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            depth[next--] = level;
+            available--;
+        }
+        available = 2 * used;
+        level++;
+        used = 0;
+    }
+    
+    uint32_t codes_of_length[32] = {0};
+    for (int i = 0; i < n; i++) codes_of_length[depth[i] < 31 ? depth[i] : 31]++;
+    for (int bits = max_bits + 1; bits < 32; bits++) {
+        codes_of_length[max_bits] += codes_of_length[bits];
+        codes_of_length[bits] = 0;
+    }
+    uint32_t kraft = 0;
+    for (int bits = max_bits; bits > 0; bits--) kraft += codes_of_length[bits] << (max_bits - bits);
+    while (kraft != 1u << max_bits) {
+        codes_of_length[max_bits]--;
+        for (int bits = max_bits - 1; bits > 0; bits--) {
+            if (codes_of_length[bits]) {
+                codes_of_length[bits]--;
+                codes_of_length[bits + 1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+    // The most frequent symbols take the shortest codes
+    int k = n;
+    for (int bits = 1; bits <= max_bits; bits++) {
+        for (uint32_t c = codes_of_length[bits]; c > 0; c--) lengths[sorted[--k] & 511] = bits;
+    }
+}
+
+// Canonical codes for the given lengths, bit-reversed since deflate sends codes most significant bit first
+void huffman_codes(const uint8_t *lengths, int count, uint16_t *codes) {
+    uint32_t length_count[16] = {0}, next_code[16];
+    for (int i = 0; i < count; i++) length_count[lengths[i]]++;
+    length_count[0] = 0;
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + length_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!lengths[i]) continue;
+        uint32_t value = next_code[lengths[i]]++, reversed = 0;
+        for (int bit = 0; bit < lengths[i]; bit++) reversed |= ((value >> bit) & 1) << (lengths[i] - 1 - bit);
+        codes[i] = reversed;
+    }
+}
+
+// Encode the buffered symbols as one block with whichever of dynamic or fixed codes is shorter
+void deflate_block(Deflater *d, int final) {
+    uint32_t litlen_freq[DEFLATE_LITLEN_CODES] = {0}, dist_freq[DEFLATE_DIST_CODES] = {0};
+    uint32_t extra_bits = 0;
+    for (uint32_t i = 0; i < d->symbol_count; i++) {
+        uint32_t symbol = d->symbols[i];
+        if (symbol & DEFLATE_MATCH_FLAG) {
+            uint32_t length_code = d->length_code[(symbol >> 16) & 0xFF];
+            uint32_t dist_code = deflate_dist_code(d, (symbol & 0xFFFF) + 1);
+            litlen_freq[257 + length_code]++;
+            dist_freq[dist_code]++;
+            extra_bits += lengthExtra[length_code] + distExtra[dist_code];
+        } else {
+            litlen_freq[symbol]++;
+        }
+    }
+    litlen_freq[256] = 1;
+    
+    uint8_t lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    uint8_t *litlen_lengths = lengths, dist_lengths[DEFLATE_DIST_CODES];
+    huffman_lengths(litlen_freq, DEFLATE_LITLEN_CODES, 15, litlen_lengths);
+    huffman_lengths(dist_freq, DEFLATE_DIST_CODES, 15, dist_lengths);
+    int litlen_count = DEFLATE_LITLEN_CODES, dist_count = DEFLATE_DIST_CODES;
+    while (litlen_count > 257 && !litlen_lengths[litlen_count - 1]) litlen_count--;
+    while (dist_count > 1 && !dist_lengths[dist_count - 1]) dist_count--;
+    memmove(lengths + litlen_count, dist_lengths, dist_count);
+    
+    // Run-length code both length lists as one sequence: 16 repeats the previous length 3-6 times,
+    // 17 and 18 stand for runs of 3-10 and 11-138 zeros
+    uint16_t runs[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];  // symbol | extra value << 5
+    uint32_t run_freq[19] = {0};
+    int run_count = 0, total = litlen_count + dist_count;
+    for (int i = 0; i < total;) {
+        int run = 1;
+        while (i + run < total && lengths[i + run] == lengths[i]) run++;
+        if (lengths[i] == 0 && run >= 3) {
+            if (run > 138) run = 138;
+            runs[run_count++] = run >= 11 ? 18 | (run - 11) << 5 : 17 | (run - 3) << 5;
+            i += run;
+        } else if (lengths[i] != 0 && run >= 4) {
+            runs[run_count++] = lengths[i];
+            run = run - 1 > 6 ? 6 : run - 1;
+            runs[run_count++] = 16 | (run - 3) << 5;
+            i += 1 + run;
+        } else {
+            runs[run_count++] = lengths[i];
+            i++;
+        }
+    }
+    for (int i = 0; i < run_count; i++) run_freq[runs[i] & 31]++;
+    uint8_t run_lengths[19];
+    huffman_lengths(run_freq, 19, 7, run_lengths);
+    int run_code_count = 19;
+    while (run_code_count > 4 && !run_lengths[codeLengthOrder[run_code_count - 1]]) run_code_count--;
+    
+    uint8_t fixed_lengths[288];
+    for (int i = 0; i < 288; i++) fixed_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    uint64_t dynamic_bits = 14 + 3 * run_code_count + extra_bits, fixed_bits = extra_bits;
+    for (int i = 0; i < run_count; i++) {
+        uint32_t symbol = runs[i] & 31;
+        dynamic_bits += run_lengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+    }
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; i++) {
+        dynamic_bits += (uint64_t)litlen_freq[i] * litlen_lengths[i];
+        fixed_bits += (uint64_t)litlen_freq[i] * fixed_lengths[i];
+    }
+    for (int i = 0; i < DEFLATE_DIST_CODES; i++) {
+        dynamic_bits += (uint64_t)dist_freq[i] * dist_lengths[i];
+        fixed_bits += (uint64_t)dist_freq[i] * 5;
+    }
+    
+    uint16_t litlen_codes[288], dist_codes[DEFLATE_DIST_CODES];
+    uint8_t dist_code_lengths[DEFLATE_DIST_CODES];
+    int code_count = DEFLATE_LITLEN_CODES;
+    deflate_bits(d, final, 1);
+    if (fixed_bits <= dynamic_bits) {
+        // The fixed code's canonical order counts the two unused length codes 286 and 287
+        deflate_bits(d, 1, 2);
+        memcpy(litlen_lengths, fixed_lengths, 288);
+        code_count = 288;
+        memset(dist_code_lengths, 5, DEFLATE_DIST_CODES);
+    } else {
+        deflate_bits(d, 2, 2);
+        deflate_bits(d, litlen_count - 257, 5);
+        deflate_bits(d, dist_count - 1, 5);
+        deflate_bits(d, run_code_count - 4, 4);
+        for (int i = 0; i < run_code_count; i++) deflate_bits(d, run_lengths[codeLengthOrder[i]], 3);
+        uint16_t run_codes[19];
+        huffman_codes(run_lengths, 19, run_codes);
+        for (int i = 0; i < run_count; i++) {
+            uint32_t symbol = runs[i] & 31, extra = runs[i] >> 5;
+            deflate_bits(d, run_codes[symbol], run_lengths[symbol]);
+            if (symbol == 16) deflate_bits(d, extra, 2);
+            else if (symbol == 17) deflate_bits(d, extra, 3);
+            else if (symbol == 18) deflate_bits(d, extra, 7);
+        }
+        memcpy(dist_code_lengths, dist_lengths, DEFLATE_DIST_CODES);
+        memset(litlen_lengths + litlen_count, 0, DEFLATE_LITLEN_CODES - litlen_count);
+    }
+    huffman_codes(litlen_lengths, code_count, litlen_codes);
+    huffman_codes(dist_code_lengths, DEFLATE_DIST_CODES, dist_codes);
+    
+    for (uint32_t i = 0; i < d->symbol_count; i++) {
+        uint32_t symbol = d->symbols[i];
+        if (symbol & DEFLATE_MATCH_FLAG) {
+            uint32_t length = ((symbol >> 16) & 0xFF) + DEFLATE_MIN_MATCH, dist = (symbol & 0xFFFF) + 1;
+            uint32_t length_code = d->length_code[length - DEFLATE_MIN_MATCH], dist_code = deflate_dist_code(d, dist);
+            deflate_bits(d, litlen_codes[257 + length_code], litlen_lengths[257 + length_code]);
+            if (lengthExtra[length_code]) deflate_bits(d, length - lengthBase[length_code], lengthExtra[length_code]);
+            deflate_bits(d, dist_codes[dist_code], dist_code_lengths[dist_code]);
+            if (distExtra[dist_code]) deflate_bits(d, dist - distBase[dist_code], distExtra[dist_code]);
+        } else {
+            deflate_bits(d, litlen_codes[symbol], litlen_lengths[symbol]);
+        }
+    }
+    deflate_bits(d, litlen_codes[256], litlen_lengths[256]);
+    d->symbol_count = 0;
+}
+
+void deflate_symbol(Deflater *d, uint32_t symbol) {
+    d->symbols[d->symbol_count++] = symbol;
+    if (d->symbol_count == DEFLATE_BLOCK_SYMBOLS) deflate_block(d, 0);
+}
+
+uint32_t deflate_hash(const uint8_t *p) {
+    return ((p[0] | p[1] << 8 | (uint32_t)p[2] << 16) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Add positions [*inserted, target) that start a full 3-byte prefix to the hash chains
+void deflate_insert(Deflater *d, const uint8_t *data, size_t len, size_t *inserted, size_t target) {
+    for (size_t i = *inserted; i < target && i + DEFLATE_MIN_MATCH <= len; i++) {
+        uint32_t hash = deflate_hash(data + i);
+        d->prev[i & (DEFLATE_WINDOW - 1)] = d->head[hash];
+        d->head[hash] = d->base + (uint32_t)i;
+    }
+    if (target > *inserted) *inserted = target;
+}
+
+// Longest earlier match for data + i among up to max_chain chain entries; returns its length
+// (0 if shorter than DEFLATE_MIN_MATCH) and its distance through *dist
+uint32_t deflate_longest_match(Deflater *d, const uint8_t *data, size_t len, size_t i, int max_chain, uint32_t *dist) {
+    if (i + DEFLATE_MIN_MATCH > len) return 0;
+    uint32_t limit = len - i < DEFLATE_MAX_MATCH ? (uint32_t)(len - i) : DEFLATE_MAX_MATCH;
+    uint32_t best = DEFLATE_MIN_MATCH - 1;
+    const uint8_t *target = data + i;
+    uint32_t entry = d->head[deflate_hash(target)];
+    for (int chain = 0; chain < max_chain && entry >= d->base; chain++) {
+        size_t candidate = entry - d->base;
+        if (candidate >= i || i - candidate > DEFLATE_WINDOW) break;
+        const uint8_t *match = data + candidate;
+        if (match[best] == target[best] && match[0] == target[0] && match[1] == target[1]) {
+            uint32_t n = 0;
+            while (n + 8 <= limit) {
+                uint64_t x, y;
+                memcpy(&x, match + n, 8);
+                memcpy(&y, target + n, 8);
+                if (x != y) {
+                    n += __builtin_ctzll(x ^ y) / 8;
+                    goto compared;
+                }
+                n += 8;
+            }
+            while (n < limit && match[n] == target[n]) n++;
+        compared:
+            if (n > best) {
+                best = n;
+                *dist = (uint32_t)(i - candidate);
+                if (n >= limit) break;
+            }
+        }
+        entry = d->prev[candidate & (DEFLATE_WINDOW - 1)];
+    }
+    return best >= DEFLATE_MIN_MATCH ? best : 0;
+}
+
+// Append data as raw deflate blocks, searching up to max_chain earlier positions per match. The
+// output ends on a byte boundary: with the final block set, or with an empty stored block (a sync
+// flush) so that further calls continue the same stream.
+void deflate_compress(Buffer *out, const char *text, size_t len, int final, int max_chain) {
+    Deflater *d = deflater_get();
+    const uint8_t *data = (const uint8_t *)text;
+    if ((uint64_t)d->base + len + DEFLATE_WINDOW > UINT32_MAX) {
+        memset(d->head, 0, sizeof(d->head));
+        memset(d->prev, 0, sizeof(d->prev));
+        d->base = 1;
+    }
+    d->out = out;
+    d->bits = 0;
+    d->bit_count = 0;
+    d->symbol_count = 0;
+    
+    size_t i = 0, inserted = 0;
+    while (i < len) {
+        deflate_insert(d, data, len, &inserted, i);
+        uint32_t dist = 0, length = deflate_longest_match(d, data, len, i, max_chain, &dist);
+        // Lazy matching: emit a literal instead when the next position matches longer
+        if (length && length < DEFLATE_LAZY_LIMIT) {
+            deflate_insert(d, data, len, &inserted, i + 1);
+            uint32_t next_dist = 0, next_length = deflate_longest_match(d, data, len, i + 1, max_chain, &next_dist);
+            if (next_length > length) {
+                deflate_symbol(d, data[i++]);
+                length = next_length;
+                dist = next_dist;
+            }
+        }
+        if (length) {
+            deflate_symbol(d, DEFLATE_MATCH_FLAG | (length - DEFLATE_MIN_MATCH) << 16 | (dist - 1));
+            i += length;
+        } else {
+            deflate_symbol(d, data[i++]);
+        }
+    }
+    deflate_block(d, final);
+    if (!final) {
+        deflate_bits(d, 0, 3);
+        deflate_align(d);
+        buffer_append(out, "\x00\x00\xff\xff", 4);
+    }
+    deflate_align(d);
+    d->base += (uint32_t)len + DEFLATE_WINDOW;
+}
+
+uint32_t adler32_update(uint32_t adler, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (len > 0) {
+        // 5552 bytes is the most that can be summed before b could overflow
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// The gzip (RFC 1952) or zlib (RFC 1950, HTTP's "deflate") framing around a deflate stream
+void encoding_header(Buffer *out, ContentEncoding encoding) {
+    if (encoding == ENCODING_GZIP) buffer_append(out, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+    else if (encoding == ENCODING_DEFLATE) buffer_append(out, "\x78\x9c", 2);
+}
+
+void encoding_trailer(Buffer *out, ContentEncoding encoding, uint32_t crc, uint32_t adler, size_t plain_len) {
+    char trailer[8];
+    if (encoding == ENCODING_GZIP) {
+        put_u32(trailer, crc);
+        put_u32(trailer + 4, (uint32_t)plain_len);
+        buffer_append(out, trailer, 8);
+    } else if (encoding == ENCODING_DEFLATE) {
+        put_u32(trailer, __builtin_bswap32(adler));
+        buffer_append(out, trailer, 4);
+    }
+}
+
+size_t encoding_overhead(ContentEncoding encoding) {
+    return encoding == ENCODING_GZIP ? 18 : encoding == ENCODING_DEFLATE ? 6 : 0;
+}
+
+// Append data compressed as one complete gzip or zlib body
+void compress_body(Buffer *out, ContentEncoding encoding, const char *data, size_t len, int max_chain) {
+    encoding_header(out, encoding);
+    deflate_compress(out, data, len, 1, max_chain);
+    encoding_trailer(out, encoding, encoding == ENCODING_GZIP ? crc32_update(0, data, len) : 0,
+                     encoding == ENCODING_DEFLATE ? adler32_update(1, data, len) : 0, len);
+}
+
+// Decompression
+// Archive blocks are read back by a matching inflater. Huffman codes are
+// decoded through a table indexed by the next INFLATE_FAST_BITS input bits;
+// the rare longer codes are matched against the code list one by one.
+#define INFLATE_FAST_BITS 10
+#define INFLATE_MAX_CODES 288  // literal/length codes including the two unused fixed ones
+
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS];  // symbol << 4 | code length, 0 when the code is longer
+    uint16_t codes[INFLATE_MAX_CODES];      // bit-reversed, as huffman_codes makes them
+    uint8_t lengths[INFLATE_MAX_CODES];
+    int count;
+} InflateTable;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t bits;
+    int bit_count;
+    int ok;  // drops to 0 on malformed input
+} Inflater;
+
+void inflate_refill(Inflater *in) {
+    while (in->bit_count <= 56 && in->p < in->end) {
+        in->bits |= (uint64_t)*in->p++ << in->bit_count;
+        in->bit_count += 8;
+    }
+}
+
+// Take count bits, least significant first (count at most 16)
+uint32_t inflate_bits(Inflater *in, int count) {
+    if (in->bit_count < count) inflate_refill(in);
+    if (in->bit_count < count) {
+        in->ok = 0;
+        return 0;
+    }
+    uint32_t value = (uint32_t)(in->bits & ((1u << count) - 1));
+    in->bits >>= count;
+    in->bit_count -= count;
+    return value;
+}
+
+void inflate_table(InflateTable *table, const uint8_t *lengths, int count) {
+    memcpy(table->lengths, lengths, count);
+    table->count = count;
+    huffman_codes(lengths, count, table->codes);
+    memset(table->fast, 0, sizeof(table->fast));
+    for (int symbol = 0; symbol < count; symbol++) {
+        int len = lengths[symbol];
+        if (!len || len > INFLATE_FAST_BITS) continue;
+        for (uint32_t index = table->codes[symbol]; index < (1u << INFLATE_FAST_BITS); index += 1u << len) {
+            table->fast[index] = (uint16_t)(symbol << 4 | len);
+        }
+    }
+}
+
+// Next symbol of table's code, or -1 if the input holds none
+int inflate_symbol(Inflater *in, const InflateTable *table) {
+    if (in->bit_count < 15) inflate_refill(in);
+    uint16_t entry = table->fast[in->bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (entry && (entry & 15) <= in->bit_count) {
+        in->bits >>= entry & 15;
+        in->bit_count -= entry & 15;
+        return entry >> 4;
+    }
+    for (int symbol = 0; symbol < table->count && !entry; symbol++) {
+        int len = table->lengths[symbol];
+        if (len > INFLATE_FAST_BITS && len <= in->bit_count && (in->bits & ((1u << len) - 1)) == table->codes[symbol]) {
+            in->bits >>= len;
+            in->bit_count -= len;
+            return symbol;
+        }
+    }
+    in->ok = 0;
+    return -1;
+}
+
+// Read a dynamic block's code lengths into its literal/length and distance tables
+int inflate_dynamic_tables(Inflater *in, InflateTable *litlen, InflateTable *dist) {
+    int hlit = inflate_bits(in, 5) + 257, hdist = inflate_bits(in, 5) + 1, hclen = inflate_bits(in, 4) + 4;
+    uint8_t code_lengths[19] = {0}, lengths[INFLATE_MAX_CODES + 32];
+    for (int i = 0; i < hclen; i++) code_lengths[codeLengthOrder[i]] = (uint8_t)inflate_bits(in, 3);
+    InflateTable *length_table = litlen;  // reused: the literal/length table is built after it
+    inflate_table(length_table, code_lengths, 19);
+    
+    int n = 0;
+    while (n < hlit + hdist && in->ok) {
+        int symbol = inflate_symbol(in, length_table);
+        if (symbol < 0) return 0;
+        if (symbol < 16) {
+            lengths[n++] = (uint8_t)symbol;
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (n == 0) return 0;
+            value = lengths[n - 1];
+            repeat = 3 + inflate_bits(in, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + inflate_bits(in, 3);
+        } else {
+            repeat = 11 + inflate_bits(in, 7);
+        }
+        if (n + repeat > hlit + hdist) return 0;
+        while (repeat-- > 0) lengths[n++] = value;
+    }
+    if (!in->ok || lengths[256] == 0) return 0;
+    inflate_table(litlen, lengths, hlit);
+    inflate_table(dist, lengths + hlit, hdist);
+    return 1;
+}
+
+// Append the output of one complete raw deflate stream to out; returns 0 if it is malformed
+int inflate_stream(Buffer *out, const uint8_t *data, size_t len) {
+    Inflater in = { data, data + len, 0, 0, 1 };
+    InflateTable litlen, dist;
+    int final = 0;
+    while (!final && in.ok) {
+        final = inflate_bits(&in, 1);
+        int type = inflate_bits(&in, 2);
+        if (type == 0) {
+            // Stored: the rest of the current byte is padding, then LEN and its complement
+            inflate_bits(&in, in.bit_count & 7);
+            uint32_t stored = inflate_bits(&in, 16);
+            if ((inflate_bits(&in, 16) ^ 0xFFFF) != stored || !in.ok) return 0;
+            buffer_reserve(out, stored);
+            for (uint32_t i = 0; i < stored && in.ok; i++) out->data[out->len++] = (char)inflate_bits(&in, 8);
+            continue;
+        }
+        if (type == 1) {
+            uint8_t lengths[INFLATE_MAX_CODES + DEFLATE_DIST_CODES];
+            for (int i = 0; i < INFLATE_MAX_CODES; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            for (int i = 0; i < DEFLATE_DIST_CODES; i++) lengths[INFLATE_MAX_CODES + i] = 5;
+            inflate_table(&litlen, lengths, INFLATE_MAX_CODES);
+            inflate_table(&dist, lengths + INFLATE_MAX_CODES, DEFLATE_DIST_CODES);
+        } else if (type != 2 || !inflate_dynamic_tables(&in, &litlen, &dist)) {
+            return 0;
+        }
+        
+        for (;;) {
+            int symbol = inflate_symbol(&in, &litlen);
+            if (symbol < 256) {
+                if (symbol < 0) return 0;
+                buffer_reserve(out, 1);
+                out->data[out->len++] = (char)symbol;
+                continue;
+            }
+            if (symbol == 256) break;
+            if (symbol - 257 >= 29) return 0;
+            uint32_t length = lengthBase[symbol - 257] + inflate_bits(&in, lengthExtra[symbol - 257]);
+            int dist_symbol = inflate_symbol(&in, &dist);
+            if (dist_symbol < 0 || dist_symbol >= DEFLATE_DIST_CODES) return 0;
+            uint32_t distance = distBase[dist_symbol] + inflate_bits(&in, distExtra[dist_symbol]);
+            if (!in.ok || distance > out->len) return 0;
+            // Byte by byte, since a match may overlap the bytes it produces
+            buffer_reserve(out, length);
+            char *to = out->data + out->len;
+            const char *from = to - distance;
+            for (uint32_t i = 0; i < length; i++) to[i] = from[i];
+            out->len += length;
+        }
+    }
+    return in.ok;
+}
+
+// Write-ahead log operations
+// Queue a record's entry and return the LSN a response about it must wait for, or 0 when
+// running in memory only (caller holds write_lock, after publishing the record)
+uint64_t wal_log(WalEntryType type, const void *record) {
+    return wal_log_batch(type, &record, 1);
+}
+
+// Queue the entries of several published records under one acquisition of the log lock
+uint64_t wal_log_batch(WalEntryType type, const void *const *records, uint32_t count) {
+    if (!persistence || count == 0) return 0;
+    pthread_mutex_lock(&wal.lock);
+    size_t start = wal.pending.len;
+    for (uint32_t i = 0; i < count; i++) encode_entry(&wal.pending, type, records[i]);
+    wal.appended_lsn += wal.pending.len - start;
+    uint64_t lsn = wal.appended_lsn;
+    pthread_cond_signal(&wal.wake);
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+// Hold the connection's output until the log is durable up to lsn (called on the owning worker)
+void connection_wait_durable(Connection *conn, uint64_t lsn) {
+    if (lsn == 0) return;
+    if (!conn->wait_lsn) {
+        Worker *worker = conn->worker;
+        conn->wait_prev = worker->wait_head.wait_prev;
+        conn->wait_next = &worker->wait_head;
+        worker->wait_head.wait_prev->wait_next = conn;
+        worker->wait_head.wait_prev = conn;
+        // Pairs with the log thread storing durable_lsn before it reads waiting
+        __atomic_add_fetch(&worker->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    conn->wait_lsn = lsn;
+}
+
+void connection_wait_unlink(Connection *conn) {
+    conn->wait_prev->wait_next = conn->wait_next;
+    conn->wait_next->wait_prev = conn->wait_prev;
+    conn->wait_lsn = 0;
+    __atomic_sub_fetch(&conn->worker->waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+void storage_path(char *path, size_t size, const char *prefix, uint64_t seq, const char *suffix) {
+    snprintf(path, size, "%s/%s-%016llx%s", data_dir, prefix, (unsigned long long)seq, suffix);
+}
+
+// Parse "<prefix>-<16 hex digits><suffix>" file names
+int parse_storage_name(const char *name, const char *prefix, const char *suffix, uint64_t *seq) {
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(name, prefix, prefix_len) != 0 || name[prefix_len] != '-') return 0;
+    const char *digits = name + prefix_len + 1;
+    for (int i = 0; i < 16; i++) {
+        if (!((digits[i] >= '0' && digits[i] <= '9') || (digits[i] >= 'a' && digits[i] <= 'f'))) return 0;
+    }
+    if (strcmp(digits + 16, suffix) != 0) return 0;
+    *seq = strtoull(digits, NULL, 16);
+    return 1;
+}
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Make a create, rename or unlink in the data directory durable
+void sync_data_dir() {
+    int fd = open(data_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+int open_segment(uint64_t seq) {
+    char path[4096];
+    storage_path(path, sizeof(path), "wal", seq, ".log");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Opening write-ahead log failed");
+        exit(1);
+    }
+    sync_data_dir();
+    return fd;
+}
+
+// Wake every worker holding responses for entries the log has just made durable
+void notify_workers();
+// Wake every worker with event subscribers after a publish
+void notify_subscribers();
+// Publish that a record left the hot store: its id, and for an action its patient's (caller holds write_lock)
+void publish_archived(RecordStore *store, uint32_t ref);
+
+// Log thread: one write and fdatasync per batch of entries that accumulated during the previous flush
+void *wal_main(void *arg) {
+    (void)arg;
+    Buffer batch = {0};
+    for (;;) {
+        pthread_mutex_lock(&wal.lock);
+        while (wal.pending.len == 0 && !wal.rotate_requested) pthread_cond_wait(&wal.wake, &wal.lock);
+        Buffer taken = wal.pending;
+        wal.pending = batch;
+        batch = taken;
+        uint64_t lsn = wal.appended_lsn;
+        int rotate = wal.rotate_requested;
+        // Every record logged so far is already published, so these counts cover the closed segments
+        uint32_t patients = store_count(&patientStore);
+        uint32_t actions = store_count(&actionStore);
+        pthread_mutex_unlock(&wal.lock);
+        
+        if (batch.len) {
+            if (write_all(wal.fd, batch.data, batch.len) < 0 || fdatasync(wal.fd) < 0) {
+                perror("Write-ahead log write failed");
+                abort();
+            }
+            __atomic_add_fetch(&wal.unsnapshotted, batch.len, __ATOMIC_RELAXED);
+            batch.len = 0;
+        }
+        if (rotate) {
+            int fd = open_segment(wal.seq + 1);
+            close(wal.fd);
+            pthread_mutex_lock(&wal.lock);
+            wal.fd = fd;
+            wal.seq++;
+            wal.rotated_patients = patients;
+            wal.rotated_actions = actions;
+            wal.rotate_requested = 0;
+            pthread_cond_broadcast(&wal.rotated);
+            pthread_mutex_unlock(&wal.lock);
+        }
+        
+        __atomic_store_n(&wal.durable_lsn, lsn, __ATOMIC_SEQ_CST);
+        notify_workers();
+    }
+    return NULL;
+}
+
+// Archive operations
+// Bloom filter bits of an id are picked by double hashing with the two halves of one mixed hash
+uint64_t archive_hash(const Uuid *id) {
+    uint64_t hash = get_u64(id->bytes) ^ get_u64(id->bytes + 8) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDull;
+    hash = (hash ^ (hash >> 33)) * 0xC4CEB9FE1A85EC53ull;
+    return hash ^ (hash >> 33);
+}
+
+uint32_t archive_bloom_bit(uint64_t hash, uint32_t i, uint32_t bits) {
+    return (uint32_t)(((hash & 0xFFFFFFFF) + i * ((hash >> 32) | 1)) % bits);
+}
+
+// A hot patient that is discharged and whose actions are all completed, none changed after cutoff.
+// A discharged patient without actions has nothing left to wait for. (call inside a read or write section)
+int patient_archivable(uint32_t ref, int64_t cutoff) {
+    if (patient_tier(ref) != TIER_HOT || strcmp(get_patient(ref)->status, "discharged") != 0) return 0;
+    ActionList *list = __atomic_load_n(patient_action_list(ref), __ATOMIC_ACQUIRE);
+    uint32_t count = list ? __atomic_load_n(&list->count, __ATOMIC_ACQUIRE) : 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (action_status(list->refs[i]) != STATUS_COMPLETED || action_updated_at(list->refs[i]) > cutoff) return 0;
+    }
+    return 1;
+}
+
+// Take patient ref and its actions out of the hot tier: out of the hot and field bitmaps, the counters
+// and the fragment cache, and skipped by lists and search from now on. Frozen, they accept no writes,
+// so their records and action list stay exactly as the archive segment will hold them.
+// (caller holds write_lock)
+void archive_freeze_patient(uint32_t ref) {
+    set_patient_tier(ref, TIER_ARCHIVING);
+    ActionList *list = *patient_action_list(ref);
+    for (uint32_t i = 0; list && i < list->count; i++) {
+        uint32_t action = list->refs[i];
+        bitmap_clear(&hotActions, action);
+        field_index_remove(&assignedToIndex, action_assignee(action), action);
+        field_index_remove(&statusIndex, STATUS_COMPLETED, action);
+        field_index_remove(&priorityIndex, action_priority(action), action);
+        stats_count_action(action_assignee(action), STATUS_COMPLETED, action_priority(action), -1);
+        store_release_fragment(&actionStore, action);
+        publish_archived(&actionStore, action);
+    }
+    bitmap_clear(&hotPatients, ref);
+    stats_count_patient(-1, 0);
+    store_release_fragment(&patientStore, ref);
+    publish_archived(&patientStore, ref);
+}
+
+// Freeze every archivable patient; returns how many were frozen (snapshot thread). A lock-free scan
+// finds the candidates, so the write sections only recheck them, ARCHIVE_FREEZE_BATCH at a time.
+uint32_t archive_freeze(int64_t cutoff) {
+    uint32_t count = store_count(&patientStore), found = 0, capacity = 0, frozen = 0;
+    uint32_t *refs = NULL;
+    for (uint32_t ref = 0; ref < count; ref++) {
+        if (ref % 1024 == 0) read_begin();
+        if (patient_archivable(ref, cutoff)) {
+            if (found == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                refs = realloc(refs, capacity * sizeof(uint32_t));
+                if (!refs) {
+                    fprintf(stderr, "Out of memory collecting patients to archive\n");
+                    abort();
+                }
+            }
+            refs[found++] = ref;
+        }
+        if (ref % 1024 == 1023 || ref + 1 == count) read_end();
+    }
+    
+    for (uint32_t i = 0; i < found; i += ARCHIVE_FREEZE_BATCH) {
+        uint32_t batch_frozen = 0;
+        write_begin();
+        for (uint32_t j = i; j < found && j < i + ARCHIVE_FREEZE_BATCH; j++) {
+            // The patient may have been readmitted, or an action reopened, since the scan
+            if (!patient_archivable(refs[j], cutoff)) continue;
+            archive_freeze_patient(refs[j]);
+            batch_frozen++;
+        }
+        if (batch_frozen) {
+            // Cached lists are rebuilt without them
+            __atomic_store_n(&patientStore.generation, patientStore.generation + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&actionStore.generation, actionStore.generation + 1, __ATOMIC_RELEASE);
+        }
+        write_end();
+        if (batch_frozen) notify_subscribers();
+        frozen += batch_frozen;
+    }
+    free(refs);
+    return frozen;
+}
+
+// Map archive-<seq>.arc and check that its index and Bloom filter lie within it; NULL if they do not
+ArchiveSegment *archive_open(uint64_t seq) {
+    char path[4096];
+    storage_path(path, sizeof(path), "archive", seq, ".arc");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    uint8_t *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= ARCHIVE_HEADER) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    
+    size_t size = st.st_size;
+    uint32_t block_count = get_u32(data + 8), bloom_bits = get_u32(data + 20);
+    uint64_t index_offset = get_u64(data + 24), bloom_offset = get_u64(data + 32);
+    if (memcmp(data, "CWARCH01", 8) != 0 || index_offset < ARCHIVE_HEADER || index_offset > size ||
+        (size - index_offset) / ARCHIVE_INDEX_ENTRY < block_count ||
+        bloom_offset != index_offset + (uint64_t)block_count * ARCHIVE_INDEX_ENTRY ||
+        bloom_bits == 0 || bloom_bits % 8 != 0 || size - bloom_offset < bloom_bits / 8) {
+        munmap(data, size);
+        return NULL;
+    }
+    // Lookups touch one index page and one block at a time
+    madvise(data, size, MADV_RANDOM);
+    
+    ArchiveSegment *segment = malloc(sizeof(ArchiveSegment));
+    if (!segment) {
+        fprintf(stderr, "Out of memory opening archive segment\n");
+        abort();
+    }
+    segment->seq = seq;
+    segment->data = data;
+    segment->size = size;
+    segment->block_count = block_count;
+    segment->patients = get_u32(data + 12);
+    segment->actions = get_u32(data + 16);
+    segment->bloom_bits = bloom_bits;
+    segment->index = data + index_offset;
+    segment->bloom = data + bloom_offset;
+    return segment;
+}
+
+// Make a mapped segment visible to lookups (recovery, then only the snapshot thread)
+void archive_register(ArchiveSegment *segment) {
+    segmented_reserve(&archiveSegments, archiveCount);
+    __atomic_store_n(segmented_slot(&archiveSegments, archiveCount), segment, __ATOMIC_RELEASE);
+    __atomic_store_n(&archiveCount, archiveCount + 1, __ATOMIC_RELEASE);
+}
+
+const ArchiveSegment *archive_segment(uint32_t index) {
+    return __atomic_load_n(segmented_slot(&archiveSegments, index), __ATOMIC_ACQUIRE);
+}
+
+// Sum the registered segments' record counts and file sizes; returns how many there are
+uint32_t archive_totals(uint64_t *patients, uint64_t *actions, uint64_t *bytes) {
+    uint32_t count = __atomic_load_n(&archiveCount, __ATOMIC_ACQUIRE);
+    *patients = *actions = *bytes = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const ArchiveSegment *segment = archive_segment(i);
+        *patients += segment->patients;
+        *actions += segment->actions;
+        *bytes += segment->size;
+    }
+    return count;
+}
+
+int compare_patient_ids(const void *a, const void *b) {
+    return memcmp(get_patient(*(const uint32_t *)a)->id.bytes, get_patient(*(const uint32_t *)b)->id.bytes, 16);
+}
+
+// Append patient ref's entry (its JSON, then each action's createdAt and JSON) to block
+void archive_append_patient(Buffer *block, uint32_t ref) {
+    char json[MAX_RECORD_JSON], prefix[12];
+    const Patient *patient = get_patient(ref);
+    ActionList *list = *patient_action_list(ref);
+    uint32_t action_count = list ? list->count : 0;
+    int len = render_patient(ref, patient, json);
+    buffer_append(block, (const char *)patient->id.bytes, 16);
+    encode_u32(block, (uint32_t)len);
+    encode_u32(block, action_count);
+    buffer_append(block, json, len);
+    for (uint32_t i = 0; i < action_count; i++) {
+        const ActionRecord *record = get_action(list->refs[i]);
+        len = render_action(list->refs[i], record, json);
+        put_u64(prefix, (uint64_t)record->createdAt);
+        put_u32(prefix + 8, (uint32_t)len);
+        buffer_append(block, prefix, sizeof(prefix));
+        buffer_append(block, json, len);
+    }
+}
+
+// Write the frozen patients below patients, and their actions, to archive-<seq>.arc, then serve them
+// from it and leave them out of later snapshots. Like a snapshot, the file only appears under its
+// final name once it is complete and on disk. Returns how many patients were archived, or -1 if the
+// segment could not be written (they stay frozen and are retried). (snapshot thread)
+long archive_write(uint64_t seq, uint32_t patients) {
+    uint32_t *refs = NULL, count = 0, actions = 0;
+    for (uint32_t ref = 0; ref < patients; ref++) {
+        if (patient_tier(ref) != TIER_ARCHIVING) continue;
+        if (count % 1024 == 0) {
+            refs = realloc(refs, (count + 1024) * sizeof(uint32_t));
+            if (!refs) {
+                fprintf(stderr, "Out of memory collecting patients to archive\n");
+                abort();
+            }
+        }
+        refs[count++] = ref;
+    }
+    if (count == 0) return 0;
+    // Frozen records and lists no longer change, so they are read without a read section
+    qsort(refs, count, sizeof(uint32_t), compare_patient_ids);
+    
+    char tmp_path[4096], path[4096];
+    storage_path(tmp_path, sizeof(tmp_path), "archive", seq, ".tmp");
+    storage_path(path, sizeof(path), "archive", seq, ".arc");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(refs);
+        return -1;
+    }
+    
+    uint32_t bloom_bits = (count * ARCHIVE_BLOOM_BITS + 63) / 64 * 64;
+    uint8_t *bloom = calloc(bloom_bits / 8, 1);
+    if (!bloom) {
+        fprintf(stderr, "Out of memory building archive filter\n");
+        abort();
+    }
+    Buffer block = {0}, compressed = {0}, index = {0};
+    char header[ARCHIVE_HEADER] = {0}, entry[ARCHIVE_INDEX_ENTRY];
+    uint64_t offset = ARCHIVE_HEADER;
+    uint32_t block_count = 0;
+    int failed = write_all(fd, header, sizeof(header)) < 0;
+    for (uint32_t i = 0; i < count && !failed; i++) {
+        const Patient *patient = get_patient(refs[i]);
+        if (block.len == 0) memcpy(entry, patient->id.bytes, 16);
+        uint64_t hash = archive_hash(&patient->id);
+        for (uint32_t k = 0; k < ARCHIVE_BLOOM_HASHES; k++) {
+            uint32_t bit = archive_bloom_bit(hash, k, bloom_bits);
+            bloom[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+        archive_append_patient(&block, refs[i]);
+        ActionList *list = *patient_action_list(refs[i]);
+        actions += list ? list->count : 0;
+        if (block.len < ARCHIVE_BLOCK_BYTES && i + 1 < count) continue;
+        
+        compressed.len = 0;
+        deflate_compress(&compressed, block.data, block.len, 1, DEFLATE_CHAIN_CACHED);
+        put_u64(entry + 16, offset);
+        put_u32(entry + 24, (uint32_t)compressed.len);
+        put_u32(entry + 28, (uint32_t)block.len);
+        put_u32(entry + 32, crc32_update(0, block.data, block.len));
+        buffer_append(&index, entry, sizeof(entry));
+        failed = write_all(fd, compressed.data, compressed.len) < 0;
+        offset += compressed.len;
+        block.len = 0;
+        block_count++;
+    }
+    
+    memcpy(header, "CWARCH01", 8);
+    put_u32(header + 8, block_count);
+    put_u32(header + 12, count);
+    put_u32(header + 16, actions);
+    put_u32(header + 20, bloom_bits);
+    put_u64(header + 24, offset);
+    put_u64(header + 32, offset + index.len);
+    if (!failed) {
+        failed = write_all(fd, index.data, index.len) < 0 || write_all(fd, (const char *)bloom, bloom_bits / 8) < 0 ||
+                 pwrite(fd, header, sizeof(header), 0) != sizeof(header) || fsync(fd) < 0;
+    }
+    free(block.data);
+    free(compressed.data);
+    free(index.data);
+    free(bloom);
+    close(fd);
+    if (failed || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        free(refs);
+        return -1;
+    }
+    sync_data_dir();
+    ArchiveSegment *segment = archive_open(seq);
+    if (!segment) {
+        unlink(path);
+        free(refs);
+        return -1;
+    }
+    
+    // Registered before any patient is marked, so a lookup never misses one
+    archive_register(segment);
+    for (uint32_t i = 0; i < count; i++) set_patient_tier(refs[i], TIER_ARCHIVED);
+    free(refs);
+    return count;
+}
+
+// Scan one inflated block for id; block entries are sorted by id
+int archive_block_find(const uint8_t *p, const uint8_t *end, const Uuid *id, ArchivedPatient *found) {
+    while (end - p >= 24) {
+        uint32_t len = get_u32(p + 16), action_count = get_u32(p + 20);
+        if ((size_t)(end - p) - 24 < len) return 0;
+        const uint8_t *actions = p + 24 + len, *next = actions;
+        for (uint32_t i = 0; i < action_count; i++) {
+            if (end - next < 12 || (size_t)(end - next) - 12 < get_u32(next + 8)) return 0;
+            next += 12 + get_u32(next + 8);
+        }
+        int order = memcmp(p, id->bytes, 16);
+        if (order > 0) return 0;
+        if (order == 0) {
+            found->json = (const char *)p + 24;
+            found->len = len;
+            found->action_count = action_count;
+            found->actions = actions;
+            return 1;
+        }
+        p = next;
+    }
+    return 0;
+}
+
+// Find the archived patient with id, newest segment first. The block that holds it is inflated
+// into this thread's archiveBlock, which found points into until the thread's next lookup.
+// Returns 0 if no segment holds it (lock-free).
+int archive_lookup(const Uuid *id, ArchivedPatient *found) {
+    uint64_t hash = archive_hash(id);
+    for (uint32_t s = __atomic_load_n(&archiveCount, __ATOMIC_ACQUIRE); s-- > 0;) {
+        const ArchiveSegment *segment = archive_segment(s);
+        int present = 1;
+        for (uint32_t k = 0; k < ARCHIVE_BLOOM_HASHES && present; k++) {
+            uint32_t bit = archive_bloom_bit(hash, k, segment->bloom_bits);
+            present = segment->bloom[bit / 8] >> (bit % 8) & 1;
+        }
+        if (!present) continue;
+        
+        // Last block whose first id is at or before id
+        uint32_t low = 0, high = segment->block_count;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            if (memcmp(segment->index + (size_t)mid * ARCHIVE_INDEX_ENTRY, id->bytes, 16) <= 0) low = mid + 1;
+            else high = mid;
+        }
+        if (low == 0) continue;
+        
+        const uint8_t *entry = segment->index + (size_t)(low - 1) * ARCHIVE_INDEX_ENTRY;
+        uint64_t offset = get_u64(entry + 16), end = segment->index - segment->data;
+        uint32_t compressed = get_u32(entry + 24), plain = get_u32(entry + 28);
+        if (offset > end || end - offset < compressed) continue;
+        const uint8_t *data = segment->data + offset;
+        if (archiveBlockSource != data) {
+            archiveBlock.len = 0;
+            buffer_reserve(&archiveBlock, plain);
+            archiveBlockSource = NULL;
+            if (!inflate_stream(&archiveBlock, data, compressed) || archiveBlock.len != plain ||
+                crc32_update(0, archiveBlock.data, plain) != get_u32(entry + 32)) {
+                fprintf(stderr, "Archive segment %016llx has a corrupt block at %llu\n",
+                        (unsigned long long)segment->seq, (unsigned long long)offset);
+                continue;
+            }
+            archiveBlockSource = data;
+        }
+        const uint8_t *block = (const uint8_t *)archiveBlock.data;
+        if (archive_block_find(block, block + archiveBlock.len, id, found)) return 1;
+    }
+    return 0;
+}
+
+// Look up an id given as text; malformed ids are simply not found
+int archive_lookup_text(const char *text, ArchivedPatient *found) {
+    Uuid id;
+    return parse_uuid(text, &id) && archive_lookup(&id, found);
+}
+
+// Snapshot operations
+// Write every record below the given counts to snapshot-<seq>.snap, atomically replacing nothing:
+// the file only appears under its final name once it is complete and on disk. Archived patients and
+// their actions are left to their archive segments.
+int write_snapshot(uint64_t seq, uint32_t patients, uint32_t actions) {
+    char tmp_path[4096], path[4096];
+    storage_path(tmp_path, sizeof(tmp_path), "snapshot", seq, ".tmp");
+    storage_path(path, sizeof(path), "snapshot", seq, ".snap");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    
+    Buffer out = {0};
+    buffer_append(&out, "CWSNAP01", 8);
+    encode_u32(&out, (uint32_t)seq);
+    encode_u32(&out, (uint32_t)(seq >> 32));
+    encode_u32(&out, patients);
+    encode_u32(&out, actions);
+    
+    int failed = 0;
+    uint32_t total = patients + actions;
+    for (uint32_t i = 0; i < total && !failed; i++) {
+        if (i % 1024 == 0) read_begin();
+        if (i < patients) {
+            if (patient_tier(i) != TIER_ARCHIVED) encode_entry(&out, WAL_PATIENT, get_patient(i));
+        } else if (patient_tier(action_patient(i - patients)) != TIER_ARCHIVED) {
+            ClinicalAction action;
+            action_expand(i - patients, get_action(i - patients), &action);
+            encode_entry(&out, WAL_ACTION, &action);
+        }
+        if (i % 1024 == 1023 || i + 1 == total) read_end();
+        
+        if (out.len >= SLAB_CHUNK_SIZE) {
+            failed = write_all(fd, out.data, out.len) < 0;
+            out.len = 0;
+        }
+    }
+    if (!failed) failed = write_all(fd, out.data, out.len) < 0 || fsync(fd) < 0;
+    free(out.data);
+    close(fd);
+    if (failed || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    sync_data_dir();
+    return 0;
+}
+
+// Delete snapshots and log segments superseded by snapshot-<seq>.snap
+void remove_obsolete_files(uint64_t seq) {
+    DIR *dir = opendir(data_dir);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uint64_t file_seq;
+        if ((parse_storage_name(entry->d_name, "wal", ".log", &file_seq) ||
+             parse_storage_name(entry->d_name, "snapshot", ".snap", &file_seq)) && file_seq < seq) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", data_dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    sync_data_dir();
+}
+
+// Snapshot thread: once enough log has built up (or some has sat for SNAPSHOT_INTERVAL seconds),
+// rotate to a new segment and write the records the closed segments hold as one compact file.
+// Compaction runs before each snapshot and every ARCHIVE_INTERVAL seconds; patients it freezes are
+// written to an archive segment of the same number just before the snapshot that leaves them out.
+void *snapshot_main(void *arg) {
+    (void)arg;
+    time_t last_snapshot = time(NULL), last_archive = 0;
+    int archive_failed = 0;
+    for (;;) {
+        sleep(1);
+        uint64_t unsnapshotted = __atomic_load_n(&wal.unsnapshotted, __ATOMIC_RELAXED);
+        int due = unsnapshotted >= SNAPSHOT_WAL_BYTES ||
+                  (unsnapshotted > 0 && time(NULL) - last_snapshot >= SNAPSHOT_INTERVAL);
+        if (due || time(NULL) - last_archive >= ARCHIVE_INTERVAL) {
+            if (archive_freeze(current_timestamp() - archive_age) > 0 || archive_failed) due = 1;
+            last_archive = time(NULL);
+        }
+        if (!due) continue;
+        
+        pthread_mutex_lock(&wal.lock);
+        wal.rotate_requested = 1;
+        pthread_cond_signal(&wal.wake);
+        while (wal.rotate_requested) pthread_cond_wait(&wal.rotated, &wal.lock);
+        uint64_t seq = wal.seq;
+        uint32_t patients = wal.rotated_patients;
+        uint32_t actions = wal.rotated_actions;
+        pthread_mutex_unlock(&wal.lock);
+        
+        archive_failed = archive_write(seq, patients) < 0;
+        if (archive_failed) perror("Writing archive segment failed");
+        
+        __atomic_sub_fetch(&wal.unsnapshotted, unsnapshotted, __ATOMIC_RELAXED);
+        if (write_snapshot(seq, patients, actions) < 0) {
+            perror("Writing snapshot failed");
+            __atomic_add_fetch(&wal.unsnapshotted, unsnapshotted, __ATOMIC_RELAXED);
+        } else {
+            remove_obsolete_files(seq);
+        }
+        last_snapshot = time(NULL);
+    }
+    return NULL;
+}
+
+// Recovery
+// Rebuild one record from a snapshot or log entry, or apply a logged status change. Entries near a
+// segment rotation may already be in the snapshot, so log replay skips records that exist.
+// Returns 0 if the payload is malformed.
+int replay_entry(uint8_t type, const uint8_t *payload, uint32_t len, int skip_existing) {
+    Decoder decoder = { payload, payload + len, 1 };
+    if (type == WAL_PATIENT) {
+        Patient decoded;
+        if (!decode_patient(&decoder, &decoded)) return 0;
+        if (skip_existing && index_lookup(&patientIndex, &decoded.id) >= 0) return 1;
+        Patient *patient = slab_alloc(&patientStore.slab);
+        *patient = decoded;
+        index_patient(store_publish(&patientStore, patient, NULL));
+        return 1;
+    }
+    if (type == WAL_ACTION) {
+        ClinicalAction action;
+        if (!decode_action(&decoder, &action)) return 0;
+        if (skip_existing && index_lookup(&actionIndex, &action.id) >= 0) return 1;
+        int patient_ref = index_lookup_text(&patientIndex, action.patientId);
+        if (patient_ref < 0) return 0;
+        return add_action(&action, patient_ref, 0) >= 0;
+    }
+    if (type == WAL_ACTION_STATUS) {
+        ClinicalAction update;
+        decode_uuid(&decoder, &update.id);
+        decode_string(&decoder, update.status, sizeof(update.status));
+        decode_timestamp(&decoder, &update.updatedAt);
+        if (!decoder.ok || decoder.p != decoder.end) return 0;
+        int ref = index_lookup(&actionIndex, &update.id);
+        int status = enum_code(statusNames, STATUS_COUNT, update.status);
+        if (ref < 0 || status < 0) return 0;
+        // The snapshot may already hold this update
+        if (action_status(ref) != (ActionStatus)status || action_updated_at(ref) != update.updatedAt) {
+            update_action_status(ref, status, update.updatedAt);
+        }
+        return 1;
+    }
+    if (type == WAL_PATIENT_STATUS) {
+        Patient update;
+        decode_uuid(&decoder, &update.id);
+        decode_string(&decoder, update.status, sizeof(update.status));
+        if (!decoder.ok || decoder.p != decoder.end) return 0;
+        int ref = index_lookup(&patientIndex, &update.id);
+        if (ref < 0) return 0;
+        if (strcmp(get_patient(ref)->status, update.status) != 0) update_patient_status(ref, update.status);
+        return 1;
+    }
+    return 0;
+}
+
+// Replay the entries of a snapshot or log segment in place from a read-only mapping.
+// Log entries are checksummed, since a crash can tear the segment's tail; a snapshot only
+// gets its final name once it is complete and on disk, so only its framing is checked.
+// Returns the bytes of valid entries; anything left over is reported through *complete.
+// An intact entry that no longer applies (say, a status change to an action archived since)
+// is skipped with a warning rather than ending the replay.
+size_t replay_file(const char *path, size_t offset, int is_log, int *complete) {
+    *complete = 1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size <= offset) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *complete = 0;
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    
+    size_t pos = offset;
+    uint32_t skipped = 0;
+    while (pos < size) {
+        if (size - pos < WAL_ENTRY_HEADER) break;
+        uint32_t len = get_u32(data + pos);
+        if (size - pos - WAL_ENTRY_HEADER < len) break;
+        if (is_log && crc32_update(0, data + pos + 8, len + 1) != get_u32(data + pos + 4)) break;
+        if (!replay_entry(data[pos + 8], data + pos + WAL_ENTRY_HEADER, len, is_log)) skipped++;
+        pos += WAL_ENTRY_HEADER + len;
+    }
+    if (skipped) fprintf(stderr, "Skipped %u entries of %s that could not be applied\n", skipped, path);
+    if (pos < size) *complete = 0;
+    munmap(data, size);
+    return pos - offset;
+}
+
+int compare_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void seq_list_add(uint64_t **list, size_t *count, size_t *capacity, uint64_t seq) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *list = realloc(*list, *capacity * sizeof(uint64_t));
+        if (!*list) {
+            fprintf(stderr, "Out of memory listing storage files\n");
+            abort();
+        }
+    }
+    (*list)[(*count)++] = seq;
+}
+
+// Load the newest snapshot, replay the log segments written since and open a fresh segment
+// (runs before the workers start)
+void recover_storage() {
+    if (mkdir(data_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Creating data directory failed");
+        exit(1);
+    }
+    DIR *dir = opendir(data_dir);
+    if (!dir) {
+        perror("Opening data directory failed");
+        exit(1);
+    }
+    
+    uint64_t *segments = NULL, *archives = NULL;
+    size_t segment_count = 0, segment_cap = 0, archive_count = 0, archive_cap = 0;
+    uint64_t snapshot_seq = 0, next_seq = 1;
+    int have_snapshot = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uint64_t seq;
+        if (parse_storage_name(entry->d_name, "wal", ".log", &seq)) {
+            seq_list_add(&segments, &segment_count, &segment_cap, seq);
+            if (seq >= next_seq) next_seq = seq + 1;
+        } else if (parse_storage_name(entry->d_name, "archive", ".arc", &seq)) {
+            seq_list_add(&archives, &archive_count, &archive_cap, seq);
+        } else if (parse_storage_name(entry->d_name, "snapshot", ".snap", &seq)) {
+            if (!have_snapshot || seq > snapshot_seq) snapshot_seq = seq;
+            have_snapshot = 1;
+            if (seq > next_seq) next_seq = seq;
+        }
+    }
+    closedir(dir);
+    qsort(segments, segment_count, sizeof(uint64_t), compare_seq);
+    qsort(archives, archive_count, sizeof(uint64_t), compare_seq);
+    
+    // An archive segment takes effect with the snapshot of its number. One newer than the snapshot
+    // was cut short by a crash before that snapshot was written, and its patients are still in the
+    // older snapshot and the log.
+    char path[4096];
+    for (size_t i = 0; i < archive_count; i++) {
+        storage_path(path, sizeof(path), "archive", archives[i], ".arc");
+        if (!have_snapshot || archives[i] > snapshot_seq) {
+            unlink(path);
+            continue;
+        }
+        ArchiveSegment *segment = archive_open(archives[i]);
+        if (!segment) {
+            fprintf(stderr, "Archive segment %s is corrupt\n", path);
+            exit(1);
+        }
+        archive_register(segment);
+    }
+    free(archives);
+    
+    int complete;
+    if (have_snapshot) {
+        storage_path(path, sizeof(path), "snapshot", snapshot_seq, ".snap");
+        uint8_t header[SNAPSHOT_HEADER] = {0};
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (read(fd, header, sizeof(header)) != sizeof(header)) header[0] = '\0';
+            close(fd);
+        }
+        complete = memcmp(header, "CWSNAP01", 8) == 0;
+        if (complete) {
+            // Size the indexes once instead of doubling them through the load
+            index_reserve(&patientIndex, get_u32(header + 16));
+            index_reserve(&actionIndex, get_u32(header + 20));
+            replay_file(path, SNAPSHOT_HEADER, 0, &complete);
+        }
+        if (!complete) {
+            fprintf(stderr, "Snapshot %s is corrupt\n", path);
+            exit(1);
+        }
+    }
+    uint64_t log_bytes = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        if (have_snapshot && segments[i] < snapshot_seq) continue;
+        storage_path(path, sizeof(path), "wal", segments[i], ".log");
+        log_bytes += replay_file(path, 0, 1, &complete);
+        if (!complete) fprintf(stderr, "Ignoring torn tail of %s\n", path);
+    }
+    free(segments);
+    reclaim_retired();
+    
+    // Replayed log counts towards the next snapshot
+    wal.unsnapshotted = log_bytes;
+    wal.seq = next_seq;
+    wal.fd = open_segment(next_seq);
+}
+
+// Shared bytes
+SharedBytes *shared_bytes_create(size_t len, uint64_t generation) {
+    SharedBytes *bytes = malloc(sizeof(SharedBytes) + len);
+    if (!bytes) {
+        fprintf(stderr, "Out of memory allocating shared bytes\n");
+        abort();
+    }
+    bytes->refs = 1;
+    bytes->generation = generation;
+    bytes->len = len;
+    return bytes;
+}
+
+void shared_bytes_release(void *ptr) {
+    SharedBytes *bytes = ptr;
+    if (__atomic_sub_fetch(&bytes->refs, 1, __ATOMIC_ACQ_REL) == 0) free(bytes);
+}
+
+// Queue long-lived bytes behind whatever is already buffered, without copying them.
+// An owner reference passes to the connection and is released once the bytes are sent.
+void connection_splice(Connection *conn, const char *data, size_t len, SharedBytes *owner) {
+    if (len == 0 || conn->splice_count == MAX_SPLICES) {
+        buffer_append(&conn->out, data, len);
+        if (owner) shared_bytes_release(owner);
+        return;
+    }
+    conn->splices[conn->splice_count++] = (Splice){ conn->out.len, data, len, owner };
+}
+
+int output_pending(Connection *conn) {
+    return conn->out_sent < conn->out.len || conn->splice_head < conn->splice_count;
+}
+
+// HTTP response helpers
+const char *const encodingNames[ENCODING_COUNT] = { "identity", "gzip", "deflate" };
+
+// content_length < 0 selects a streamed body: chunked for HTTP/1.1, close-delimited for HTTP/1.0.
+// extra holds any further header lines, each ending in CRLF.
+void send_response_header(Connection *conn, const char *status, const char *content_type, long content_length,
+                          ContentEncoding encoding, const char *extra) {
+    char header[640];
+    char framing[96] = "";
+    int framing_len = 0;
+    if (encoding != ENCODING_IDENTITY) {
+        framing_len = snprintf(framing, sizeof(framing), "Content-Encoding: %s\r\n", encodingNames[encoding]);
+    }
+    if (content_length >= 0) {
+        snprintf(framing + framing_len, sizeof(framing) - framing_len, "Content-Length: %ld\r\n", content_length);
+    } else if (conn->http11) {
+        strcpy(framing + framing_len, "Transfer-Encoding: chunked\r\n");
+    } else {
+        conn->keep_alive = 0;
+    }
+    int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+            "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
+            "Vary: Accept-Encoding\r\n"
+            "%s"
+            "%s"
+            "Connection: %s\r\n"
+            "\r\n",
+            status, content_type, extra, framing, conn->keep_alive ? "keep-alive" : "close");
+    buffer_append(&conn->out, header, header_len);
+    conn->status = atoi(status);
+}
+
+void send_encoded_header(Connection *conn, const char *status, const char *content_type, long content_length,
+                         ContentEncoding encoding) {
+    send_response_header(conn, status, content_type, content_length, encoding, "");
+}
+
+void send_http_header(Connection *conn, const char *status, const char *content_type, long content_length) {
+    send_encoded_header(conn, status, content_type, content_length, ENCODING_IDENTITY);
+}
+
+// Send a body, compressed in the coding the request accepts once it is large enough to gain from it,
+// after the header lines in extra
+void send_http_body_extra(Connection *conn, const char *status, const char *content_type, const char *body,
+                          size_t body_len, const char *extra) {
+    if (conn->encoding != ENCODING_IDENTITY && body_len >= COMPRESS_MIN_BYTES) {
+        Buffer compressed = {0};
+        compress_body(&compressed, conn->encoding, body, body_len, DEFLATE_CHAIN_REQUEST);
+        send_response_header(conn, status, content_type, (long)compressed.len, conn->encoding, extra);
+        buffer_append(&conn->out, compressed.data, compressed.len);
+        free(compressed.data);
+        return;
+    }
+    send_response_header(conn, status, content_type, (long)body_len, ENCODING_IDENTITY, extra);
+    buffer_append(&conn->out, body, body_len);
+}
+
+void send_http_body(Connection *conn, const char *status, const char *content_type, const char *body, size_t body_len) {
+    send_http_body_extra(conn, status, content_type, body, body_len, "");
+}
+
+void send_http_response(Connection *conn, const char *status, const char *content_type, const char *body) {
+    send_http_body(conn, status, content_type, body, strlen(body));
+}
+
+void send_json_response(Connection *conn, const char *json) {
+    send_http_response(conn, "200 OK", "application/json", json);
+}
+
+void send_html_response(Connection *conn, const char *html) {
+    send_http_response(conn, "200 OK", "text/html", html);
+}
+
+// Reply 405 naming the methods the resource does accept
+void send_method_not_allowed(Connection *conn, const char *allow) {
+    const char *body = "{\"error\":\"Method not allowed\"}";
+    char allow_header[64];
+    snprintf(allow_header, sizeof(allow_header), "Allow: %s\r\n", allow);
+    send_response_header(conn, "405 Method Not Allowed", "application/json", (long)strlen(body), ENCODING_IDENTITY,
+                         allow_header);
+    buffer_append(&conn->out, body, strlen(body));
+}
+
+// Answer a CORS preflight, which browsers send before a cross-origin PUT or JSON POST.
+// A 204 carries no body and so no Content-Length.
+void send_preflight_response(Connection *conn) {
+    char header[320];
+    int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 204 No Content\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+            "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
+            "Access-Control-Max-Age: 86400\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            conn->keep_alive ? "keep-alive" : "close");
+    buffer_append(&conn->out, header, header_len);
+    conn->status = 204;
+}
+
+// HTTP request parsing
+int view_equals(StringView view, const char *text) {
+    size_t len = strlen(text);
+    return view.len == len && memcmp(view.data, text, len) == 0;
+}
+
+int view_equals_ci(StringView view, const char *text) {
+    size_t len = strlen(text);
+    return view.len == len && strncasecmp(view.data, text, len) == 0;
+}
+
+// True if the comma-separated header value lists token (case-insensitive)
+int view_has_token(StringView view, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = view.data, *end = view.data + view.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',') p++;
+        const char *stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+        if ((size_t)(stop - start) == token_len && strncasecmp(start, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+const StringView *request_header(const HttpRequest *request, const char *name) {
+    for (int i = 0; i < request->header_count; i++) {
+        if (view_equals_ci(request->headers[i].name, name)) return &request->headers[i].value;
+    }
+    return NULL;
+}
+
+// Content coding to answer with: whichever of gzip and deflate Accept-Encoding gives the higher
+// q-value (directly or through "*"), gzip on a tie, or identity when neither is acceptable
+ContentEncoding request_encoding(const HttpRequest *request) {
+    const StringView *accept = request_header(request, "Accept-Encoding");
+    if (!accept) return ENCODING_IDENTITY;
+    int quality[ENCODING_COUNT] = { -1, -1, -1 };  // thousandths, -1 when not listed
+    int any = -1;
+    const char *p = accept->data, *end = accept->data + accept->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+        int q = 1000;
+        while (p < end && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                    p += 2;
+                    q = p < end && *p == '1' ? 1000 : 0;
+                    if (p < end) p++;
+                    if (p < end && *p == '.') {
+                        p++;
+                        for (int scale = 100; scale > 0 && p < end && isdigit((unsigned char)*p); scale /= 10) {
+                            if (q < 1000) q += (*p - '0') * scale;
+                            p++;
+                        }
+                    }
+                    continue;
+                }
+            }
+            p++;
+        }
+        if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) quality[ENCODING_GZIP] = q;
+        else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0) quality[ENCODING_DEFLATE] = q;
+        else if (name_len == 1 && *name == '*') any = q;
+    }
+    for (int encoding = ENCODING_GZIP; encoding < ENCODING_COUNT; encoding++) {
+        if (quality[encoding] < 0) quality[encoding] = any > 0 ? any : 0;
+    }
+    if (quality[ENCODING_GZIP] == 0 && quality[ENCODING_DEFLATE] == 0) return ENCODING_IDENTITY;
+    return quality[ENCODING_GZIP] >= quality[ENCODING_DEFLATE] ? ENCODING_GZIP : ENCODING_DEFLATE;
+}
+
+ParseStatus parse_error(HttpRequest *request, const char *status, const char *message) {
+    request->error_status = status;
+    request->error_message = message;
+    return PARSE_ERROR;
+}
+
+// Parse the request line and headers of a complete header block in place
+ParseStatus parse_request_head(HttpRequest *request, char *data) {
+    char *end = data + request->header_len - 2;  // keep the final CRLF as a sentinel
+    char *p = data;
+    
+    // Request line: METHOD SP target SP HTTP/1.x CRLF
+    char *method_end = memchr(p, ' ', end - p);
+    if (!method_end || method_end == p) return parse_error(request, "400 Bad Request", "Malformed request line");
+    char *target = method_end + 1;
+    char *target_end = memchr(target, ' ', end - target);
+    if (!target_end || target_end == target) return parse_error(request, "400 Bad Request", "Malformed request line");
+    char *version = target_end + 1;
+    char *line_end = memchr(version, '\r', end - version + 1);
+    if (!line_end || line_end - version != 8 || strncmp(version, "HTTP/1.", 7) != 0) {
+        return parse_error(request, "400 Bad Request", "Unsupported HTTP version");
+    }
+    request->http11 = version[7] != '0';
+    
+    char *query = memchr(target, '?', target_end - target);
+    request->method = (StringView){ p, method_end - p };
+    request->path = (StringView){ target, (query ? query : target_end) - target };
+    request->query = query ? (StringView){ query + 1, target_end - query - 1 } : (StringView){ target_end, 0 };
+    
+    // Header fields
+    int has_length = 0, close = 0, keep_alive = 0;
+    p = line_end + 2;
+    while (p < end) {
+        char *eol = memchr(p, '\r', end - p + 1);
+        char *colon = memchr(p, ':', eol - p);
+        if (!colon || colon == p) return parse_error(request, "400 Bad Request", "Malformed header");
+        if (request->header_count == MAX_HEADERS) {
+            return parse_error(request, "431 Request Header Fields Too Large", "Too many headers");
+        }
+        char *value = colon + 1, *value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        
+        HttpHeader *header = &request->headers[request->header_count++];
+        header->name = (StringView){ p, colon - p };
+        header->value = (StringView){ value, value_end - value };
+        
+        if (view_equals_ci(header->name, "Content-Length")) {
+            size_t length = 0;
+            if (header->value.len == 0 || header->value.len > 12) {
+                return parse_error(request, "400 Bad Request", "Invalid Content-Length");
+            }
+            for (size_t i = 0; i < header->value.len; i++) {
+                if (value[i] < '0' || value[i] > '9') return parse_error(request, "400 Bad Request", "Invalid Content-Length");
+                length = length * 10 + (value[i] - '0');
+            }
+            if (has_length && length != request->content_length) {
+                return parse_error(request, "400 Bad Request", "Conflicting Content-Length");
+            }
+            has_length = 1;
+            request->content_length = length;
+        } else if (view_equals_ci(header->name, "Transfer-Encoding")) {
+            return parse_error(request, "411 Length Required", "Chunked request bodies are not supported; send Content-Length");
+        } else if (view_equals_ci(header->name, "Connection")) {
+            close |= view_has_token(header->value, "close");
+            keep_alive |= view_has_token(header->value, "keep-alive");
+        } else if (view_equals_ci(header->name, "Expect")) {
+            request->expect_continue = view_has_token(header->value, "100-continue");
+        }
+        p = eol + 2;
+    }
+    
+    // Bulk uploads are consumed line by line as they arrive, so their bodies have no size limit
+    if (view_equals(request->method, "POST") && view_equals(request->path, "/api/patients/bulk")) {
+        request->bulk = BULK_PATIENTS;
+    } else if (view_equals(request->method, "POST") && view_equals(request->path, "/api/clinical-actions/bulk")) {
+        request->bulk = BULK_ACTIONS;
+    }
+    if (!request->bulk && request->content_length > MAX_REQUEST_BODY) {
+        return parse_error(request, "413 Payload Too Large", "Request body too large");
+    }
+    request->keep_alive = request->http11 ? !close : keep_alive;
+    request->total_len = request->header_len + (request->bulk ? 0 : request->content_length);
+    return PARSE_DONE;
+}
+
+// Resume parsing the request at data[0..len); call again with more bytes after PARSE_INCOMPLETE
+ParseStatus http_parse_request(HttpRequest *request, char *data, size_t len) {
+    if (request->header_len == 0) {
+        size_t from = request->scanned > 3 ? request->scanned - 3 : 0;
+        char *blank = len > from ? memmem(data + from, len - from, "\r\n\r\n", 4) : NULL;
+        if (!blank) {
+            request->scanned = len;
+            if (len > MAX_HEADER_BYTES) {
+                return parse_error(request, "431 Request Header Fields Too Large", "Request headers too large");
+            }
+            return PARSE_INCOMPLETE;
+        }
+        request->header_len = blank + 4 - data;
+        if (request->header_len > MAX_HEADER_BYTES) {
+            return parse_error(request, "431 Request Header Fields Too Large", "Request headers too large");
+        }
+        if (parse_request_head(request, data) == PARSE_ERROR) return PARSE_ERROR;
+    }
+    
+    if (len < request->total_len) return PARSE_INCOMPLETE;
+    request->body = (StringView){ data + request->header_len, request->total_len - request->header_len };
+    return PARSE_DONE;
+}
+
+// JSON parsing
+// Request bodies are tokenized in one pass, in place: string values are
+// decoded straight into the record field their key maps to, and unknown keys
+// are skipped. Runs of plain string bytes are found eight at a time (SWAR),
+// since long titles and descriptions dominate bulk uploads.
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define JSON_MAX_DEPTH 32
+#define JSON_ERROR_SIZE 96
+
+typedef enum {
+    FIELD_STRING,
+    FIELD_INT
+} FieldKind;
+
+// Where a body key lands in its record
+typedef struct {
+    const char *key;
+    FieldKind kind;
+    size_t offset;
+    size_t size;
+    int required;
+} JsonField;
+
+#define STRING_FIELD(type, name, required) { #name, FIELD_STRING, offsetof(type, name), sizeof(((type *)0)->name), required }
+#define INT_FIELD(type, name, required) { #name, FIELD_INT, offsetof(type, name), sizeof(int), required }
+
+const JsonField patientFields[] = {
+    STRING_FIELD(Patient, name, 1),
+    INT_FIELD(Patient, age, 1),
+    STRING_FIELD(Patient, gender, 1),
+    STRING_FIELD(Patient, condition, 1),
+    STRING_FIELD(Patient, bloodGroup, 0),
+    STRING_FIELD(Patient, admissionDate, 0),
+    STRING_FIELD(Patient, status, 0),
+};
+
+const JsonField actionFields[] = {
+    STRING_FIELD(ClinicalAction, patientId, 1),
+    STRING_FIELD(ClinicalAction, type, 1),
+    STRING_FIELD(ClinicalAction, title, 1),
+    STRING_FIELD(ClinicalAction, description, 1),
+    STRING_FIELD(ClinicalAction, assignedTo, 1),
+    STRING_FIELD(ClinicalAction, initiatedBy, 0),
+    STRING_FIELD(ClinicalAction, initiatedByDepartment, 0),
+    STRING_FIELD(ClinicalAction, priority, 0),
+};
+
+const JsonField statusFields[] = {
+    STRING_FIELD(ClinicalAction, status, 1),
+};
+
+const JsonField patientStatusFields[] = {
+    STRING_FIELD(Patient, status, 1),
+};
+
+typedef struct {
+    const char *p;
+    const char *end;
+    char *error;  // JSON_ERROR_SIZE bytes, set when a call returns 0
+} JsonParser;
+
+int json_fail(JsonParser *parser, const char *message, const char *key) {
+    if (key) snprintf(parser->error, JSON_ERROR_SIZE, "Field %s %s", key, message);
+    else snprintf(parser->error, JSON_ERROR_SIZE, "%s", message);
+    return 0;
+}
+
+void json_skip_space(JsonParser *parser) {
+    while (parser->p < parser->end && (*parser->p == ' ' || *parser->p == '\t' ||
+                                       *parser->p == '\n' || *parser->p == '\r')) {
+        parser->p++;
+    }
+}
+
+// First byte in [p, end) that ends a run of plain string bytes: a quote, a backslash or a control
+// character. Words without one are skipped whole; the word holding one is finished bytewise.
+const char *json_scan_string(const char *p, const char *end) {
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        uint64_t quote = word ^ (SWAR_ONES * '"');
+        uint64_t backslash = word ^ (SWAR_ONES * '\\');
+        uint64_t hits = ((quote - SWAR_ONES) & ~quote) | ((backslash - SWAR_ONES) & ~backslash) |
+                        ((word - SWAR_ONES * 0x20) & ~word);
+        if (hits & SWAR_HIGHS) break;
+        p += 8;
+    }
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+int json_hex4(const char *p, const char *end, uint32_t *value) {
+    if (end - p < 4) return 0;
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)p[i])) return 0;
+        *value = *value << 4 | (uint32_t)(isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+    }
+    return 1;
+}
+
+long json_string_error(JsonParser *parser, const char *message) {
+    json_fail(parser, message, NULL);
+    return -1;
+}
+
+// Decode the string whose opening quote is at parser->p into out[0..size) (NULL skips it).
+// Returns the decoded length, which is size or more if it did not fit, or -1 on malformed input.
+long json_string(JsonParser *parser, char *out, size_t size) {
+    const char *p = parser->p + 1, *end = parser->end;
+    size_t len = 0;
+    for (;;) {
+        const char *run = p;
+        p = json_scan_string(p, end);
+        if (out && len < size) memcpy(out + len, run, (size_t)(p - run) < size - len ? (size_t)(p - run) : size - len);
+        len += p - run;
+        if (p == end) return json_string_error(parser, "Unterminated string");
+        if (*p == '"') break;
+        if (*p != '\\') return json_string_error(parser, "Control character in string");
+        
+        // Escape sequence, decoded to at most four UTF-8 bytes
+        char decoded[4];
+        size_t n = 1;
+        if (++p == end) return json_string_error(parser, "Unterminated string");
+        switch (*p++) {
+            case '"': decoded[0] = '"'; break;
+            case '\\': decoded[0] = '\\'; break;
+            case '/': decoded[0] = '/'; break;
+            case 'b': decoded[0] = '\b'; break;
+            case 'f': decoded[0] = '\f'; break;
+            case 'n': decoded[0] = '\n'; break;
+            case 'r': decoded[0] = '\r'; break;
+            case 't': decoded[0] = '\t'; break;
+            case 'u': {
+                uint32_t code, low;
+                if (!json_hex4(p, end, &code)) return json_string_error(parser, "Invalid unicode escape");
+                p += 4;
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !json_hex4(p + 2, end, &low) ||
+                        low < 0xDC00 || low > 0xDFFF) {
+                        return json_string_error(parser, "Unpaired surrogate in string");
+                    }
+                    p += 6;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                    return json_string_error(parser, "Unpaired surrogate in string");
+                }
+                // Records are NUL-terminated, so an embedded NUL cannot be stored
+                if (code == 0) return json_string_error(parser, "NUL character in string");
+                if (code < 0x80) {
+                    decoded[0] = (char)code;
+                } else if (code < 0x800) {
+                    decoded[0] = (char)(0xC0 | code >> 6);
+                    decoded[1] = (char)(0x80 | (code & 0x3F));
+                    n = 2;
+                } else if (code < 0x10000) {
+                    decoded[0] = (char)(0xE0 | code >> 12);
+                    decoded[1] = (char)(0x80 | (code >> 6 & 0x3F));
+                    decoded[2] = (char)(0x80 | (code & 0x3F));
+                    n = 3;
+                } else {
+                    decoded[0] = (char)(0xF0 | code >> 18);
+                    decoded[1] = (char)(0x80 | (code >> 12 & 0x3F));
+                    decoded[2] = (char)(0x80 | (code >> 6 & 0x3F));
+                    decoded[3] = (char)(0x80 | (code & 0x3F));
+                    n = 4;
+                }
+                break;
+            }
+            default:
+                return json_string_error(parser, "Invalid escape in string");
+        }
+        if (out && len + n <= size) memcpy(out + len, decoded, n);
+        len += n;
+    }
+    parser->p = p + 1;
+    if (out && len < size) out[len] = '\0';
+    return (long)len;
+}
+
+int json_literal(JsonParser *parser, const char *literal) {
+    size_t len = strlen(literal);
+    if ((size_t)(parser->end - parser->p) < len || memcmp(parser->p, literal, len) != 0) {
+        return json_fail(parser, "Invalid JSON value", NULL);
+    }
+    parser->p += len;
+    return 1;
+}
+
+// An integer value; fractions, exponents and values beyond int are rejected
+int json_int(JsonParser *parser, int *value, const char *key) {
+    const char *p = parser->p;
+    int negative = p < parser->end && *p == '-';
+    if (negative) p++;
+    if (p == parser->end || !isdigit((unsigned char)*p)) return json_fail(parser, "must be an integer", key);
+    long long n = 0;
+    while (p < parser->end && isdigit((unsigned char)*p)) {
+        n = n * 10 + (*p++ - '0');
+        if (n > 2147483648LL) return json_fail(parser, "is out of range", key);
+    }
+    if (p < parser->end && (*p == '.' || *p == 'e' || *p == 'E')) return json_fail(parser, "must be an integer", key);
+    if (negative) n = -n;
+    if (n > 2147483647LL) return json_fail(parser, "is out of range", key);
+    *value = (int)n;
+    parser->p = p;
+    return 1;
+}
+
+// Step over any value, for keys no field maps
+int json_skip_value(JsonParser *parser, int depth) {
+    if (depth > JSON_MAX_DEPTH) return json_fail(parser, "JSON nested too deeply", NULL);
+    json_skip_space(parser);
+    if (parser->p == parser->end) return json_fail(parser, "Unexpected end of JSON", NULL);
+    char c = *parser->p;
+    if (c == '"') return json_string(parser, NULL, 0) >= 0;
+    if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        parser->p++;
+        json_skip_space(parser);
+        if (parser->p < parser->end && *parser->p == close) {
+            parser->p++;
+            return 1;
+        }
+        for (;;) {
+            if (c == '{') {
+                json_skip_space(parser);
+                if (parser->p == parser->end || *parser->p != '"') return json_fail(parser, "Expected object key", NULL);
+                if (json_string(parser, NULL, 0) < 0) return 0;
+                json_skip_space(parser);
+                if (parser->p == parser->end || *parser->p != ':') return json_fail(parser, "Expected ':'", NULL);
+                parser->p++;
+            }
+            if (!json_skip_value(parser, depth + 1)) return 0;
+            json_skip_space(parser);
+            if (parser->p < parser->end && *parser->p == ',') {
+                parser->p++;
+                continue;
+            }
+            if (parser->p < parser->end && *parser->p == close) {
+                parser->p++;
+                return 1;
+            }
+            return json_fail(parser, "Expected ',' or closing bracket", NULL);
+        }
+    }
+    if (c == 't') return json_literal(parser, "true");
+    if (c == 'f') return json_literal(parser, "false");
+    if (c == 'n') return json_literal(parser, "null");
+    if (c == '-' || isdigit((unsigned char)c)) {
+        const char *start = parser->p;
+        while (parser->p < parser->end && (isdigit((unsigned char)*parser->p) || *parser->p == '-' || *parser->p == '+' ||
+                                           *parser->p == '.' || *parser->p == 'e' || *parser->p == 'E')) {
+            parser->p++;
+        }
+        return parser->p > start;
+    }
+    return json_fail(parser, "Invalid JSON value", NULL);
+}
+
+// Parse one JSON object from [data, data + len) into record through fields. Keys may come in any
+// order and repeat (the last wins); null leaves a field at its default. Returns 1 if the body is a
+// single well-formed object holding every required field, else 0 with the reason in error.
+int json_parse_record(const char *data, size_t len, void *record, const JsonField *fields, int field_count, char *error) {
+    JsonParser parser = { data, data + len, error };
+    uint32_t seen = 0;
+    
+    json_skip_space(&parser);
+    if (parser.p == parser.end || *parser.p != '{') return json_fail(&parser, "Expected a JSON object", NULL);
+    parser.p++;
+    json_skip_space(&parser);
+    if (parser.p < parser.end && *parser.p == '}') {
+        parser.p++;
+    } else {
+        for (;;) {
+            json_skip_space(&parser);
+            if (parser.p == parser.end || *parser.p != '"') return json_fail(&parser, "Expected object key", NULL);
+            char key[32];
+            long key_len = json_string(&parser, key, sizeof(key));
+            if (key_len < 0) return 0;
+            json_skip_space(&parser);
+            if (parser.p == parser.end || *parser.p != ':') return json_fail(&parser, "Expected ':'", NULL);
+            parser.p++;
+            json_skip_space(&parser);
+            
+            const JsonField *field = NULL;
+            if ((size_t)key_len < sizeof(key)) {
+                for (int i = 0; i < field_count; i++) {
+                    if (strcmp(fields[i].key, key) == 0) {
+                        field = &fields[i];
+                        break;
+                    }
+                }
+            }
+            if (!field || (parser.p < parser.end && *parser.p == 'n')) {
+                if (!json_skip_value(&parser, 0)) return 0;
+            } else if (field->kind == FIELD_INT) {
+                if (!json_int(&parser, (int *)((char *)record + field->offset), field->key)) return 0;
+                seen |= 1u << (field - fields);
+            } else {
+                if (parser.p == parser.end || *parser.p != '"') return json_fail(&parser, "must be a string", field->key);
+                long value_len = json_string(&parser, (char *)record + field->offset, field->size);
+                if (value_len < 0) return 0;
+                if ((size_t)value_len >= field->size) return json_fail(&parser, "is too long", field->key);
+                seen |= 1u << (field - fields);
+            }
+            
+            json_skip_space(&parser);
+            if (parser.p < parser.end && *parser.p == ',') {
+                parser.p++;
+                continue;
+            }
+            if (parser.p < parser.end && *parser.p == '}') {
+                parser.p++;
+                break;
+            }
+            return json_fail(&parser, "Expected ',' or '}'", NULL);
+        }
+    }
+    json_skip_space(&parser);
+    if (parser.p != parser.end) return json_fail(&parser, "Unexpected data after JSON object", NULL);
+    
+    for (int i = 0; i < field_count; i++) {
+        if (fields[i].required && !(seen & (1u << i))) return json_fail(&parser, "is required", fields[i].key);
+    }
+    return 1;
+}
+
+// Fill a new patient from a create request body; returns 1 if it is valid, else 0 with the reason
+// in error. The id is left for the writer to assign.
+int parse_patient(const char *body, size_t len, Patient *patient, char *error) {
+    memset(patient, 0, sizeof(*patient));
+    strcpy(patient->bloodGroup, "O+");
+    strcpy(patient->status, "admitted");
+    strcpy(patient->admissionDate, "2024-01-17");
+    return json_parse_record(body, len, patient, patientFields, sizeof(patientFields) / sizeof(patientFields[0]), error);
+}
+
+// Fill a new clinical action from a create request body; returns 1 if it is valid, else 0 with
+// the reason in error. The id and timestamps are left for the writer to assign.
+int parse_action(const char *body, size_t len, ClinicalAction *action, char *error) {
+    memset(action, 0, sizeof(*action));
+    strcpy(action->initiatedBy, "Dr. Smith");
+    strcpy(action->initiatedByDepartment, "Doctor");
+    strcpy(action->status, "pending");
+    strcpy(action->priority, "medium");
+    if (!json_parse_record(body, len, action, actionFields, sizeof(actionFields) / sizeof(actionFields[0]), error)) {
+        return 0;
+    }
+    if (enum_code(priorityNames, PRIORITY_COUNT, action->priority) < 0) {
+        snprintf(error, JSON_ERROR_SIZE, "Field priority must be high, medium or low");
+        return 0;
+    }
+    return 1;
+}
+
+// JSON generation functions
+// Append value as a quoted JSON string after prefix, escaping quotes, backslashes and control
+// characters; returns the new end of out (6 bytes per input byte at most)
+char *json_member(char *out, const char *prefix, const char *value) {
+    size_t prefix_len = strlen(prefix);
+    memcpy(out, prefix, prefix_len);
+    out += prefix_len;
+    *out++ = '"';
+    const char *p = value, *end = value + strlen(value);
+    for (;;) {
+        const char *run = p;
+        p = json_scan_string(p, end);
+        memcpy(out, run, p - run);
+        out += p - run;
+        if (p == end) break;
+        unsigned char c = (unsigned char)*p++;
+        *out++ = '\\';
+        switch (c) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '\n': *out++ = 'n'; break;
+            case '\r': *out++ = 'r'; break;
+            case '\t': *out++ = 't'; break;
+            default: out += sprintf(out, "u%04x", c); break;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+int patient_to_json(const Patient *patient, char *json) {
+    char *out = json;
+    char id[37];
+    format_uuid(&patient->id, id);
+    out = json_member(out, "{\"id\":", id);
+    out = json_member(out, ",\"name\":", patient->name);
+    out += sprintf(out, ",\"age\":%d", patient->age);
+    out = json_member(out, ",\"gender\":", patient->gender);
+    out = json_member(out, ",\"bloodGroup\":", patient->bloodGroup);
+    out = json_member(out, ",\"admissionDate\":", patient->admissionDate);
+    out = json_member(out, ",\"condition\":", patient->condition);
+    out = json_member(out, ",\"status\":", patient->status);
+    *out++ = '}';
+    *out = '\0';
+    return out - json;
+}
+
+int action_to_json(const ClinicalAction *action, char *json) {
+    char *out = json;
+    char id[37], createdAt[20], updatedAt[20];
+    format_uuid(&action->id, id);
+    format_timestamp(action->createdAt, createdAt);
+    format_timestamp(action->updatedAt, updatedAt);
+    out = json_member(out, "{\"id\":", id);
+    out = json_member(out, ",\"patientId\":", action->patientId);
+    out = json_member(out, ",\"type\":", action->type);
+    out = json_member(out, ",\"title\":", action->title);
+    out = json_member(out, ",\"description\":", action->description);
+    out = json_member(out, ",\"initiatedBy\":", action->initiatedBy);
+    out = json_member(out, ",\"initiatedByDepartment\":", action->initiatedByDepartment);
+    out = json_member(out, ",\"assignedTo\":", action->assignedTo);
+    out = json_member(out, ",\"status\":", action->status);
+    out = json_member(out, ",\"priority\":", action->priority);
+    out = json_member(out, ",\"createdAt\":", createdAt);
+    out = json_member(out, ",\"updatedAt\":", updatedAt);
+    *out++ = '}';
+    *out = '\0';
+    return out - json;
+}
+
+int render_patient(uint32_t ref, const void *record, char *json) {
+    (void)ref;
+    return patient_to_json(record, json);
+}
+
+int render_action(uint32_t ref, const void *record, char *json) {
+    ClinicalAction action;
+    action_expand(ref, record, &action);
+    return action_to_json(&action, json);
+}
+
+// Streaming list serializers
+// Each call appends the pre-rendered fragments of records from stream->next
+// onward into out and stops once out reaches limit bytes. The list is closed
+// with ']' when the snapshot is exhausted.
+int json_stream_open(Buffer *out, JsonStream *stream) {
+    if (!stream->started) {
+        buffer_append(out, "[", 1);
+        stream->started = 1;
+    }
+    return stream->next < stream->count;
+}
+
+void json_stream_close(Buffer *out, JsonStream *stream) {
+    if (stream->next >= stream->count) {
+        buffer_append(out, "]", 1);
+        stream->kind = STREAM_NONE;
+    }
+}
+
+void append_fragment(Buffer *out, Fragment *fragment, int comma) {
+    buffer_reserve(out, fragment->len + 1);
+    if (comma) out->data[out->len++] = ',';
+    memcpy(out->data + out->len, fragment->data, fragment->len);
+    out->len += fragment->len;
+}
+
+void patients_to_json(Buffer *out, JsonStream *stream, size_t limit) {
+    if (json_stream_open(out, stream)) {
+        while (out->len < limit &&
+               (stream->next = bitmap_next(&hotPatients, stream->next, stream->count)) < stream->count) {
+            append_fragment(out, store_fragment(&patientStore, stream->next), stream->written++ > 0);
+            stream->next++;
+        }
+    }
+    json_stream_close(out, stream);
+}
+
+void actions_to_json(Buffer *out, JsonStream *stream, size_t limit) {
+    if (json_stream_open(out, stream)) {
+        while (out->len < limit &&
+               (stream->next = bitmap_next(&hotActions, stream->next, stream->count)) < stream->count) {
+            append_fragment(out, store_fragment(&actionStore, stream->next), stream->written++ > 0);
+            stream->next++;
+        }
+    }
+    json_stream_close(out, stream);
+}
+
+// Walks only this patient's action list instead of scanning every action
+void patient_actions_to_json(Buffer *out, JsonStream *stream, size_t limit) {
+    if (json_stream_open(out, stream)) {
+        // The list may have been copied on growth since the last chunk; the snapshot prefix is unchanged
+        ActionList *list = __atomic_load_n(patient_action_list(stream->patient_ref), __ATOMIC_ACQUIRE);
+        while (stream->next < stream->count && out->len < limit) {
+            append_fragment(out, store_fragment(&actionStore, list->refs[stream->next]), stream->next > stream->first);
+            stream->next++;
+        }
+    }
+    json_stream_close(out, stream);
+}
+
+// HTML template
+const char* get_html_template() {
+    return "<!DOCTYPE html>\n"
+           "<html lang=\"en\">\n"
+           "<head>\n"
+           "    <meta charset=\"UTF-8\">\n"
+           "    <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
+           "    <title>Patient Clinical Workflow - C Version</title>\n"
+           "    <style>\n"
+           "        body { font-family: Arial, sans-serif; margin: 20px; background: #f5f5f5; }\n"
+           "        .container { max-width: 1200px; margin: 0 auto; }\n"
+           "        .card { background: white; padding: 20px; margin: 10px 0; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }\n"
+           "        .patient { border-left: 4px solid #007bff; }\n"
+           "        .action { border-left: 4px solid #28a745; }\n"
+           "        .status-pending { background: #fff3cd; }\n"
+           "        .status-in-progress { background: #cce5ff; }\n"
+           "        .status-completed { background: #d4edda; }\n"
+           "        button { background: #007bff; color: white; padding: 8px 16px; border: none; border-radius: 4px; cursor: pointer; }\n"
+           "        button:hover { background: #0056b3; }\n"
+           "        .grid { display: grid; grid-template-columns: 1fr 1fr; gap: 20px; }\n"
+           "        input, select, textarea { width: 100%; padding: 8px; margin: 5px 0; border: 1px solid #ddd; border-radius: 4px; }\n"
+           "    </style>\n"
+           "</head>\n"
+           "<body>\n"
+           "    <div class=\"container\">\n"
+           "        <h1>Patient-Centric Clinical Workflow System</h1>\n"
+           "        <p>C Implementation with Raw Sockets</p>\n"
+           "        \n"
+           "        <div class=\"card\">\n"
+           "            <h2>Patients</h2>\n"
+           "            <div id=\"patients-list\"></div>\n"
+           "        </div>\n"
+           "        \n"
+           "        <div class=\"grid\">\n"
+           "            <div class=\"card\">\n"
+           "                <h2>Add Patient</h2>\n"
+           "                <form id=\"patient-form\">\n"
+           "                    <input type=\"text\" id=\"name\" placeholder=\"Patient Name\" required>\n"
+           "                    <input type=\"number\" id=\"age\" placeholder=\"Age\" required>\n"
+           "                    <select id=\"gender\" required>\n"
+           "                        <option value=\"\">Select Gender</option>\n"
+           "                        <option value=\"Male\">Male</option>\n"
+           "                        <option value=\"Female\">Female</option>\n"
+           "                    </select>\n"
+           "                    <input type=\"text\" id=\"condition\" placeholder=\"Condition\" required>\n"
+           "                    <button type=\"submit\">Add Patient</button>\n"
+           "                </form>\n"
+           "            </div>\n"
+           "            \n"
+           "            <div class=\"card\">\n"
+           "                <h2>Create Clinical Action</h2>\n"
+           "                <form id=\"action-form\">\n"
+           "                    <select id=\"patient-select\" required>\n"
+           "                        <option value=\"\">Select Patient</option>\n"
+           "                    </select>\n"
+           "                    <select id=\"action-type\" required>\n"
+           "                        <option value=\"prescription\">Prescription</option>\n"
            "                        <option value=\"diagnostic\">Diagnostic</option>\n"
            "                        <option value=\"referral\">Referral</option>\n"
            "                    </select>\n"
@@ -293,19 +4797,57 @@ const char* get_html_template() {
            "    <script>\n"
            "        let patients = [];\n"
            "        let actions = [];\n"
+           "        let lastSeq = 0;\n"
            "        \n"
            "        async function loadData() {\n"
+           "            // Note the change sequence first, so changes made during the load are caught up later\n"
+           "            lastSeq = Math.max(lastSeq, (await (await fetch('/api/changes')).json()).seq);\n"
            "            const [patientsRes, actionsRes] = await Promise.all([\n"
            "                fetch('/api/patients'),\n"
            "                fetch('/api/clinical-actions')\n"
            "            ]);\n"
            "            \n"
-           "            patients = await patientsRes.json();\n"
-           "            actions = await actionsRes.json();\n"
+           "            // Keep records pushed while the lists were loading\n"
+           "            patients = mergeById(await patientsRes.json(), patients);\n"
+           "            actions = mergeById(await actionsRes.json(), actions);\n"
            "            \n"
            "            updateUI();\n"
            "        }\n"
            "        \n"
+           "        function mergeById(loaded, pushed) {\n"
+           "            const ids = new Set(loaded.map(r => r.id));\n"
+           "            return loaded.concat(pushed.filter(r => !ids.has(r.id)));\n"
+           "        }\n"
+           "        \n"
+           "        function replaceById(records, changed) {\n"
+           "            const byId = new Map(changed.map(r => [r.id, r]));\n"
+           "            return mergeById(records.map(r => byId.get(r.id) || r), changed);\n"
+           "        }\n"
+           "        \n"
+           "        function removeById(records, removed) {\n"
+           "            const ids = new Set(removed);\n"
+           "            return records.filter(r => !ids.has(r.id));\n"
+           "        }\n"
+           "        \n"
+           "        // Fetch only what changed since the last event seen; reload everything if that is too long ago\n"
+           "        async function catchUp() {\n"
+           "            for (;;) {\n"
+           "                const changes = await (await fetch('/api/changes?since=' + lastSeq)).json();\n"
+           "                if (changes.resync) return loadData();\n"
+           "                patients = replaceById(patients, changes.patients);\n"
+           "                actions = replaceById(actions, changes.clinicalActions);\n"
+           "                patients = removeById(patients, changes.archived.patients);\n"
+           "                actions = removeById(actions, changes.archived.clinicalActions);\n"
+           "                lastSeq = changes.seq;\n"
+           "                if (!changes.more) break;\n"
+           "            }\n"
+           "            updateUI();\n"
+           "        }\n"
+           "        \n"
+           "        function seen(e) {\n"
+           "            lastSeq = Math.max(lastSeq, Number(e.lastEventId));\n"
+           "        }\n"
+           "        \n"
            "        function updateUI() {\n"
            "            updatePatientsList();\n"
            "            updateActionsList();\n"
@@ -357,7 +4899,6 @@ const char* get_html_template() {
            "            });\n"
            "            \n"
            "            e.target.reset();\n"
-           "            loadData();\n"
            "        });\n"
            "        \n"
            "        document.getElementById('action-form').addEventListener('submit', async (e) => {\n"
@@ -378,9 +4919,45 @@ const char* get_html_template() {
            "            });\n"
            "            \n"
            "            e.target.reset();\n"
-           "            loadData();\n"
            "        });\n"
            "        \n"
+           "        // New records arrive as server-sent events instead of re-fetching both lists\n"
+           "        const events = new EventSource('/api/events');\n"
+           "        events.addEventListener('patientCreated', (e) => {\n"
+           "            seen(e);\n"
+           "            patients = mergeById(patients, [JSON.parse(e.data)]);\n"
+           "            updateUI();\n"
+           "        });\n"
+           "        events.addEventListener('clinicalActionCreated', (e) => {\n"
+           "            seen(e);\n"
+           "            actions = mergeById(actions, [JSON.parse(e.data)]);\n"
+           "            updateActionsList();\n"
+           "        });\n"
+           "        events.addEventListener('actionUpdated', (e) => {\n"
+           "            seen(e);\n"
+           "            actions = replaceById(actions, [JSON.parse(e.data)]);\n"
+           "            updateActionsList();\n"
+           "        });\n"
+           "        events.addEventListener('patientUpdated', (e) => {\n"
+           "            seen(e);\n"
+           "            patients = replaceById(patients, [JSON.parse(e.data)]);\n"
+           "            updatePatientsList();\n"
+           "        });\n"
+           "        // Archived records leave the lists; a patient's actions go with it\n"
+           "        events.addEventListener('patientArchived', (e) => {\n"
+           "            seen(e);\n"
+           "            const id = JSON.parse(e.data).id;\n"
+           "            patients = removeById(patients, [id]);\n"
+           "            actions = actions.filter(a => a.patientId !== id);\n"
+           "            updateUI();\n"
+           "        });\n"
+           "        events.addEventListener('actionArchived', (e) => {\n"
+           "            seen(e);\n"
+           "            actions = removeById(actions, [JSON.parse(e.data).id]);\n"
+           "            updateActionsList();\n"
+           "        });\n"
+           "        events.addEventListener('resync', catchUp);\n"
+           "        \n"
            "        // Load initial data\n"
            "        loadData();\n"
            "    </script>\n"
@@ -388,158 +4965,2227 @@ const char* get_html_template() {
            "</html>";
 }
 
-// Route handlers
-void handle_patients_request(int client_socket) {
-    char json[10000];
-    patients_to_json(json);
-    send_json_response(client_socket, json);
+// Pre-rendered index page
+StaticResponse indexPage;
+
+uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Each coding is compressed once here with the thorough match search and gets its own ETag, since
+// its bytes differ
+void render_static_response(StaticResponse *response, const char *content_type, const char *body) {
+    size_t body_len = strlen(body);
+    unsigned long long hash = hash_bytes(body, body_len);
+    
+    for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+        Buffer encoded = {0};
+        char coding[64] = "";
+        if (encoding == ENCODING_IDENTITY) {
+            buffer_append(&encoded, body, body_len);
+            snprintf(response->etag[encoding], sizeof(response->etag[encoding]), "\"%016llx-%zx\"", hash, body_len);
+        } else {
+            compress_body(&encoded, encoding, body, body_len, DEFLATE_CHAIN_CACHED);
+            snprintf(coding, sizeof(coding), "Content-Encoding: %s\r\n", encodingNames[encoding]);
+            snprintf(response->etag[encoding], sizeof(response->etag[encoding]), "\"%016llx-%zx-%s\"", hash, body_len,
+                     encodingNames[encoding]);
+        }
+        
+        for (int keep_alive = 0; keep_alive <= 1; keep_alive++) {
+            char header[640];
+            int header_len = snprintf(header, sizeof(header),
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "Access-Control-Allow-Origin: *\r\n"
+                    "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+                    "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "Vary: Accept-Encoding\r\n"
+                    "ETag: %s\r\n"
+                    "%s"
+                    "Content-Length: %zu\r\n"
+                    "Connection: %s\r\n"
+                    "\r\n",
+                    content_type, response->etag[encoding], coding, encoded.len, keep_alive ? "keep-alive" : "close");
+            buffer_append(&response->ok[encoding][keep_alive], header, header_len);
+            buffer_append(&response->ok[encoding][keep_alive], encoded.data, encoded.len);
+            
+            header_len = snprintf(header, sizeof(header),
+                    "HTTP/1.1 304 Not Modified\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "Vary: Accept-Encoding\r\n"
+                    "ETag: %s\r\n"
+                    "Connection: %s\r\n"
+                    "\r\n",
+                    response->etag[encoding], keep_alive ? "keep-alive" : "close");
+            buffer_append(&response->not_modified[encoding][keep_alive], header, header_len);
+        }
+        free(encoded.data);
+    }
+}
+
+// If-None-Match uses the weak comparison: W/ prefixes are ignored and "*" matches anything
+int etag_matches(const StringView *if_none_match, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = if_none_match->data, *end = p + if_none_match->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p < end && *p == '*') return 1;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        if ((size_t)(end - p) >= etag_len && memcmp(p, etag, etag_len) == 0) return 1;
+        while (p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+void send_static_response(Connection *conn, HttpRequest *request, StaticResponse *response) {
+    const StringView *if_none_match = request_header(request, "If-None-Match");
+    Buffer *prepared = if_none_match && etag_matches(if_none_match, response->etag[conn->encoding])
+                       ? &response->not_modified[conn->encoding][conn->keep_alive]
+                       : &response->ok[conn->encoding][conn->keep_alive];
+    if (prepared != &response->ok[conn->encoding][conn->keep_alive]) conn->status = 304;
+    connection_splice(conn, prepared->data, prepared->len, NULL);
+}
+
+// Change event publishing
+// Number the change to record ref of store, note it in the change log, and frame the record as one
+// SSE message in the event ring (caller holds write_lock)
+// Publish data as the next change's SSE event and log store's record ref as changed (caller holds
+// write_lock)
+void publish_message(const char *name, const char *patientId, const char *department, const char *data,
+                     uint32_t len, RecordStore *store, uint32_t ref) {
+    uint64_t seq = change_seq + 1;
+    char head[64];
+    int head_len = snprintf(head, sizeof(head), "id: %llu\nevent: %s\ndata: ", (unsigned long long)seq, name);
+    Event *event = malloc(sizeof(Event) + head_len + len + 2);
+    if (!event) {
+        fprintf(stderr, "Out of memory publishing event\n");
+        abort();
+    }
+    event->seq = seq;
+    snprintf(event->patientId, sizeof(event->patientId), "%s", patientId);
+    snprintf(event->department, sizeof(event->department), "%s", department);
+    memcpy(event->data, head, head_len);
+    // A raw line break would end the data field early
+    for (uint32_t i = 0; i < len; i++) {
+        char c = data[i];
+        event->data[head_len + i] = (c == '\n' || c == '\r') ? ' ' : c;
+    }
+    event->len = head_len + len + 2;
+    memcpy(event->data + head_len + len, "\n\n", 2);
+    
+    __atomic_store_n(&change_log[seq % CHANGE_LOG_SIZE], seq << 33 | (uint64_t)ref << 1 | (store == &actionStore),
+                     __ATOMIC_RELAXED);
+    Event **slot = &event_ring[seq % EVENT_RING_SIZE];
+    Event *overwritten = *slot;
+    __atomic_store_n(slot, event, __ATOMIC_RELEASE);
+    __atomic_store_n(&change_seq, seq, __ATOMIC_RELEASE);
+    if (overwritten) retire(overwritten, free);
+}
+
+// Publish a created or changed record with its JSON as the event data
+void publish_event(const char *name, const char *patientId, const char *department, RecordStore *store, uint32_t ref) {
+    const Fragment *record = store_fragment(store, ref);
+    publish_message(name, patientId, department, record->data, record->len, store, ref);
+}
+
+void publish_archived(RecordStore *store, uint32_t ref) {
+    char id[37], patientId[37], data[128];
+    if (store == &patientStore) {
+        format_uuid(&get_patient(ref)->id, patientId);
+        int len = snprintf(data, sizeof(data), "{\"id\":\"%s\"}", patientId);
+        publish_message("patientArchived", patientId, "", data, len, store, ref);
+    } else {
+        format_uuid(&get_action(ref)->id, id);
+        format_uuid(&get_patient(action_patient(ref))->id, patientId);
+        int len = snprintf(data, sizeof(data), "{\"id\":\"%s\",\"patientId\":\"%s\"}", id, patientId);
+        publish_message("actionArchived", patientId, vocabulary_name(&departments, action_assignee(ref)), data, len,
+                        store, ref);
+    }
+}
+
+int event_matches(const Subscription *subscription, const Event *event) {
+    if (subscription->patientId[0] && strcmp(subscription->patientId, event->patientId) != 0) return 0;
+    if (subscription->department[0] && strcmp(subscription->department, event->department) != 0) return 0;
+    return 1;
+}
+
+// Append every event the subscriber has not seen yet and its filters match, or a resync
+// message if some were overwritten before it read them (call inside a read section)
+void subscription_fill(Connection *conn) {
+    Subscription *subscription = &conn->subscription;
+    uint64_t last = __atomic_load_n(&change_seq, __ATOMIC_ACQUIRE);
+    while (subscription->seq < last) {
+        uint64_t seq = subscription->seq + 1;
+        Event *event = __atomic_load_n(&event_ring[seq % EVENT_RING_SIZE], __ATOMIC_ACQUIRE);
+        if (!event || event->seq != seq) {
+            char resync[64];
+            int len = snprintf(resync, sizeof(resync), "id: %llu\nevent: resync\ndata: {}\n\n",
+                               (unsigned long long)last);
+            buffer_append(&conn->out, resync, len);
+            subscription->seq = last;
+            return;
+        }
+        if (event_matches(subscription, event)) buffer_append(&conn->out, event->data, event->len);
+        subscription->seq = seq;
+    }
+}
+
+// Percent-decode [p, end) into value ('+' is a space in query strings); returns -1 if it does not fit
+int url_decode(const char *p, const char *end, char *value, size_t size, int plus_is_space) {
+    size_t len = 0;
+    for (const char *c = p; c < end; c++) {
+        if (len + 1 >= size) return -1;
+        if (*c == '+' && plus_is_space) {
+            value[len++] = ' ';
+        } else if (*c == '%' && end - c > 2 && isxdigit((unsigned char)c[1]) && isxdigit((unsigned char)c[2])) {
+            char hex[3] = { c[1], c[2], '\0' };
+            value[len++] = (char)strtol(hex, NULL, 16);
+            c += 2;
+        } else {
+            value[len++] = *c;
+        }
+    }
+    value[len] = '\0';
+    return 1;
+}
+
+// Copy the URL-decoded value of a query parameter into value; returns 1 if it was found,
+// 0 if it is absent and -1 if it does not fit
+int query_param(const HttpRequest *request, const char *name, char *value, size_t size) {
+    const char *p = request->query.data, *end = p + request->query.len;
+    size_t name_len = strlen(name);
+    while (p && p < end) {
+        const char *amp = memchr(p, '&', end - p);
+        const char *field_end = amp ? amp : end;
+        if ((size_t)(field_end - p) > name_len && memcmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            return url_decode(p + name_len + 1, field_end, value, size, 1);
+        }
+        p = amp ? amp + 1 : end;
+    }
+    return 0;
+}
+
+// Route handlers
+// Start a streamed list response; the event loop serializes it chunk by chunk as the socket drains
+void start_json_stream(Connection *conn, StreamKind kind, uint32_t count, int patient_ref) {
+    JsonStream *stream = &conn->stream;
+    memset(stream, 0, sizeof(*stream));
+    stream->kind = kind;
+    stream->count = count;
+    stream->patient_ref = patient_ref;
+    stream->encoding = conn->encoding;
+    stream->adler32 = 1;
+    send_encoded_header(conn, "200 OK", "application/json", -1, stream->encoding);
+    stream->chunked = conn->http11;
+}
+
+// List response cache
+ListCache patientListCache = { &patientStore, NULL, NULL, PTHREAD_MUTEX_INITIALIZER };
+ListCache actionListCache = { &actionStore, NULL, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// Concatenate every record's fragment into a new list body labelled with the generation it reflects,
+// or return NULL if the body would be too large to cache
+SharedBytes *render_list(RecordStore *store, uint64_t generation) {
+    // Records appended after the count was read are left for the next generation. Fragments
+    // are collected first, since an update can replace one between sizing and copying.
+    uint32_t count = store_count(store), listed = 0;
+    Fragment **fragments = malloc((count ? count : 1) * sizeof(Fragment *));
+    if (!fragments) {
+        fprintf(stderr, "Out of memory rendering list\n");
+        abort();
+    }
+    size_t len = 2;
+    FieldBitmap *hot = store == &patientStore ? &hotPatients : &hotActions;
+    for (uint32_t i = bitmap_next(hot, 0, count); i < count && len <= LIST_CACHE_MAX_BYTES;
+         i = bitmap_next(hot, i + 1, count)) {
+        fragments[listed] = store_fragment(store, i);
+        len += fragments[listed++]->len + 1;
+    }
+    if (len > LIST_CACHE_MAX_BYTES) {
+        free(fragments);
+        return NULL;
+    }
+    
+    SharedBytes *bytes = shared_bytes_create(len, generation);
+    char *p = bytes->data;
+    *p++ = '[';
+    for (uint32_t i = 0; i < listed; i++) {
+        if (i > 0) *p++ = ',';
+        memcpy(p, fragments[i]->data, fragments[i]->len);
+        p += fragments[i]->len;
+    }
+    *p++ = ']';
+    free(fragments);
+    bytes->len = p - bytes->data;
+    return bytes;
+}
+
+// Returns a referenced, current list body, or NULL when the caller should stream instead:
+// the list is too large to cache or another thread is already rebuilding it (call inside a read section)
+SharedBytes *list_cache_get(ListCache *cache) {
+    uint64_t generation = __atomic_load_n(&cache->store->generation, __ATOMIC_ACQUIRE);
+    SharedBytes *bytes = __atomic_load_n(&cache->bytes, __ATOMIC_ACQUIRE);
+    if (bytes && bytes->generation == generation) {
+        __atomic_add_fetch(&bytes->refs, 1, __ATOMIC_ACQ_REL);
+        if (thread_metrics) metric_add(&thread_metrics->list_cache_hits, 1);
+        return bytes;
+    }
+    if (thread_metrics) metric_add(&thread_metrics->list_cache_misses, 1);
+    
+    if (__atomic_load_n(&cache->store->fragment_bytes, __ATOMIC_RELAXED) > LIST_CACHE_MAX_BYTES) return NULL;
+    if (pthread_mutex_trylock(&cache->build_lock) != 0) return NULL;
+    
+    SharedBytes *current = cache->bytes;
+    if (!current || current->generation != generation) {
+        SharedBytes *rendered = render_list(cache->store, generation);
+        if (!rendered) {
+            pthread_mutex_unlock(&cache->build_lock);
+            return NULL;
+        }
+        __atomic_store_n(&cache->bytes, rendered, __ATOMIC_RELEASE);
+        // Connections still sending the old body hold their own references
+        if (current) retire(current, shared_bytes_release);
+        current = rendered;
+    }
+    __atomic_add_fetch(&current->refs, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&cache->build_lock);
+    reclaim_retired();
+    return current;
+}
+
+// Returns a referenced deflate stream of plain (a current list body from list_cache_get), compressing
+// it once per generation, or NULL while another thread is busy with the cache (call inside a read section)
+SharedBytes *list_cache_deflated(ListCache *cache, SharedBytes *plain) {
+    SharedBytes *deflated = __atomic_load_n(&cache->deflated, __ATOMIC_ACQUIRE);
+    if (deflated && deflated->generation >= plain->generation) {
+        __atomic_add_fetch(&deflated->refs, 1, __ATOMIC_ACQ_REL);
+        return deflated;
+    }
+    if (pthread_mutex_trylock(&cache->build_lock) != 0) return NULL;
+    
+    deflated = cache->deflated;
+    if (!deflated || deflated->generation < plain->generation) {
+        Buffer out = {0};
+        deflate_compress(&out, plain->data, plain->len, 1, DEFLATE_CHAIN_CACHED);
+        SharedBytes *compressed = shared_bytes_create(out.len, plain->generation);
+        memcpy(compressed->data, out.data, out.len);
+        free(out.data);
+        compressed->crc32 = crc32_update(0, plain->data, plain->len);
+        compressed->adler32 = adler32_update(1, plain->data, plain->len);
+        compressed->plain_len = plain->len;
+        __atomic_store_n(&cache->deflated, compressed, __ATOMIC_RELEASE);
+        if (deflated) retire(deflated, shared_bytes_release);
+        deflated = compressed;
+    }
+    __atomic_add_fetch(&deflated->refs, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&cache->build_lock);
+    reclaim_retired();
+    return deflated;
+}
+
+// Serve a list from the cache with a single send of prepared bytes, streaming it when uncached.
+// Compressed responses splice the shared deflate stream between their own gzip or zlib framing.
+void send_list_response(Connection *conn, ListCache *cache, StreamKind kind) {
+    SharedBytes *bytes = list_cache_get(cache);
+    if (!bytes) {
+        start_json_stream(conn, kind, store_count(cache->store), -1);
+        return;
+    }
+    SharedBytes *deflated = conn->encoding != ENCODING_IDENTITY && bytes->len >= COMPRESS_MIN_BYTES
+                            ? list_cache_deflated(cache, bytes) : NULL;
+    if (deflated) {
+        shared_bytes_release(bytes);
+        send_encoded_header(conn, "200 OK", "application/json",
+                            (long)(deflated->len + encoding_overhead(conn->encoding)), conn->encoding);
+        encoding_header(&conn->out, conn->encoding);
+        connection_splice(conn, deflated->data, deflated->len, deflated);
+        encoding_trailer(&conn->out, conn->encoding, deflated->crc32, deflated->adler32, deflated->plain_len);
+        return;
+    }
+    send_http_header(conn, "200 OK", "application/json", (long)bytes->len);
+    connection_splice(conn, bytes->data, bytes->len, bytes);
+}
+
+void handle_patients_request(Connection *conn) {
+    send_list_response(conn, &patientListCache, STREAM_PATIENTS);
+}
+
+// Read ?since= / ?until= as a timestamp ("YYYY-MM-DD" means its midnight); returns 1 if it was
+// given, 0 if it is absent and -1 if it is malformed
+int query_time(const HttpRequest *request, const char *name, int64_t *timestamp) {
+    char value[24];
+    int found = query_param(request, name, value, sizeof(value));
+    if (found <= 0) return found;
+    if (strlen(value) == 10) strcat(value, "T00:00:00");
+    return parse_timestamp(value, timestamp) ? 1 : -1;
+}
+
+// Read ?since= and ?until= as the range [*since, *until), open where absent; replies 400 and
+// returns 0 if either is malformed
+int query_time_bounds(Connection *conn, const HttpRequest *request, int64_t *since, int64_t *until) {
+    *since = INT64_MIN;
+    *until = INT64_MAX;
+    if (query_time(request, "since", since) < 0 || query_time(request, "until", until) < 0) {
+        send_http_response(conn, "400 Bad Request", "application/json",
+                           "{\"error\":\"since and until must be YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS\"}");
+        return 0;
+    }
+    return 1;
+}
+
+// Narrow positions [*first, *end) of refs to actions created in [since, until)
+int query_time_range(Connection *conn, const HttpRequest *request, const uint32_t *refs, uint32_t *first,
+                     uint32_t *end) {
+    int64_t since, until;
+    if (!query_time_bounds(conn, request, &since, &until)) return 0;
+    uint32_t count = *end;
+    if (until != INT64_MAX) *end = created_lower_bound(refs, count, until);
+    if (since != INT64_MIN) {
+        uint32_t start = created_lower_bound(refs, *end, since);
+        if (start > *first) *first = start;
+    }
+    return 1;
+}
+
+// An archived patient's actions created in [since, until), copied from its archive entry
+void send_archived_actions(Connection *conn, const HttpRequest *request, const ArchivedPatient *archived) {
+    int64_t since, until;
+    if (!query_time_bounds(conn, request, &since, &until)) return;
+    Buffer body = {0};
+    buffer_append(&body, "[", 1);
+    const uint8_t *p = archived->actions;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < archived->action_count; i++) {
+        int64_t createdAt = (int64_t)get_u64(p);
+        uint32_t len = get_u32(p + 8);
+        if (createdAt >= since && createdAt < until) {
+            if (written++ > 0) buffer_append(&body, ",", 1);
+            buffer_append(&body, (const char *)p + 12, len);
+        }
+        p += 12 + len;
+    }
+    buffer_append(&body, "]", 1);
+    send_http_body(conn, "200 OK", "application/json", body.data, body.len);
+    free(body.data);
+}
+
+// Archived patients are served from their segment; those still being archived, from the stores
+void handle_patient_actions_request(Connection *conn, const HttpRequest *request, const char *patientId) {
+    int patient_ref = index_lookup_text(&patientIndex, patientId);
+    ArchivedPatient archived;
+    if ((patient_ref < 0 || patient_tier(patient_ref) == TIER_ARCHIVED) && archive_lookup_text(patientId, &archived)) {
+        send_archived_actions(conn, request, &archived);
+        return;
+    }
+    ActionList *list = patient_ref < 0 ? NULL : __atomic_load_n(patient_action_list(patient_ref), __ATOMIC_ACQUIRE);
+    uint32_t first = 0, count = list ? __atomic_load_n(&list->count, __ATOMIC_ACQUIRE) : 0;
+    if (!query_time_range(conn, request, list ? list->refs : NULL, &first, &count)) return;
+    start_json_stream(conn, STREAM_PATIENT_ACTIONS, count, patient_ref);
+    conn->stream.first = conn->stream.next = first < count ? first : count;
+}
+
+void handle_patient_request(Connection *conn, const char *id) {
+    int ref = index_lookup_text(&patientIndex, id);
+    ArchivedPatient archived;
+    if ((ref < 0 || patient_tier(ref) == TIER_ARCHIVED) && archive_lookup_text(id, &archived)) {
+        send_http_header(conn, "200 OK", "application/json", archived.len);
+        buffer_append(&conn->out, archived.json, archived.len);
+        return;
+    }
+    if (ref < 0) {
+        send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"Patient not found\"}");
+        return;
+    }
+    Fragment *fragment = store_fragment(&patientStore, ref);
+    send_http_header(conn, "200 OK", "application/json", fragment->len);
+    buffer_append(&conn->out, fragment->data, fragment->len);
+}
+
+// Archived actions are only found through their patient, as they are once the stores are reloaded
+void handle_action_request(Connection *conn, const char *id) {
+    int ref = index_lookup_text(&actionIndex, id);
+    if (ref < 0 || patient_tier(action_patient(ref)) == TIER_ARCHIVED) {
+        send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"Clinical action not found\"}");
+        return;
+    }
+    Fragment *fragment = store_fragment(&actionStore, ref);
+    send_http_header(conn, "200 OK", "application/json", fragment->len);
+    buffer_append(&conn->out, fragment->data, fragment->len);
+}
+
+void handle_actions_request(Connection *conn) {
+    send_list_response(conn, &actionListCache, STREAM_ACTIONS);
+}
+
+// Parse a non-negative decimal that fits in 32 bits
+int parse_count(const char *text, uint32_t *value) {
+    uint64_t parsed = 0;
+    if (!*text) return 0;
+    for (const char *p = text; *p; p++) {
+        if (*p < '0' || *p > '9') return 0;
+        parsed = parsed * 10 + (*p - '0');
+        if (parsed > UINT32_MAX) return 0;
+    }
+    *value = (uint32_t)parsed;
+    return 1;
+}
+
+int parse_sequence(const char *text, uint64_t *value) {
+    uint64_t parsed = 0;
+    if (!*text) return 0;
+    for (const char *p = text; *p; p++) {
+        if (*p < '0' || *p > '9' || parsed > (UINT64_MAX - 9) / 10) return 0;
+        parsed = parsed * 10 + (*p - '0');
+    }
+    *value = parsed;
+    return 1;
+}
+
+// Worklist query: ?assignedTo=, ?status= and ?priority= intersect the actions' bitmaps, ?since= and
+// ?until= bound createdAt, and ?limit= and ?cursor= page through the matches in creation order.
+// While more match, the X-Next-Cursor header holds the id of the page's last action to pass as ?cursor=.
+void handle_action_query(Connection *conn, HttpRequest *request) {
+    static const char *const filter_names[] = { "assignedTo", "status", "priority" };
+    FieldIndex *filter_indexes[] = { &assignedToIndex, &statusIndex, &priorityIndex };
+    char value[MAX_QUERY_VALUE];
+    FieldBitmap *bitmaps[3];
+    int bitmap_count = 0, unmatched = 0;
+    for (int i = 0; i < 3; i++) {
+        int status = query_param(request, filter_names[i], value, sizeof(value));
+        if (status < 0) {
+            send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"Query value too long\"}");
+            return;
+        }
+        if (status == 0) continue;
+        int code = i == 0 ? vocabulary_find(&departments, value)
+                 : i == 1 ? enum_code(statusNames, STATUS_COUNT, value)
+                 : enum_code(priorityNames, PRIORITY_COUNT, value);
+        FieldBitmap *bitmap = code < 0 ? NULL : field_bitmap(filter_indexes[i], code);
+        if (bitmap) bitmaps[bitmap_count++] = bitmap;
+        else unmatched = 1;
+    }
+    
+    uint32_t limit = DEFAULT_PAGE_LIMIT, cursor = 0;
+    Uuid after;
+    int has_limit = query_param(request, "limit", value, sizeof(value));
+    if (has_limit && (has_limit < 0 || !parse_count(value, &limit) || limit < 1 || limit > MAX_PAGE_LIMIT)) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"limit must be 1-1000\"}");
+        return;
+    }
+    // The cursor is the id of the last action on the previous page
+    int has_cursor = query_param(request, "cursor", value, sizeof(value));
+    if (has_cursor) {
+        int last = has_cursor < 0 || !parse_uuid(value, &after) ? -1 : index_lookup(&actionIndex, &after);
+        if (last < 0) {
+            send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"Invalid cursor\"}");
+            return;
+        }
+        cursor = (uint32_t)last + 1;
+    }
+    
+    uint32_t end = store_count(&actionStore);
+    if (!query_time_range(conn, request, NULL, &cursor, &end)) return;
+    
+    // One match past the page tells whether there is a next page and where it starts
+    uint32_t refs[MAX_PAGE_LIMIT + 1];
+    uint32_t found = unmatched ? 0 : bitmap_query(bitmaps, bitmap_count, cursor, end, refs, limit + 1);
+    Buffer body = {0};
+    buffer_append(&body, "[", 1);
+    for (uint32_t i = 0; i < found && i < limit; i++) {
+        append_fragment(&body, store_fragment(&actionStore, refs[i]), i > 0);
+    }
+    buffer_append(&body, "]", 1);
+    
+    // A page is an array like the unfiltered list; the next page's cursor travels in a header
+    char extra[128] = "";
+    if (found > limit) {
+        char id[37];
+        format_uuid(&get_action(refs[limit - 1])->id, id);
+        snprintf(extra, sizeof(extra), "X-Next-Cursor: %s\r\nAccess-Control-Expose-Headers: X-Next-Cursor\r\n", id);
+    }
+    send_http_body_extra(conn, "200 OK", "application/json", body.data, body.len, extra);
+    free(body.data);
+}
+
+// Full-text search: ?q= is split into terms like the indexed text, and a record matches when every
+// term is a prefix of one of its words. Each word a term matches adds log(1 + records / postings),
+// doubled in a title or name and halved for a prefix rather than the whole word. The best ?limit=
+// matches of both stores come back as ranked ids, newer records first among equal scores.
+typedef struct {
+    uint32_t ids[SEARCH_MAX_EXPANSIONS];
+    float weights[SEARCH_MAX_EXPANSIONS];  // per posting, before the title factor
+    uint32_t id_count;
+    uint64_t postings;
+} SearchToken;
+
+typedef struct {
+    SearchStore store;
+    uint32_t ref;
+    float score;
+} SearchResult;
+
+// Per-record accumulators, sized to the larger store and left zeroed after each query
+typedef struct {
+    float *scores;
+    uint8_t *hits;  // query terms matched so far
+    uint32_t *candidates;
+    uint32_t capacity;
+} SearchScratch;
+
+__thread SearchScratch searchScratch;
+
+void search_scratch_reserve(uint32_t records) {
+    SearchScratch *scratch = &searchScratch;
+    if (records <= scratch->capacity) return;
+    uint32_t capacity = scratch->capacity ? scratch->capacity : 1024;
+    while (capacity < records) capacity *= 2;
+    free(scratch->scores);
+    free(scratch->hits);
+    free(scratch->candidates);
+    scratch->scores = calloc(capacity, sizeof(float));
+    scratch->hits = calloc(capacity, sizeof(uint8_t));
+    scratch->candidates = malloc(capacity * sizeof(uint32_t));
+    if (!scratch->scores || !scratch->hits || !scratch->candidates) {
+        fprintf(stderr, "Out of memory allocating search scratch\n");
+        abort();
+    }
+    scratch->capacity = capacity;
+}
+
+// Position of the posting for ref in list, or -1
+int postings_find(const ActionList *list, uint32_t count, uint32_t ref) {
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (list->refs[mid] >> 1 < ref) low = mid + 1;
+        else high = mid;
+    }
+    return low < count && list->refs[low] >> 1 == ref ? (int)low : -1;
+}
+
+// Keep results sorted best first, at most limit of them
+void search_offer(SearchResult *results, uint32_t *found, uint32_t limit, SearchResult result) {
+    uint32_t i = *found;
+    if (i == limit) {
+        SearchResult *last = &results[limit - 1];
+        if (result.score < last->score || (result.score == last->score && result.ref <= last->ref)) return;
+        i--;
+    } else {
+        (*found)++;
+    }
+    while (i > 0 && (results[i - 1].score < result.score ||
+                     (results[i - 1].score == result.score && results[i - 1].ref < result.ref))) {
+        results[i] = results[i - 1];
+        i--;
+    }
+    results[i] = result;
+}
+
+// Match the query terms against one store (call inside a read section)
+void search_store(SearchStore store, char terms[][SEARCH_MAX_TERM], uint32_t term_count,
+                  SearchResult *results, uint32_t *found, uint32_t limit) {
+    uint32_t records = store_count(store == SEARCH_PATIENTS ? &patientStore : &actionStore);
+    if (records == 0) return;
+    SearchToken tokens[SEARCH_MAX_QUERY_TERMS];
+    for (uint32_t t = 0; t < term_count; t++) {
+        SearchToken *token = &tokens[t];
+        uint32_t len = strlen(terms[t]);
+        token->id_count = search_expand(terms[t], len, 1, token->ids, SEARCH_MAX_EXPANSIONS);
+        token->postings = 0;
+        for (uint32_t i = 0; i < token->id_count; i++) {
+            SearchTerm *term = search_term(token->ids[i]);
+            ActionList *list = __atomic_load_n(&term->postings[store], __ATOMIC_ACQUIRE);
+            uint32_t count = list ? __atomic_load_n(&list->count, __ATOMIC_ACQUIRE) : 0;
+            token->postings += count;
+            token->weights[i] = count ? logf(1.0f + (float)records / count) * (term->len == len ? 1.0f : 0.5f) : 0;
+        }
+        if (token->postings == 0) return;
+    }
+    // Rarest terms first: the first fixes the candidates and the rest only narrow them
+    for (uint32_t t = 1; t < term_count; t++) {
+        SearchToken token = tokens[t];
+        uint32_t u = t;
+        for (; u > 0 && tokens[u - 1].postings > token.postings; u--) tokens[u] = tokens[u - 1];
+        tokens[u] = token;
+    }
+    
+    search_scratch_reserve(records);
+    SearchScratch *scratch = &searchScratch;
+    uint32_t candidate_count = 0;
+    for (uint32_t t = 0; t < term_count; t++) {
+        SearchToken *token = &tokens[t];
+        // Probing each candidate's postings beats walking every posting once candidates are few
+        int probe = t > 0 && (uint64_t)candidate_count * token->id_count * 16 < token->postings;
+        for (uint32_t i = 0; i < token->id_count; i++) {
+            ActionList *list = __atomic_load_n(&search_term(token->ids[i])->postings[store], __ATOMIC_ACQUIRE);
+            if (!list) continue;
+            uint32_t count = __atomic_load_n(&list->count, __ATOMIC_ACQUIRE);
+            float weight = token->weights[i];
+            if (probe) {
+                for (uint32_t c = 0; c < candidate_count; c++) {
+                    uint32_t ref = scratch->candidates[c];
+                    if (scratch->hits[ref] < t) continue;
+                    int position = postings_find(list, count, ref);
+                    if (position < 0) continue;
+                    scratch->hits[ref] = t + 1;
+                    scratch->scores[ref] += weight * (list->refs[position] & 1 ? 2.0f : 1.0f);
+                }
+                continue;
+            }
+            for (uint32_t p = 0; p < count; p++) {
+                uint32_t posting = list->refs[p], ref = posting >> 1;
+                if (ref >= records) break;
+                if (scratch->hits[ref] < t) continue;
+                if (t == 0 && scratch->hits[ref] == 0) scratch->candidates[candidate_count++] = ref;
+                scratch->hits[ref] = t + 1;
+                scratch->scores[ref] += weight * (posting & 1 ? 2.0f : 1.0f);
+            }
+        }
+    }
+    
+    for (uint32_t c = 0; c < candidate_count; c++) {
+        uint32_t ref = scratch->candidates[c];
+        if (scratch->hits[ref] == term_count &&
+            !record_archived(store == SEARCH_PATIENTS ? &patientStore : &actionStore, ref)) {
+            search_offer(results, found, limit, (SearchResult){ store, ref, scratch->scores[ref] });
+        }
+        scratch->hits[ref] = 0;
+        scratch->scores[ref] = 0;
+    }
+}
+
+void handle_search_request(Connection *conn, HttpRequest *request) {
+    char query[MAX_QUERY_VALUE], value[MAX_QUERY_VALUE];
+    int has_query = query_param(request, "q", query, sizeof(query));
+    if (has_query < 0) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"Query value too long\"}");
+        return;
+    }
+    uint32_t limit = SEARCH_DEFAULT_LIMIT;
+    int has_limit = query_param(request, "limit", value, sizeof(value));
+    if (has_limit && (has_limit < 0 || !parse_count(value, &limit) || limit < 1 || limit > SEARCH_MAX_LIMIT)) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"limit must be 1-100\"}");
+        return;
+    }
+    
+    char terms[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM];
+    uint32_t term_count = 0;
+    const char *p = has_query ? query : "";
+    while (term_count < SEARCH_MAX_QUERY_TERMS && search_next_term(&p, terms[term_count]) > 0) term_count++;
+    if (term_count == 0) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"q must contain a word\"}");
+        return;
+    }
+    
+    SearchResult results[SEARCH_MAX_LIMIT];
+    uint32_t found = 0;
+    search_store(SEARCH_PATIENTS, terms, term_count, results, &found, limit);
+    search_store(SEARCH_ACTIONS, terms, term_count, results, &found, limit);
+    
+    Buffer body = {0};
+    buffer_append(&body, "{\"results\":[", 12);
+    for (uint32_t i = 0; i < found; i++) {
+        char id[37];
+        format_uuid(results[i].store == SEARCH_PATIENTS ? patient_id_of(results[i].ref) : action_id_of(results[i].ref), id);
+        buffer_printf(&body, "%s{\"type\":\"%s\",\"id\":\"%s\",\"score\":%.3f}", i > 0 ? "," : "",
+                      results[i].store == SEARCH_PATIENTS ? "patient" : "clinicalAction", id, results[i].score);
+    }
+    buffer_append(&body, "]}", 2);
+    send_http_body(conn, "200 OK", "application/json", body.data, body.len);
+    free(body.data);
+}
+
+int compare_changes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Delta sync: every record created or changed after change since, once each in its current form and
+// in store order, read from at most limit changes; seq is the change to resume from and more says
+// whether later changes remain. Records archived since are listed by id under archived, for the
+// client to drop. A cursor older than the change log, from another run, or absent gets resync
+// instead, telling the client to reload the lists (reading seq first).
+void handle_changes_request(Connection *conn, HttpRequest *request) {
+    char value[MAX_QUERY_VALUE];
+    uint64_t since = 0;
+    int has_since = query_param(request, "since", value, sizeof(value));
+    if (has_since < 0 || (has_since && !parse_sequence(value, &since))) {
+        send_http_response(conn, "400 Bad Request", "application/json",
+                           "{\"error\":\"since must be a change sequence number\"}");
+        return;
+    }
+    uint32_t limit = CHANGES_DEFAULT_LIMIT;
+    int has_limit = query_param(request, "limit", value, sizeof(value));
+    if (has_limit && (has_limit < 0 || !parse_count(value, &limit) || limit < 1 || limit > CHANGES_MAX_LIMIT)) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"limit must be 1-10000\"}");
+        return;
+    }
+    
+    uint64_t last = __atomic_load_n(&change_seq, __ATOMIC_ACQUIRE);
+    int resync = !has_since || since < change_base || since > last || last - since > CHANGE_LOG_SIZE;
+    uint64_t end = resync || last - since <= limit ? last : since + limit;
+    uint32_t change_count = resync ? 0 : (uint32_t)(end - since);
+    uint64_t *changes = malloc((change_count ? change_count : 1) * sizeof(uint64_t));
+    if (!changes) {
+        fprintf(stderr, "Out of memory reading changes\n");
+        abort();
+    }
+    // An entry overwritten by a newer change no longer carries its own sequence number
+    for (uint32_t i = 0; i < change_count && !resync; i++) {
+        uint64_t seq = since + 1 + i;
+        uint64_t entry = __atomic_load_n(&change_log[seq % CHANGE_LOG_SIZE], __ATOMIC_RELAXED);
+        resync = entry >> 33 != (seq & ((1ull << 31) - 1));
+        changes[i] = (entry & 1) << 32 | (uint32_t)(entry >> 1);
+    }
+    if (resync) {
+        char json[64];
+        snprintf(json, sizeof(json), "{\"seq\":%llu,\"resync\":true}", (unsigned long long)last);
+        free(changes);
+        send_json_response(conn, json);
+        return;
+    }
+    
+    // Sorting groups patients before actions, each in index order, and puts repeats side by side
+    qsort(changes, change_count, sizeof(uint64_t), compare_changes);
+    Buffer body = {0}, archived[2] = { {0}, {0} };
+    buffer_printf(&body, "{\"seq\":%llu,\"resync\":false,\"more\":%s,\"patients\":[",
+                  (unsigned long long)end, end < last ? "true" : "false");
+    int first = 1, actions = 0;
+    for (uint32_t i = 0; i < change_count; i++) {
+        if (i > 0 && changes[i] == changes[i - 1]) continue;
+        if ((changes[i] >> 32) && !actions) {
+            buffer_append(&body, "],\"clinicalActions\":[", 21);
+            actions = 1;
+            first = 1;
+        }
+        RecordStore *store = actions ? &actionStore : &patientStore;
+        uint32_t ref = (uint32_t)changes[i];
+        if (record_archived(store, ref)) {
+            char id[37];
+            format_uuid(actions ? &get_action(ref)->id : &get_patient(ref)->id, id);
+            buffer_printf(&archived[actions], "%s\"%s\"", archived[actions].len ? "," : "", id);
+            continue;
+        }
+        Fragment *fragment = store_fragment(store, ref);
+        if (!first) buffer_append(&body, ",", 1);
+        buffer_append(&body, fragment->data, fragment->len);
+        first = 0;
+    }
+    if (!actions) buffer_append(&body, "],\"clinicalActions\":[", 21);
+    buffer_append(&body, "],\"archived\":{\"patients\":[", 26);
+    buffer_append(&body, archived[0].data, archived[0].len);
+    buffer_append(&body, "],\"clinicalActions\":[", 21);
+    buffer_append(&body, archived[1].data, archived[1].len);
+    buffer_append(&body, "]}}", 3);
+    send_http_body(conn, "200 OK", "application/json", body.data, body.len);
+    free(changes);
+    free(body.data);
+    free(archived[0].data);
+    free(archived[1].data);
+}
+
+// Record counts and memory held by each store, and what the archive segments hold on disk
+void handle_storage_request(Connection *conn) {
+    char json[768];
+    size_t patient_bytes = store_memory(&patientStore) + column_memory(&patientTier);
+    size_t action_bytes = store_memory(&actionStore) + segmented_memory(&patientActions) +
+                          column_memory(&actionStatus) + column_memory(&actionPriority) +
+                          column_memory(&actionAssignee) + column_memory(&actionPatient) +
+                          column_memory(&actionUpdatedAt) + heap_memory(&actionText) +
+                          sizeof(departments) + segmented_memory(&departments.names) +
+                          sizeof(actionTypes) + segmented_memory(&actionTypes.names);
+    IndexTable *terms = __atomic_load_n(&searchIndex.table, __ATOMIC_ACQUIRE);
+    TermOrder *sorted = __atomic_load_n(&searchIndex.sorted, __ATOMIC_ACQUIRE);
+    size_t search_bytes = __atomic_load_n(&searchIndex.posting_bytes, __ATOMIC_RELAXED) +
+                          __atomic_load_n(&searchIndex.slab.chunk_count, __ATOMIC_RELAXED) * (sizeof(SlabChunk) + SLAB_CHUNK_SIZE) +
+                          heap_memory(&searchIndex.text) + segmented_memory(&searchIndex.terms) +
+                          (terms ? (terms->mask + 1) * sizeof(uint64_t) : 0) +
+                          (sorted ? sorted->count * sizeof(uint32_t) : 0);
+    uint64_t archived_patients, archived_actions, archive_bytes;
+    uint32_t segments = archive_totals(&archived_patients, &archived_actions, &archive_bytes);
+    sprintf(json,
+            "{\"patients\":{\"count\":%u,\"recordBytes\":%zu,\"memoryBytes\":%zu},"
+            "\"clinicalActions\":{\"count\":%u,\"recordBytes\":%zu,\"memoryBytes\":%zu},"
+            "\"searchIndex\":{\"terms\":%u,\"postings\":%llu,\"memoryBytes\":%zu},"
+            "\"archive\":{\"segments\":%u,\"patients\":%llu,\"clinicalActions\":%llu,\"fileBytes\":%llu},"
+            "\"totalMemoryBytes\":%zu}",
+            store_count(&patientStore), slab_stride(&patientStore.slab), patient_bytes,
+            store_count(&actionStore), slab_stride(&actionStore.slab), action_bytes,
+            __atomic_load_n(&searchIndex.count, __ATOMIC_ACQUIRE),
+            (unsigned long long)__atomic_load_n(&searchIndex.postings, __ATOMIC_RELAXED), search_bytes,
+            segments, (unsigned long long)archived_patients, (unsigned long long)archived_actions,
+            (unsigned long long)archive_bytes, patient_bytes + action_bytes + search_bytes);
+    send_json_response(conn, json);
+}
+
+// Dashboard counts: patients, actions by status, and each department's actions by status and
+// priority. The counters are read while they change, so an action whose status changes mid-read
+// may be missed or counted twice in that response.
+void handle_stats_request(Connection *conn) {
+    uint64_t patients = metric_read(&dashboardStats.patients);
+    uint64_t admitted = metric_read(&dashboardStats.admitted);
+    
+    Buffer by_department = {0};
+    int64_t totals[STATUS_COUNT] = {0};
+    uint32_t department_count = __atomic_load_n(&departments.count, __ATOMIC_ACQUIRE);
+    for (uint32_t d = 0; d < department_count; d++) {
+        const uint64_t *department_counts = stats_counts(d);
+        if (!department_counts) continue;
+        int64_t counts[STATUS_COUNT * PRIORITY_COUNT];
+        int any = 0;
+        for (int i = 0; i < STATUS_COUNT * PRIORITY_COUNT; i++) {
+            counts[i] = (int64_t)metric_read(&department_counts[i]);
+            any |= counts[i] != 0;
+        }
+        if (!any) continue;
+        
+        char name[6 * sizeof(((ClinicalAction *)0)->assignedTo) + 8];
+        char *end = json_member(name, by_department.len ? "," : "", vocabulary_name(&departments, d));
+        buffer_append(&by_department, name, end - name);
+        for (int status = 0; status < STATUS_COUNT; status++) {
+            const int64_t *row = &counts[status * PRIORITY_COUNT];
+            buffer_printf(&by_department, "%s\"%s\":[%lld,%lld,%lld]", status ? "," : ":{", statusNames[status],
+                          (long long)row[PRIORITY_HIGH], (long long)row[PRIORITY_MEDIUM], (long long)row[PRIORITY_LOW]);
+            totals[status] += row[PRIORITY_HIGH] + row[PRIORITY_MEDIUM] + row[PRIORITY_LOW];
+        }
+        buffer_append(&by_department, "}", 1);
+    }
+    
+    Buffer body = {0};
+    buffer_printf(&body, "{\"patients\":{\"total\":%llu,\"admitted\":%llu},"
+                         "\"clinicalActions\":{\"total\":%lld,\"pending\":%lld,\"in-progress\":%lld,\"completed\":%lld},"
+                         "\"priorities\":[\"high\",\"medium\",\"low\"],\"departments\":{",
+                  (unsigned long long)patients, (unsigned long long)admitted,
+                  (long long)(totals[STATUS_PENDING] + totals[STATUS_IN_PROGRESS] + totals[STATUS_COMPLETED]),
+                  (long long)totals[STATUS_PENDING], (long long)totals[STATUS_IN_PROGRESS],
+                  (long long)totals[STATUS_COMPLETED]);
+    if (by_department.len) buffer_append(&body, by_department.data, by_department.len);
+    buffer_append(&body, "}}", 2);
+    send_http_body(conn, "200 OK", "application/json", body.data, body.len);
+    free(by_department.data);
+    free(body.data);
+}
+
+// Prometheus text exposition of the workers' metrics summed, plus store and log gauges
+void handle_metrics_request(Connection *conn) {
+    WorkerMetrics total;
+    memset(&total, 0, sizeof(total));
+    uint64_t subscribers = 0;
+    for (int w = 0; w < worker_count; w++) {
+        WorkerMetrics *metrics = &workers[w].metrics;
+        for (int r = 0; r < ROUTE_COUNT; r++) {
+            total.routes[r].requests += metric_read(&metrics->routes[r].requests);
+            total.routes[r].latency_ns += metric_read(&metrics->routes[r].latency_ns);
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                total.routes[r].latency[b] += metric_read(&metrics->routes[r].latency[b]);
+            }
+        }
+        total.bytes_sent += metric_read(&metrics->bytes_sent);
+        total.connections += metric_read(&metrics->connections);
+        total.list_cache_hits += metric_read(&metrics->list_cache_hits);
+        total.list_cache_misses += metric_read(&metrics->list_cache_misses);
+        total.fragment_hits += metric_read(&metrics->fragment_hits);
+        total.fragment_renders += metric_read(&metrics->fragment_renders);
+        subscribers += (uint64_t)__atomic_load_n(&workers[w].subscribers, __ATOMIC_RELAXED);
+    }
+    
+    Buffer body = {0};
+    buffer_printf(&body, "# HELP workflow_http_requests_total Requests handled, by route.\n"
+                         "# TYPE workflow_http_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        buffer_printf(&body, "workflow_http_requests_total{route=\"%s\"} %llu\n", routeNames[r],
+                             (unsigned long long)total.routes[r].requests);
+    }
+    buffer_printf(&body, "# HELP workflow_http_request_duration_seconds Time spent in the request handler, by route.\n"
+                         "# TYPE workflow_http_request_duration_seconds histogram\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        RouteMetrics *route = &total.routes[r];
+        if (!route->requests) continue;
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+            cumulative += route->latency[b];
+            buffer_printf(&body, "workflow_http_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+                                 routeNames[r], latency_bucket_bound(b) / 1e6, (unsigned long long)cumulative);
+        }
+        buffer_printf(&body, "workflow_http_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n"
+                             "workflow_http_request_duration_seconds_sum{route=\"%s\"} %.9f\n"
+                             "workflow_http_request_duration_seconds_count{route=\"%s\"} %llu\n",
+                             routeNames[r], (unsigned long long)route->requests, routeNames[r], route->latency_ns / 1e9,
+                             routeNames[r], (unsigned long long)route->requests);
+    }
+    buffer_printf(&body, "# HELP workflow_http_response_bytes_total Bytes written to client sockets.\n"
+                         "# TYPE workflow_http_response_bytes_total counter\n"
+                         "workflow_http_response_bytes_total %llu\n", (unsigned long long)total.bytes_sent);
+    buffer_printf(&body, "# HELP workflow_open_connections Client connections currently open.\n"
+                         "# TYPE workflow_open_connections gauge\n"
+                         "workflow_open_connections %llu\n", (unsigned long long)total.connections);
+    buffer_printf(&body, "# HELP workflow_event_subscribers Connections subscribed to /api/events.\n"
+                         "# TYPE workflow_event_subscribers gauge\n"
+                         "workflow_event_subscribers %llu\n", (unsigned long long)subscribers);
+    
+    RecordStore *stores[] = { &patientStore, &actionStore };
+    const char *store_names[] = { "patients", "clinical_actions" };
+    buffer_printf(&body, "# HELP workflow_store_records Records held, by store.\n"
+                         "# TYPE workflow_store_records gauge\n");
+    for (int i = 0; i < 2; i++) {
+        buffer_printf(&body, "workflow_store_records{store=\"%s\"} %u\n", store_names[i], store_count(stores[i]));
+    }
+    buffer_printf(&body, "# HELP workflow_store_memory_bytes Memory held by records, slots and fragments, by store.\n"
+                         "# TYPE workflow_store_memory_bytes gauge\n");
+    for (int i = 0; i < 2; i++) {
+        buffer_printf(&body, "workflow_store_memory_bytes{store=\"%s\"} %zu\n", store_names[i],
+                             store_memory(stores[i]));
+    }
+    buffer_printf(&body, "# HELP workflow_fragment_bytes Bytes of cached record JSON, by store.\n"
+                         "# TYPE workflow_fragment_bytes gauge\n");
+    for (int i = 0; i < 2; i++) {
+        buffer_printf(&body, "workflow_fragment_bytes{store=\"%s\"} %zu\n", store_names[i],
+                             __atomic_load_n(&stores[i]->fragment_bytes, __ATOMIC_RELAXED));
+    }
+    
+    buffer_printf(&body, "# HELP workflow_list_cache_requests_total List requests, by whether a cached body was served.\n"
+                         "# TYPE workflow_list_cache_requests_total counter\n"
+                         "workflow_list_cache_requests_total{result=\"hit\"} %llu\n"
+                         "workflow_list_cache_requests_total{result=\"miss\"} %llu\n",
+                         (unsigned long long)total.list_cache_hits, (unsigned long long)total.list_cache_misses);
+    buffer_printf(&body, "# HELP workflow_fragment_cache_requests_total Record JSON lookups, by whether it was already rendered.\n"
+                         "# TYPE workflow_fragment_cache_requests_total counter\n"
+                         "workflow_fragment_cache_requests_total{result=\"hit\"} %llu\n"
+                         "workflow_fragment_cache_requests_total{result=\"render\"} %llu\n",
+                         (unsigned long long)total.fragment_hits, (unsigned long long)total.fragment_renders);
+    buffer_printf(&body, "# HELP workflow_wal_bytes Write-ahead log bytes, appended and flushed to disk.\n"
+                         "# TYPE workflow_wal_bytes counter\n"
+                         "workflow_wal_bytes{state=\"appended\"} %llu\n"
+                         "workflow_wal_bytes{state=\"durable\"} %llu\n",
+                         (unsigned long long)__atomic_load_n(&wal.appended_lsn, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&wal.durable_lsn, __ATOMIC_RELAXED));
+    buffer_printf(&body, "# HELP workflow_access_log_dropped_total Access log lines dropped because the ring was full.\n"
+                         "# TYPE workflow_access_log_dropped_total counter\n"
+                         "workflow_access_log_dropped_total %llu\n",
+                         (unsigned long long)__atomic_load_n(&accessLog.dropped, __ATOMIC_RELAXED));
+    
+    send_http_body(conn, "200 OK", "text/plain; version=0.0.4", body.data, body.len);
+    free(body.data);
+}
+
+// Keep the connection open as a text/event-stream of creates matching ?patientId= and ?department=;
+// an EventSource reconnecting with Last-Event-ID resumes where it left off while the ring still holds it
+void handle_events_request(Connection *conn, HttpRequest *request) {
+    Subscription *subscription = &conn->subscription;
+    if (query_param(request, "patientId", subscription->patientId, sizeof(subscription->patientId)) < 0 ||
+        query_param(request, "department", subscription->department, sizeof(subscription->department)) < 0) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"Unknown filter value\"}");
+        return;
+    }
+    
+    // Subscribe before reading change_seq so a publish racing with us still wakes this worker
+    Worker *worker = conn->worker;
+    Connection *head = &worker->event_head;
+    subscription->prev = head->subscription.prev;
+    subscription->next = head;
+    head->subscription.prev->subscription.next = conn;
+    head->subscription.prev = conn;
+    subscription->active = 1;
+    __atomic_add_fetch(&worker->subscribers, 1, __ATOMIC_SEQ_CST);
+    
+    uint64_t last = __atomic_load_n(&change_seq, __ATOMIC_SEQ_CST);
+    subscription->seq = last;
+    const StringView *last_id = request_header(request, "Last-Event-ID");
+    if (last_id && last_id->len > 0 && last_id->len < 21) {
+        char id[21];
+        memcpy(id, last_id->data, last_id->len);
+        id[last_id->len] = '\0';
+        uint64_t resume = strtoull(id, NULL, 10);
+        // An id from before a restart is older than this run's events and gets a resync; so does
+        // one ahead of them, which can only come from a run whose clock was ahead
+        subscription->seq = resume <= last ? resume : 0;
+    }
+    
+    const char *header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"
+        "retry: 3000\n\n";
+    buffer_append(&conn->out, header, strlen(header));
+    subscription_fill(conn);
+}
+
+// Reply 400 with a parser's reason for rejecting a body
+void send_invalid_body(Connection *conn, const char *error) {
+    char response[JSON_ERROR_SIZE + 16];
+    snprintf(response, sizeof(response), "{\"error\":\"%s\"}", error);
+    send_http_response(conn, "400 Bad Request", "application/json", response);
+}
+
+// Index of the patient with text id that a write may change: -1 if there is none, or -2 if it has
+// been archived or is being archived (call inside a write section)
+int writable_patient(const char *id) {
+    int ref = index_lookup_text(&patientIndex, id);
+    if (ref >= 0) return patient_tier(ref) == TIER_HOT ? ref : -2;
+    ArchivedPatient archived;
+    return archive_lookup_text(id, &archived) ? -2 : -1;
+}
+
+void send_patient_not_writable(Connection *conn, int ref) {
+    if (ref == -2) send_http_response(conn, "409 Conflict", "application/json", "{\"error\":\"Patient is archived\"}");
+    else send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"Patient not found\"}");
+}
+
+void handle_create_patient(Connection *conn, StringView body) {
+    Patient draft;
+    char error[JSON_ERROR_SIZE];
+    if (!parse_patient(body.data, body.len, &draft, error)) {
+        send_invalid_body(conn, error);
+        return;
+    }
+    
+    write_begin();
+    Patient *patient = slab_alloc(&patientStore.slab);
+    *patient = draft;
+    generate_uuid(&patient->id);
+    char id[37];
+    format_uuid(&patient->id, id);
+    
+    // Publish the fully written record to lock-free readers
+    uint32_t ref = store_append(&patientStore, patient);
+    index_patient(ref);
+    uint64_t lsn = wal_log(WAL_PATIENT, patient);
+    publish_event("patientCreated", id, "", &patientStore, ref);
+    write_end();
+    notify_subscribers();
+    
+    char response[200];
+    sprintf(response, "{\"message\":\"Patient created successfully\",\"id\":\"%s\"}", id);
+    send_json_response(conn, response);
+    connection_wait_durable(conn, lsn);
+}
+
+void handle_create_action(Connection *conn, StringView body) {
+    ClinicalAction draft;
+    char error[JSON_ERROR_SIZE];
+    if (!parse_action(body.data, body.len, &draft, error)) {
+        send_invalid_body(conn, error);
+        return;
+    }
+    
+    write_begin();
+    int patient_ref = writable_patient(draft.patientId);
+    if (patient_ref < 0) {
+        write_end();
+        send_patient_not_writable(conn, patient_ref);
+        return;
+    }
+    
+    stamp_action(&draft);
+    int ref = add_action(&draft, patient_ref, 1);
+    if (ref < 0) {
+        write_end();
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"Too many departments\"}");
+        return;
+    }
+    uint64_t lsn = wal_log(WAL_ACTION, &draft);
+    publish_event("clinicalActionCreated", draft.patientId, draft.assignedTo, &actionStore, ref);
+    write_end();
+    notify_subscribers();
+    
+    char id[37], response[200];
+    format_uuid(&draft.id, id);
+    sprintf(response, "{\"message\":\"Action created successfully\",\"id\":\"%s\"}", id);
+    send_json_response(conn, response);
+    connection_wait_durable(conn, lsn);
+}
+
+// Bulk NDJSON uploads
+// The body is never held whole: bulk_ingest takes whatever complete lines have
+// arrived, parses up to BULK_BATCH_LINES of them outside the write lock, then
+// applies them in one write section with a single index reservation and log
+// append. Lines applied before a connection drops stay applied.
+void handle_bulk_upload(Connection *conn, HttpRequest *request) {
+    BulkUpload *bulk = &conn->bulk;
+    memset(bulk, 0, sizeof(*bulk));
+    bulk->kind = request->bulk;
+    bulk->remaining = request->content_length;
+    bulk->drafts = malloc(BULK_BATCH_LINES * (bulk->kind == BULK_PATIENTS ? sizeof(Patient) : sizeof(ClinicalAction)));
+    if (!bulk->drafts) {
+        fprintf(stderr, "Out of memory allocating bulk batch\n");
+        abort();
+    }
+    // The body is not waited for, so answer the client's Expect here rather than in process_input
+    if (request->expect_continue && !request->continue_sent) {
+        buffer_append(&conn->out, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+}
+
+void bulk_fail(BulkUpload *bulk, uint32_t line, const char *error) {
+    if (bulk->failed++ >= MAX_BULK_ERRORS) return;
+    char entry[JSON_ERROR_SIZE + 48];
+    int len = snprintf(entry, sizeof(entry), "%s{\"line\":%u,\"error\":\"%s\"}", bulk->errors.len ? "," : "", line, error);
+    buffer_append(&bulk->errors, entry, len);
+}
+
+// Publish a batch of parsed drafts (lines[i] is draft i's line number)
+void bulk_apply(BulkUpload *bulk, const uint32_t *lines, uint32_t count) {
+    const void *records[BULK_BATCH_LINES];
+    uint32_t refs[BULK_BATCH_LINES];
+    uint32_t created = 0;
+    
+    write_begin();
+    if (bulk->kind == BULK_PATIENTS) {
+        Patient *drafts = bulk->drafts;
+        index_reserve(&patientIndex, count);
+        for (uint32_t i = 0; i < count; i++) {
+            Patient *patient = slab_alloc(&patientStore.slab);
+            *patient = drafts[i];
+            generate_uuid(&patient->id);
+            refs[created] = store_append(&patientStore, patient);
+            index_patient(refs[created]);
+            records[created++] = patient;
+        }
+        uint64_t lsn = wal_log_batch(WAL_PATIENT, records, created);
+        if (lsn) bulk->lsn = lsn;
+        for (uint32_t i = 0; i < created; i++) {
+            char id[37];
+            format_uuid(&((const Patient *)records[i])->id, id);
+            publish_event("patientCreated", id, "", &patientStore, refs[i]);
+        }
+    } else {
+        ClinicalAction *drafts = bulk->drafts;
+        index_reserve(&actionIndex, count);
+        for (uint32_t i = 0; i < count; i++) {
+            ClinicalAction *action = &drafts[i];
+            int patient_ref = writable_patient(action->patientId);
+            if (patient_ref < 0) {
+                bulk_fail(bulk, lines[i], patient_ref == -2 ? "Patient is archived" : "Patient not found");
+                continue;
+            }
+            stamp_action(action);
+            int ref = add_action(action, patient_ref, 1);
+            if (ref < 0) {
+                bulk_fail(bulk, lines[i], "Too many departments");
+                continue;
+            }
+            refs[created] = ref;
+            records[created++] = action;
+        }
+        uint64_t lsn = wal_log_batch(WAL_ACTION, records, created);
+        if (lsn) bulk->lsn = lsn;
+        for (uint32_t i = 0; i < created; i++) {
+            const ClinicalAction *action = records[i];
+            publish_event("clinicalActionCreated", action->patientId, action->assignedTo, &actionStore, refs[i]);
+        }
+    }
+    write_end();
+    notify_subscribers();
+    bulk->created += created;
+}
+
+// Answer with counts and the first failures, held until every applied line is durable
+void bulk_finish(Connection *conn) {
+    BulkUpload *bulk = &conn->bulk;
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "{\"received\":%u,\"created\":%u,\"failed\":%u,\"errors\":[",
+                            bulk->received, bulk->created, bulk->failed);
+    send_http_header(conn, "200 OK", "application/json", head_len + bulk->errors.len + 2);
+    buffer_append(&conn->out, head, head_len);
+    if (bulk->errors.len) buffer_append(&conn->out, bulk->errors.data, bulk->errors.len);
+    buffer_append(&conn->out, "]}", 2);
+    connection_wait_durable(conn, bulk->lsn);
+    
+    free(bulk->errors.data);
+    free(bulk->drafts);
+    memset(bulk, 0, sizeof(*bulk));
+}
+
+// Apply every complete line of the upload in the input buffer; returns bytes consumed. The
+// upload is over (kind back to BULK_NONE) once its whole body has been consumed.
+size_t bulk_ingest(Connection *conn) {
+    BulkUpload *bulk = &conn->bulk;
+    size_t total = 0;
+    for (;;) {
+        char *start = conn->in.data + conn->in_start;
+        size_t available = conn->in.len - conn->in_start;
+        if (available > bulk->remaining) available = bulk->remaining;
+        int complete = available == bulk->remaining;  // the last line needs no newline
+        char *p = start, *end = start + available;
+        uint32_t lines[BULK_BATCH_LINES];
+        uint32_t count = 0;
+        
+        while (count < BULK_BATCH_LINES && p < end) {
+            char *eol = memchr(p, '\n', end - p);
+            char *line_end = eol ? eol : end;
+            // Wait for the rest of a line unless it is already too long to keep
+            if (!eol && !complete && !bulk->skipping && end - p <= MAX_BULK_LINE) break;
+            
+            if (bulk->skipping) {
+                if (eol) bulk->skipping = 0;
+            } else {
+                size_t len = line_end - p;
+                while (len > 0 && isspace((unsigned char)p[len - 1])) len--;
+                bulk->line++;
+                if (len > MAX_BULK_LINE) {
+                    bulk->received++;
+                    bulk_fail(bulk, bulk->line, "Line too long");
+                    bulk->skipping = !eol;
+                } else if (len > 0) {
+                    char error[JSON_ERROR_SIZE];
+                    bulk->received++;
+                    int valid = bulk->kind == BULK_PATIENTS
+                        ? parse_patient(p, len, (Patient *)bulk->drafts + count, error)
+                        : parse_action(p, len, (ClinicalAction *)bulk->drafts + count, error);
+                    if (valid) {
+                        lines[count++] = bulk->line;
+                    } else {
+                        bulk_fail(bulk, bulk->line, error);
+                    }
+                }
+            }
+            p = eol ? eol + 1 : end;
+        }
+        
+        size_t consumed = p - start;
+        conn->in_start += consumed;
+        bulk->remaining -= consumed;
+        total += consumed;
+        if (count) bulk_apply(bulk, lines, count);
+        if (bulk->remaining == 0) {
+            bulk_finish(conn);
+            return total;
+        }
+        if (consumed == 0) return total;
+    }
+}
+
+// Apply a status change and queue its log entry and event; returns the LSN the response waits for
+// and the new fragment through *fragment (caller holds write_lock)
+uint64_t change_action_status(uint32_t ref, ActionStatus status, Fragment **fragment) {
+    ClinicalAction update;
+    update.id = get_action(ref)->id;
+    strcpy(update.status, statusNames[status]);
+    update.updatedAt = current_timestamp();
+    update_action_status(ref, status, update.updatedAt);
+    uint64_t lsn = wal_log(WAL_ACTION_STATUS, &update);
+    *fragment = store_fragment(&actionStore, ref);
+    
+    char patientId[37];
+    format_uuid(&get_patient(action_patient(ref))->id, patientId);
+    publish_event("actionUpdated", patientId, vocabulary_name(&departments, action_assignee(ref)), &actionStore, ref);
+    return lsn;
 }
 
-void handle_patient_actions_request(int client_socket, const char *patientId) {
-    char json[10000];
-    patient_actions_to_json(patientId, json);
-    send_json_response(client_socket, json);
+void send_fragment_response(Connection *conn, Fragment *fragment, uint64_t lsn) {
+    send_http_header(conn, "200 OK", "application/json", fragment->len);
+    buffer_append(&conn->out, fragment->data, fragment->len);
+    connection_wait_durable(conn, lsn);
 }
 
-void handle_actions_request(int client_socket) {
-    char json[20000];
-    actions_to_json(json);
-    send_json_response(client_socket, json);
+void handle_update_action_status(Connection *conn, const char *id, StringView body) {
+    ClinicalAction update = {0};
+    char error[JSON_ERROR_SIZE];
+    if (!json_parse_record(body.data, body.len, &update, statusFields, 1, error)) {
+        send_invalid_body(conn, error);
+        return;
+    }
+    int status = enum_code(statusNames, STATUS_COUNT, update.status);
+    if (status < 0) {
+        send_http_response(conn, "400 Bad Request", "application/json",
+                           "{\"error\":\"status must be pending, in-progress or completed\"}");
+        return;
+    }
+    
+    write_begin();
+    int ref = index_lookup_text(&actionIndex, id);
+    if (ref < 0) {
+        write_end();
+        send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"Clinical action not found\"}");
+        return;
+    }
+    if (action_archived(ref)) {
+        write_end();
+        send_http_response(conn, "409 Conflict", "application/json", "{\"error\":\"Patient is archived\"}");
+        return;
+    }
+    Fragment *fragment;
+    uint64_t lsn = change_action_status(ref, status, &fragment);
+    write_end();
+    notify_subscribers();
+    send_fragment_response(conn, fragment, lsn);
 }
 
-void handle_create_patient(int client_socket, const char *body) {
-    if (patientCount >= MAX_PATIENTS) {
-        send_http_response(client_socket, "400 Bad Request", "application/json", "{\"error\":\"Maximum patients reached\"}");
+// Move a patient to a new status (such as "discharged", which makes it a candidate for archiving)
+void handle_update_patient_status(Connection *conn, const char *id, StringView body) {
+    Patient update = {0};
+    char error[JSON_ERROR_SIZE];
+    if (!json_parse_record(body.data, body.len, &update, patientStatusFields, 1, error)) {
+        send_invalid_body(conn, error);
+        return;
+    }
+    if (!update.status[0]) {
+        send_http_response(conn, "400 Bad Request", "application/json", "{\"error\":\"status must not be empty\"}");
         return;
     }
     
-    // Parse JSON body (simplified parsing)
-    char name[100] = {0}, gender[10] = {0}, condition[100] = {0};
-    int age = 0;
-    
-    // Simple JSON parsing (in production, use a proper JSON library)
-    sscanf(body, "{\"name\":\"%99[^\"]\",\"age\":%d,\"gender\":\"%9[^\"]\",\"condition\":\"%99[^\"]}", 
-           name, &age, gender, condition);
-    
-    strcpy(patients[patientCount].name, name);
-    patients[patientCount].age = age;
-    strcpy(patients[patientCount].gender, gender);
-    strcpy(patients[patientCount].condition, condition);
-    strcpy(patients[patientCount].bloodGroup, "O+");
-    strcpy(patients[patientCount].status, "admitted");
-    strcpy(patients[patientCount].admissionDate, "2024-01-17");
-    generate_uuid(patients[patientCount].id);
-    
-    patientCount++;
-    
-    char response[200];
-    sprintf(response, "{\"message\":\"Patient created successfully\",\"id\":\"%s\"}", patients[patientCount-1].id);
-    send_json_response(client_socket, response);
+    write_begin();
+    int ref = writable_patient(id);
+    if (ref < 0) {
+        write_end();
+        send_patient_not_writable(conn, ref);
+        return;
+    }
+    uint64_t lsn = 0;
+    if (strcmp(get_patient(ref)->status, update.status) != 0) {
+        update_patient_status(ref, update.status);
+        lsn = wal_log(WAL_PATIENT_STATUS, get_patient(ref));
+        char patientId[37];
+        format_uuid(&get_patient(ref)->id, patientId);
+        publish_event("patientUpdated", patientId, "", &patientStore, ref);
+    }
+    Fragment *fragment = store_fragment(&patientStore, ref);
+    write_end();
+    notify_subscribers();
+    send_fragment_response(conn, fragment, lsn);
 }
 
-void handle_create_action(int client_socket, const char *body) {
-    if (actionCount >= MAX_ACTIONS) {
-        send_http_response(client_socket, "400 Bad Request", "application/json", "{\"error\":\"Maximum actions reached\"}");
+// The department's most urgent pending action. POST claims it by moving it to in-progress, popping
+// the queue and changing the status in one write section so two workstations never claim the same
+// action; GET only shows it, so prefetchers and retried requests take no work.
+void handle_department_next(Connection *conn, const char *department, int claim) {
+    Fragment *fragment;
+    if (!claim) {
+        // A peek reads the published top inside the request's read section, without write_lock
+        int code = vocabulary_find(&departments, department);
+        DepartmentQueue *queue = code < 0 ? NULL : department_queue(code, 0);
+        uint32_t top = queue ? __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE) : 0;
+        if (!top) {
+            send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"No pending actions\"}");
+            return;
+        }
+        fragment = store_fragment(&actionStore, top - 1);
+        send_fragment_response(conn, fragment, 0);
         return;
     }
     
-    // Parse JSON body (simplified)
-    char patientId[37] = {0}, type[20] = {0}, title[100] = {0};
-    char description[500] = {0}, assignedTo[20] = {0};
-    
-    sscanf(body, "{\"patientId\":\"%36[^\"]\",\"type\":\"%19[^\"]\",\"title\":\"%99[^\"]\","
-           "\"description\":\"%499[^\"]\",\"assignedTo\":\"%19[^\"]}", 
-           patientId, type, title, description, assignedTo);
-    
-    strcpy(clinicalActions[actionCount].patientId, patientId);
-    strcpy(clinicalActions[actionCount].type, type);
-    strcpy(clinicalActions[actionCount].title, title);
-    strcpy(clinicalActions[actionCount].description, description);
-    strcpy(clinicalActions[actionCount].assignedTo, assignedTo);
-    strcpy(clinicalActions[actionCount].initiatedBy, "Dr. Smith");
-    strcpy(clinicalActions[actionCount].initiatedByDepartment, "Doctor");
-    strcpy(clinicalActions[actionCount].status, "pending");
-    strcpy(clinicalActions[actionCount].priority, "medium");
-    generate_uuid(clinicalActions[actionCount].id);
-    get_current_timestamp(clinicalActions[actionCount].createdAt);
-    strcpy(clinicalActions[actionCount].updatedAt, clinicalActions[actionCount].createdAt);
-    
-    actionCount++;
-    
-    char response[200];
-    sprintf(response, "{\"message\":\"Action created successfully\",\"id\":\"%s\"}", clinicalActions[actionCount-1].id);
-    send_json_response(client_socket, response);
+    write_begin();
+    int code = vocabulary_find(&departments, department);
+    DepartmentQueue *queue = code < 0 ? NULL : department_queue(code, 0);
+    if (!queue || queue->size == 0) {
+        write_end();
+        send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"No pending actions\"}");
+        return;
+    }
+    uint64_t lsn = change_action_status(queue->heap[0].ref, STATUS_IN_PROGRESS, &fragment);
+    write_end();
+    notify_subscribers();
+    send_fragment_response(conn, fragment, lsn);
+}
+
+// True if path ends with suffix, which is then cut off
+int strip_suffix(char *path, const char *suffix) {
+    size_t len = strlen(path), suffix_len = strlen(suffix);
+    if (len <= suffix_len || strcmp(path + len - suffix_len, suffix) != 0) return 0;
+    path[len - suffix_len] = '\0';
+    return 1;
 }
 
 // Main request handler
-void handle_request(int client_socket, const char *method, const char *path, const char *body) {
-    printf("Request: %s %s\n", method, path);
-    
-    if (strcmp(path, "/") == 0) {
-        const char *html = get_html_template();
-        char response[BUFFER_SIZE];
-        sprintf(response, 
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: text/html\r\n"
-                "Access-Control-Allow-Origin: *\r\n"
-                "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
-                "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
-                "Content-Length: %zu\r\n"
-                "Connection: close\r\n"
-                "\r\n%s",
-                strlen(html), html);
-        send(client_socket, response, strlen(response), 0);
+void handle_request(Connection *conn, HttpRequest *request) {
+    const char *method = request->method.data;
+    const char *path = request->path.data;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Handlers may cut a suffix off path, so the log line is captured first
+    char request_line[ACCESS_LOG_LINE];
+    snprintf(request_line, sizeof(request_line), "%s %s", method, path);
+    Route route = ROUTE_NOT_FOUND;
+    conn->status = 200;
+    conn->encoding = request_encoding(request);
+    
+    read_begin();
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        route = ROUTE_PREFLIGHT;
+        send_preflight_response(conn);
+    }
+    else if (strcmp(path, "/") == 0) {
+        route = ROUTE_INDEX;
+        if (strcmp(method, "GET") == 0) {
+            send_static_response(conn, request, &indexPage);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
     }
     else if (strcmp(path, "/api/patients") == 0) {
+        route = ROUTE_PATIENTS;
         if (strcmp(method, "GET") == 0) {
-            handle_patients_request(client_socket);
+            handle_patients_request(conn);
         }
         else if (strcmp(method, "POST") == 0) {
-            handle_create_patient(client_socket, body);
+            handle_create_patient(conn, request->body);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, POST, OPTIONS");
         }
     }
     else if (strcmp(path, "/api/clinical-actions") == 0) {
+        route = request->query.len ? ROUTE_ACTION_QUERY : ROUTE_ACTIONS;
         if (strcmp(method, "GET") == 0) {
-            handle_actions_request(client_socket);
+            if (request->query.len) handle_action_query(conn, request);
+            else handle_actions_request(conn);
         }
         else if (strcmp(method, "POST") == 0) {
-            handle_create_action(client_socket, body);
+            handle_create_action(conn, request->body);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, POST, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/api/storage") == 0) {
+        route = ROUTE_STORAGE;
+        if (strcmp(method, "GET") == 0) {
+            handle_storage_request(conn);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/metrics") == 0) {
+        route = ROUTE_METRICS;
+        if (strcmp(method, "GET") == 0) {
+            handle_metrics_request(conn);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/api/search") == 0) {
+        route = ROUTE_SEARCH;
+        if (strcmp(method, "GET") == 0) {
+            handle_search_request(conn, request);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/api/stats") == 0) {
+        route = ROUTE_STATS;
+        if (strcmp(method, "GET") == 0) {
+            handle_stats_request(conn);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/api/changes") == 0) {
+        route = ROUTE_CHANGES;
+        if (strcmp(method, "GET") == 0) {
+            handle_changes_request(conn, request);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (strcmp(path, "/api/events") == 0) {
+        route = ROUTE_EVENTS;
+        if (strcmp(method, "GET") == 0) {
+            handle_events_request(conn, request);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
         }
     }
     else if (strncmp(path, "/api/clinical-actions/patient/", 30) == 0) {
+        route = ROUTE_PATIENT_ACTIONS;
         char *patientId = (char*)path + 30;
-        handle_patient_actions_request(client_socket, patientId);
+        if (strcmp(method, "GET") == 0) {
+            handle_patient_actions_request(conn, request, patientId);
+        }
+        else {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+    }
+    else if (request->bulk) {
+        route = ROUTE_BULK;
+        handle_bulk_upload(conn, request);
+    }
+    else if (strncmp(path, "/api/clinical-actions/", 22) == 0) {
+        char *id = (char*)path + 22;
+        route = strip_suffix(id, "/status") ? ROUTE_ACTION_STATUS : ROUTE_ACTION;
+        if (route == ROUTE_ACTION && strcmp(method, "GET") == 0) {
+            handle_action_request(conn, id);
+        }
+        else if (route == ROUTE_ACTION) {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+        else if (strcmp(method, "PUT") == 0) {
+            handle_update_action_status(conn, id, request->body);
+        }
+        else {
+            send_method_not_allowed(conn, "PUT, OPTIONS");
+        }
+    }
+    else if (strncmp(path, "/api/departments/", 17) == 0 && strip_suffix((char*)path + 17, "/next")) {
+        route = ROUTE_DEPARTMENT_NEXT;
+        char department[MAX_QUERY_VALUE];
+        if (url_decode(path + 17, path + strlen(path), department, sizeof(department), 0) < 0) {
+            send_http_response(conn, "404 Not Found", "application/json", "{\"error\":\"No pending actions\"}");
+        }
+        else if (strcmp(method, "GET") == 0 || strcmp(method, "POST") == 0) {
+            handle_department_next(conn, department, method[0] == 'P');
+        }
+        else {
+            send_method_not_allowed(conn, "GET, POST, OPTIONS");
+        }
+    }
+    else if (strncmp(path, "/api/patients/", 14) == 0) {
+        char *id = (char*)path + 14;
+        route = strip_suffix(id, "/status") ? ROUTE_PATIENT_STATUS : ROUTE_PATIENT;
+        if (route == ROUTE_PATIENT && strcmp(method, "GET") == 0) {
+            handle_patient_request(conn, id);
+        }
+        else if (route == ROUTE_PATIENT) {
+            send_method_not_allowed(conn, "GET, OPTIONS");
+        }
+        else if (strcmp(method, "PUT") == 0) {
+            handle_update_patient_status(conn, id, request->body);
+        }
+        else {
+            send_method_not_allowed(conn, "PUT, OPTIONS");
+        }
     }
     else {
-        send_http_response(client_socket, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");
+        send_http_response(conn, "404 Not Found", "text/html", "<h1>404 Not Found</h1>");
+    }
+    
+    read_end();
+    
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + end.tv_nsec - start.tv_nsec;
+    RouteMetrics *metrics = &conn->worker->metrics.routes[route];
+    metric_add(&metrics->requests, 1);
+    metric_add(&metrics->latency_ns, elapsed);
+    metric_add(&metrics->latency[latency_bucket(elapsed / 1000)], 1);
+    access_log(request_line, conn->status, elapsed / 1000);
+}
+
+// Connection management
+void idle_list_unlink(Connection *conn) {
+    conn->prev->next = conn->next;
+    conn->next->prev = conn->prev;
+}
+
+// Keep connections ordered by last activity so the idle sweep only looks at the head
+void touch_connection(Connection *conn) {
+    Connection *head = &conn->worker->idle_head;
+    conn->last_active = time(NULL);
+    idle_list_unlink(conn);
+    conn->prev = head->prev;
+    conn->next = head;
+    head->prev->next = conn;
+    head->prev = conn;
+}
+
+// Release a connection's socket and buffers. The struct itself waits on the worker's closed list
+// until the event batch is done, since events for it may still be queued later in the batch.
+void close_connection(Connection *conn) {
+    if (conn->closed) return;
+    conn->closed = 1;
+    idle_list_unlink(conn);
+    if (conn->wait_lsn) connection_wait_unlink(conn);
+    if (conn->subscription.active) {
+        conn->subscription.prev->subscription.next = conn->subscription.next;
+        conn->subscription.next->subscription.prev = conn->subscription.prev;
+        __atomic_sub_fetch(&conn->worker->subscribers, 1, __ATOMIC_SEQ_CST);
+    }
+    epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    for (int i = conn->splice_head; i < conn->splice_count; i++) {
+        if (conn->splices[i].owner) shared_bytes_release(conn->splices[i].owner);
+    }
+    free(conn->bulk.errors.data);
+    free(conn->bulk.drafts);
+    free(conn->in.data);
+    free(conn->out.data);
+    metric_add(&conn->worker->metrics.connections, (uint64_t)-1);
+    conn->next = conn->worker->closed;
+    conn->worker->closed = conn;
+}
+
+void free_closed_connections(Worker *worker) {
+    while (worker->closed) {
+        Connection *conn = worker->closed;
+        worker->closed = conn->next;
+        free(conn);
+    }
+}
+
+void close_idle_connections(Worker *worker) {
+    Connection *head = &worker->idle_head;
+    time_t now = time(NULL);
+    while (head->next != head && now - head->next->last_active >= idle_timeout) {
+        close_connection(head->next);
+    }
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Plain chunk being compressed by this worker
+__thread Buffer stream_scratch;
+
+// Serialize the next chunk of the active list response into the output buffer
+void stream_fill(Connection *conn) {
+    JsonStream *stream = &conn->stream;
+    Buffer *out = &conn->out;
+    
+    // Reserve a fixed-width chunk-size line and backfill it once the chunk length is known
+    size_t header_at = out->len;
+    if (stream->chunked) buffer_append(out, "000000\r\n", 8);
+    size_t body_at = out->len;
+    
+    read_begin();
+    switch (stream->kind) {
+        case STREAM_PATIENTS: patients_to_json(out, stream, body_at + STREAM_CHUNK_SIZE); break;
+        case STREAM_ACTIONS: actions_to_json(out, stream, body_at + STREAM_CHUNK_SIZE); break;
+        case STREAM_PATIENT_ACTIONS: patient_actions_to_json(out, stream, body_at + STREAM_CHUNK_SIZE); break;
+        case STREAM_NONE: break;
+    }
+    read_end();
+    
+    // Move the plain chunk aside and deflate it back in place, flushed so the client can decode it
+    // without waiting for the next one
+    if (stream->encoding != ENCODING_IDENTITY) {
+        size_t plain_len = out->len - body_at;
+        stream_scratch.len = 0;
+        buffer_append(&stream_scratch, out->data + body_at, plain_len);
+        out->len = body_at;
+        if (stream->plain_len == 0) encoding_header(out, stream->encoding);
+        if (stream->encoding == ENCODING_GZIP) stream->crc32 = crc32_update(stream->crc32, stream_scratch.data, plain_len);
+        else stream->adler32 = adler32_update(stream->adler32, stream_scratch.data, plain_len);
+        stream->plain_len += plain_len;
+        deflate_compress(out, stream_scratch.data, plain_len, stream->kind == STREAM_NONE, DEFLATE_CHAIN_REQUEST);
+        if (stream->kind == STREAM_NONE) {
+            encoding_trailer(out, stream->encoding, stream->crc32, stream->adler32, stream->plain_len);
+        }
+    }
+    
+    if (stream->chunked) {
+        char size_line[16];
+        snprintf(size_line, sizeof(size_line), "%06zx", out->len - body_at);
+        memcpy(out->data + header_at, size_line, 6);
+        buffer_append(out, "\r\n", 2);
+        if (stream->kind == STREAM_NONE) buffer_append(out, "0\r\n\r\n", 5);
+    }
+}
+
+void send_parse_error(Connection *conn, HttpRequest *request) {
+    char body[160];
+    snprintf(body, sizeof(body), "{\"error\":\"%s\"}", request->error_message);
+    conn->keep_alive = 0;
+    send_http_response(conn, request->error_status, "application/json", body);
+    conn->close_after_write = 1;
+}
+
+// Forget the parsed views (the buffer moved) so the next parse re-derives them
+void request_reset(HttpRequest *request) {
+    int continue_sent = request->continue_sent;
+    memset(request, 0, sizeof(*request));
+    request->continue_sent = continue_sent;
+}
+
+// Parse and dispatch every complete request sitting in the input buffer; returns bytes consumed
+size_t process_input(Connection *conn) {
+    size_t consumed = 0;
+    for (;;) {
+        // An event stream answers nothing further on its connection; discard whatever else arrives
+        if (conn->subscription.active) {
+            consumed += conn->in.len - conn->in_start;
+            conn->in_start = conn->in.len;
+            break;
+        }
+        // Finish streaming the current response before answering pipelined requests behind it
+        if (conn->stream.kind != STREAM_NONE) {
+            if (conn->out.len - conn->out_sent >= STREAM_CHUNK_SIZE) break;
+            stream_fill(conn);
+            if (conn->stream.kind != STREAM_NONE) break;
+        }
+        // Apply whatever has arrived of an upload's body; the request behind it waits for the summary
+        if (conn->bulk.kind != BULK_NONE) {
+            consumed += bulk_ingest(conn);
+            if (conn->bulk.kind != BULK_NONE) break;
+            if (!conn->keep_alive) conn->close_after_write = 1;
+        }
+        if (conn->close_after_write || conn->out.len - conn->out_sent >= OUTPUT_HIGH_WATER) break;
+        
+        HttpRequest *request = &conn->request;
+        size_t len = conn->in.len - conn->in_start;
+        if (len == 0) break;
+        
+        ParseStatus status = http_parse_request(request, conn->in.data + conn->in_start, len);
+        if (status != PARSE_ERROR && request->header_len && conn->in.cap < conn->in_start + request->total_len + 1) {
+            // Size the buffer for the whole request once; the views must then be re-derived
+            buffer_reserve(&conn->in, conn->in_start + request->total_len + 1 - conn->in.len);
+            request_reset(request);
+            status = http_parse_request(request, conn->in.data + conn->in_start, len);
+        }
+        if (status == PARSE_ERROR) {
+            send_parse_error(conn, request);
+            break;
+        }
+        if (status == PARSE_INCOMPLETE) {
+            if (request->header_len && request->expect_continue && !request->continue_sent) {
+                buffer_append(&conn->out, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+                request->continue_sent = 1;
+            }
+            break;
+        }
+        
+        conn->http11 = request->http11;
+        conn->keep_alive = request->keep_alive;
+        
+        // Terminate the method, path and body in place for the handlers (the separators after the
+        // method and path are spent); restore the next pipelined request's first byte afterwards
+        char *data = conn->in.data + conn->in_start;
+        ((char *)request->method.data)[request->method.len] = '\0';
+        ((char *)request->path.data)[request->path.len] = '\0';
+        char saved = data[request->total_len];
+        data[request->total_len] = '\0';
+        handle_request(conn, request);
+        data[request->total_len] = saved;
+        
+        if (!conn->keep_alive && !conn->subscription.active && conn->bulk.kind == BULK_NONE) {
+            conn->close_after_write = 1;
+        }
+        
+        conn->in_start += request->total_len;
+        consumed += request->total_len;
+        memset(request, 0, sizeof(*request));
+    }
+    
+    // Compact once per batch of pipelined requests rather than once per request
+    if (conn->in_start == conn->in.len) {
+        conn->in.len = conn->in_start = 0;
+        if (conn->in.cap > 4 * BUFFER_SIZE && conn->bulk.kind == BULK_NONE) {
+            free(conn->in.data);
+            conn->in.data = NULL;
+            conn->in.cap = 0;
+        }
+    } else if (conn->in_start > 0) {
+        memmove(conn->in.data, conn->in.data + conn->in_start, conn->in.len - conn->in_start);
+        conn->in.len -= conn->in_start;
+        conn->in_start = 0;
+        request_reset(&conn->request);
+    }
+    return consumed;
+}
+
+// Account for n bytes written, walking buffered bytes and splices in send order
+void output_advance(Connection *conn, size_t n) {
+    while (n > 0) {
+        Splice *splice = conn->splice_head < conn->splice_count ? &conn->splices[conn->splice_head] : NULL;
+        if (splice && conn->out_sent == splice->offset) {
+            size_t step = splice->len - conn->splice_sent;
+            if (step > n) step = n;
+            conn->splice_sent += step;
+            n -= step;
+            if (conn->splice_sent == splice->len) {
+                if (splice->owner) shared_bytes_release(splice->owner);
+                conn->splice_head++;
+                conn->splice_sent = 0;
+            }
+        } else {
+            size_t step = (splice ? splice->offset : conn->out.len) - conn->out_sent;
+            if (step > n) step = n;
+            conn->out_sent += step;
+            n -= step;
+        }
+    }
+}
+
+// Returns -1 on a fatal socket error, 0 otherwise
+int flush_output(Connection *conn) {
+    // Responses to writes (and everything queued behind them) go out only once the log has them
+    if (conn->wait_lsn) {
+        if (conn->wait_lsn > __atomic_load_n(&wal.durable_lsn, __ATOMIC_SEQ_CST)) return 0;
+        connection_wait_unlink(conn);
+    }
+    while (output_pending(conn)) {
+        // Gather buffered bytes and spliced responses into one writev-style send
+        struct iovec iov[2 * MAX_SPLICES + 1];
+        int iovcnt = 0;
+        size_t pos = conn->out_sent;
+        for (int i = conn->splice_head; i < conn->splice_count; i++) {
+            Splice *splice = &conn->splices[i];
+            if (splice->offset > pos) {
+                iov[iovcnt++] = (struct iovec){ conn->out.data + pos, splice->offset - pos };
+                pos = splice->offset;
+            }
+            size_t skip = i == conn->splice_head ? conn->splice_sent : 0;
+            iov[iovcnt++] = (struct iovec){ (void *)(splice->data + skip), splice->len - skip };
+        }
+        if (conn->out.len > pos) iov[iovcnt++] = (struct iovec){ conn->out.data + pos, conn->out.len - pos };
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        output_advance(conn, n);
+        metric_add(&conn->worker->metrics.bytes_sent, n);
+        touch_connection(conn);
+    }
+    conn->out.len = conn->out_sent = 0;
+    conn->splice_head = conn->splice_count = 0;
+    conn->splice_sent = 0;
+    return 0;
+}
+
+// Returns -1 on error or EOF, 1 if the input buffer filled up, 0 once the socket is drained
+// The buffer only grows as far as the request at its front still needs.
+int read_input(Connection *conn) {
+    for (;;) {
+        HttpRequest *request = &conn->request;
+        size_t wanted = conn->in_start + (conn->bulk.kind != BULK_NONE ? BULK_BUFFER_BYTES
+                                          : request->header_len ? request->total_len + 1 : MAX_HEADER_BYTES + 1);
+        if (conn->in.len == conn->in.cap) {
+            if (conn->in.cap >= wanted) return 1;
+            buffer_reserve(&conn->in, conn->in.cap ? conn->in.cap : BUFFER_SIZE);
+        }
+        
+        ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        conn->in.len += n;
+        touch_connection(conn);
+    }
+}
+
+void handle_connection_event(Connection *conn, uint32_t events) {
+    if (conn->closed) return;
+    if (events & EPOLLERR) {
+        close_connection(conn);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) conn->read_pending = 1;
+    
+    for (;;) {
+        if (conn->read_pending && !conn->peer_closed) {
+            int status = read_input(conn);
+            if (status < 0) conn->peer_closed = 1;
+            conn->read_pending = (status == 1);
+        }
+        
+        size_t consumed = process_input(conn);
+        if (flush_output(conn) < 0) {
+            close_connection(conn);
+            return;
+        }
+        // A peer that hung up still gets answers to whatever complete requests it sent first
+        if (!output_pending(conn) && conn->stream.kind == STREAM_NONE &&
+            (conn->close_after_write || (conn->peer_closed && consumed == 0))) {
+            close_connection(conn);
+            return;
+        }
+        
+        // Edge-triggered: loop while consuming input made room for unread socket data or more pipelined
+        // requests, or while a streamed response has drained and can produce its next chunk
+        if (consumed > 0 && (conn->read_pending || !output_pending(conn))) continue;
+        if (conn->stream.kind != STREAM_NONE && !output_pending(conn)) continue;
+        break;
+    }
+}
+
+int workers_started = 0;
+
+void wake_worker(Worker *worker) {
+    uint64_t one = 1;
+    if (write(worker->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write failed");
+}
+
+void notify_workers() {
+    int started = __atomic_load_n(&workers_started, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < started; i++) {
+        if (__atomic_load_n(&workers[i].waiting, __ATOMIC_SEQ_CST)) wake_worker(&workers[i]);
+    }
+}
+
+void notify_subscribers() {
+    int started = __atomic_load_n(&workers_started, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < started; i++) {
+        if (__atomic_load_n(&workers[i].subscribers, __ATOMIC_SEQ_CST)) wake_worker(&workers[i]);
+    }
+}
+
+// Send the held responses whose log entries are now durable
+void release_durable_connections(Worker *worker) {
+    uint64_t durable = __atomic_load_n(&wal.durable_lsn, __ATOMIC_SEQ_CST);
+    Connection *head = &worker->wait_head;
+    for (Connection *conn = head->wait_next; conn != head;) {
+        Connection *next = conn->wait_next;
+        if (conn->wait_lsn <= durable) handle_connection_event(conn, 0);
+        conn = next;
+    }
+}
+
+// Push newly published events to this worker's subscribers, dropping any that stopped reading (runs
+// inside an event batch, so a dropped subscriber is only freed after it)
+void deliver_events(Worker *worker) {
+    Connection *head = &worker->event_head;
+    for (Connection *conn = head->subscription.next; conn != head;) {
+        Connection *next = conn->subscription.next;
+        read_begin();
+        subscription_fill(conn);
+        read_end();
+        if (conn->out.len - conn->out_sent > OUTPUT_HIGH_WATER) close_connection(conn);
+        else handle_connection_event(conn, 0);
+        conn = next;
+    }
+}
+
+// Comment lines keep quiet subscribers (and proxies in between) from timing out
+void send_heartbeats(Worker *worker) {
+    time_t now = time(NULL);
+    if (now - worker->last_heartbeat < (idle_timeout > 1 ? idle_timeout / 2 : 1)) return;
+    worker->last_heartbeat = now;
+    
+    Connection *head = &worker->event_head;
+    for (Connection *conn = head->subscription.next; conn != head;) {
+        Connection *next = conn->subscription.next;
+        buffer_append(&conn->out, ":\n\n", 3);
+        handle_connection_event(conn, 0);
+        conn = next;
     }
 }
 
+void handle_wake(Worker *worker) {
+    uint64_t count;
+    while (read(worker->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+    release_durable_connections(worker);
+    deliver_events(worker);
+}
+
+void accept_connections(Worker *worker) {
+    for (;;) {
+        int client_socket = accept4(worker->server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        
+        int opt = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(client_socket);
+            continue;
+        }
+        conn->fd = client_socket;
+        conn->worker = worker;
+        conn->keep_alive = 1;
+        conn->prev = conn->next = conn;
+        touch_connection(conn);
+        metric_add(&worker->metrics.connections, 1);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close_connection(conn);
+        }
+    }
+}
+
+// Dispatch one batch of epoll events. A wake can close connections whose own events come later
+// in the batch; handle_connection_event skips those, and they are freed after the batch.
+void handle_events(Worker *worker, const struct epoll_event *events, int n) {
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            accept_connections(worker);
+        } else if (events[i].data.ptr == worker) {
+            handle_wake(worker);
+        } else {
+            handle_connection_event(events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+void *worker_main(void *arg) {
+    Worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    thread_metrics = &worker->metrics;
+    
+    while (1) {
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        
+        handle_events(worker, events, n);
+        close_idle_connections(worker);
+        send_heartbeats(worker);
+        free_closed_connections(worker);
+    }
+    return NULL;
+}
+
+// Give the worker its own epoll instance; EPOLLEXCLUSIVE wakes only one worker per new connection
+int init_worker(Worker *worker, int id, int server_socket) {
+    worker->id = id;
+    worker->server_socket = server_socket;
+    worker->idle_head.prev = worker->idle_head.next = &worker->idle_head;
+    worker->wait_head.wait_prev = worker->wait_head.wait_next = &worker->wait_head;
+    worker->event_head.subscription.prev = worker->event_head.subscription.next = &worker->event_head;
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->epoll_fd < 0 || worker->wake_fd < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = worker;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    return 0;
+}
+
+int start_worker(Worker *worker, int id, int server_socket) {
+    if (init_worker(worker, id, server_socket) < 0) return -1;
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    __atomic_add_fetch(&workers_started, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p port] [-b backlog] [-t idle_timeout_seconds] [-w workers] [-d data_dir] [-m]\n"
+                    "       [-a archive_after_days (default %d; 0 archives discharged patients at once)]\n",
+            program, ARCHIVE_AGE_DAYS);
+}
+
 // Main server function
-int main() {
-    srand(time(NULL));
-    initialize_data();
+// The benchmarks in bench/ include this file for its functions and bring their own main
+#ifndef WORKFLOW_NO_MAIN
+int main(int argc, char *argv[]) {
+    int opt, archive_days = ARCHIVE_AGE_DAYS;
+    while ((opt = getopt(argc, argv, "p:b:t:w:d:a:mh")) != -1) {
+        switch (opt) {
+            case 'p': server_port = atoi(optarg); break;
+            case 'b': listen_backlog = atoi(optarg); break;
+            case 't': idle_timeout = atoi(optarg); break;
+            case 'w': worker_count = atoi(optarg); break;
+            case 'd': data_dir = optarg; break;
+            case 'a': archive_days = atoi(optarg); break;
+            case 'm': persistence = 0; break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (worker_count == 0) {
+        worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (worker_count < 1) worker_count = 1;
+        if (worker_count > MAX_WORKERS) worker_count = MAX_WORKERS;
+    }
+    if (server_port <= 0 || listen_backlog <= 0 || idle_timeout <= 0 ||
+        worker_count < 1 || worker_count > MAX_WORKERS || archive_days < 0) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    archive_age = (int64_t)archive_days * 86400;
+    
+    signal(SIGPIPE, SIG_IGN);
+    crc32_init();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    change_base = change_seq = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if (start_access_log() < 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+    if (persistence) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        recover_storage();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Recovered %u patients and %u clinical actions from %s/ in %.0f ms\n",
+               store_count(&patientStore), store_count(&actionStore), data_dir,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        uint64_t archived_patients, archived_actions, archive_bytes;
+        uint32_t segments = archive_totals(&archived_patients, &archived_actions, &archive_bytes);
+        if (segments) {
+            printf("%u archive segments hold %llu more patients and %llu clinical actions\n", segments,
+                   (unsigned long long)archived_patients, (unsigned long long)archived_actions);
+        }
+    }
+    // A new data directory starts from the sample data, which is logged like any other write
+    if (store_count(&patientStore) == 0) initialize_data();
+    if (persistence) {
+        pthread_t wal_thread, snapshot_thread;
+        if (pthread_create(&wal_thread, NULL, wal_main, NULL) != 0 ||
+            pthread_create(&snapshot_thread, NULL, snapshot_main, NULL) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    render_static_response(&indexPage, "text/html; charset=utf-8", get_html_template());
     
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
+    int server_socket;
+    struct sockaddr_in server_addr;
     
     // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         perror("Socket creation failed");
         exit(1);
     }
     
     // Set socket options
-    int opt = 1;
+    opt = 1;
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     
     // Configure server address
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(server_port);
     
     // Bind socket
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -548,45 +7194,25 @@ int main() {
     }
     
     // Listen for connections
-    listen(server_socket, 5);
+    if (listen(server_socket, listen_backlog) < 0) {
+        perror("Listen failed");
+        exit(1);
+    }
     
     printf("Patient-Centric Clinical Workflow System (C Version)\n");
-    printf("Server running on http://localhost:%d\n", PORT);
+    printf("Server running on http://localhost:%d\n", server_port);
+    printf("Listen backlog %d, keep-alive idle timeout %ds, %d worker threads\n",
+           listen_backlog, idle_timeout, worker_count);
     printf("Press Ctrl+C to stop\n\n");
     
-    while (1) {
-        // Accept connection
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
-        }
-        
-        // Read request
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_read > 0) {
-            // Parse HTTP request
-            char method[10], path[256], *body_start = NULL;
-            buffer[bytes_read] = '\0';
-            
-            // Extract method and path
-            sscanf(buffer, "%9s %255s", method, path);
-            
-            // Find body (if any)
-            body_start = strstr(buffer, "\r\n\r\n");
-            if (body_start) {
-                body_start += 4;
-            }
-            
-            // Handle request
-            handle_request(client_socket, method, path, body_start ? body_start : "");
-        }
-        
-        // Close connection
-        close(client_socket);
+    for (int i = 0; i < worker_count; i++) {
+        if (start_worker(&workers[i], i, server_socket) < 0) exit(1);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
     
     close(server_socket);
     return 0;
-}
\ No newline at end of file
+}
+#endif